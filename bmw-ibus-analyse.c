@@ -0,0 +1,817 @@
+/**
+ *   Offline analyser for bus captures of BMW IBus Daemon (-c). Decodes the
+ *   capture with the parser of the daemon on all cores and prints message
+ *   counts per bus, device and message, vehicle value ranges and the
+ *   timeline of vehicle and radio state changes.
+ *
+ *   Capture is split to chunks at record boundaries. Every chunk is decoded
+ *   on its own: the parser synchronizes to the first valid frame of the
+ *   chunk and owns the frames that start in it, continuing over the chunk
+ *   end to complete the last one. First frames of a chunk are kept aside
+ *   and when the chunks are merged only the ones at or after the frame the
+ *   previous chunk ended to are counted, so a chunk synchronized to a false
+ *   frame does not count anything twice.
+ *
+ *   Copyright (C) 2012 Kari Suvanto karis79@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* parser, decoding and capture format are shared with the daemon */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define IBUS_NO_MAIN
+#include "bmw-ibus.c"
+
+
+#define ANALYSE_DEFAULT_CHUNK_MB 16
+#define ANALYSE_MAX_CHUNK_MB 1024 /*bus offsets in the ring are 32 bit*/
+#define ANALYSE_HEAD_FRAMES 16 /*frames per bus kept aside at chunk start*/
+
+/* timeline has the vehicle fields with few values and the radio state */
+#define ANALYSE_RADIO_STATE EVehicleFieldCount
+#define ANALYSE_FIELD_COUNT (EVehicleFieldCount+1)
+#define ANALYSE_TIMELINE_FIELDS (1<<EVehicleIgnition | 1<<EVehicleDoors | 1<<EVehicleWindows | \
+                                 1<<EVehicleLamps | 1<<ANALYSE_RADIO_STATE)
+
+static const char *analyse_state_names[] = { "UNKNOWN", "POWEROFF", "MENU", "FM", "TAPE", "AUX", "CDCHANGER" };
+
+/* counters, one set per worker, summed at the end */
+struct analyse_totals {
+    struct ibus_ingest_stats stats[IBUS_MAX_BUSES];
+    uint64_t frames[IBUS_MAX_BUSES][256]; /*by sender, D-Bus by address*/
+    uint64_t bytes[IBUS_MAX_BUSES][256];
+    uint64_t messages[IBUS_MAX_BUSES][256][256]; /*by sender and message, D-Bus by address and command*/
+    int32_t min[EVehicleFieldCount];
+    int32_t max[EVehicleFieldCount];
+    unsigned int seen; /*fields received*/
+};
+
+struct analyse_event {
+    uint64_t time; /*us from the start of the capture*/
+    uint64_t offset; /*bus stream offset of the frame*/
+    uint8_t bus;
+    uint8_t field;
+    int32_t value;
+};
+
+struct analyse_timeline {
+    struct analyse_event *events;
+    size_t count;
+    size_t capacity;
+};
+
+/* last timeline value of every field of every bus */
+struct analyse_last {
+    int32_t value[IBUS_MAX_BUSES][ANALYSE_FIELD_COUNT];
+    unsigned int known[IBUS_MAX_BUSES];
+};
+
+struct analyse_frame {
+    uint64_t time;
+    uint64_t offset;
+    uint16_t length;
+    unsigned char data[257]; /*EMaximumMessageLength*/
+};
+
+struct analyse_chunk {
+    size_t start; /*file offset of the first record*/
+    size_t end;
+    uint64_t time; /*us at the start*/
+    uint64_t offset[IBUS_MAX_BUSES]; /*bus stream offset at the start*/
+    /*results*/
+    uint64_t handoff[IBUS_MAX_BUSES]; /*first frame the chunk did not own*/
+    int handed_off[IBUS_MAX_BUSES];
+    struct analyse_frame *head; /*ANALYSE_HEAD_FRAMES per bus*/
+    unsigned int head_count[IBUS_MAX_BUSES];
+    struct analyse_timeline timeline;
+};
+
+struct analyse_capture {
+    const char *path;
+    const unsigned char *map;
+    size_t map_size;
+    size_t size; /*up to the end of the last valid record*/
+    size_t record_size; /*header size of the records*/
+    struct capture_reader reader;
+    uint64_t start; /*ns, CLOCK_REALTIME*/
+    uint64_t duration; /*us*/
+    uint64_t bus_bytes[IBUS_MAX_BUSES];
+    struct analyse_chunk *chunks;
+    unsigned int chunk_count;
+    unsigned int next_chunk; /*taken by the workers*/
+};
+
+/* decoding state of one bus within a chunk */
+struct analyse_bus {
+    struct ibus_parser rx;
+    struct ibus_ingest_stats scratch; /*stats while synchronizing and after handoff*/
+    uint64_t offset; /*stream offset of the ring start*/
+    uint64_t end; /*stream offset where the next chunk starts*/
+    uint64_t last_time;
+    int syncing; /*frames go to the chunk head*/
+    int handed_off;
+};
+
+struct analyse_worker {
+    pthread_t thread;
+    struct analyse_capture *capture;
+    struct analyse_totals *totals;
+    struct analyse_bus buses[IBUS_MAX_BUSES];
+    struct analyse_last last;
+    struct analyse_chunk *chunk;
+    uint64_t time; /*us of the record being decoded*/
+};
+
+static size_t analyse_chunk_size = (size_t)ANALYSE_DEFAULT_CHUNK_MB<<20;
+static unsigned int analyse_threads;
+static int analyse_print_timeline = 0;
+
+/******************************************************************************
+ * decoding
+ *****************************************************************************/
+static void analyse_event_add(struct analyse_timeline *timeline, unsigned int bus, unsigned int field,
+    int32_t value, uint64_t time, uint64_t offset)
+{
+    struct analyse_event *event;
+
+    if(timeline->count == timeline->capacity) {
+        timeline->capacity = timeline->capacity ? timeline->capacity*2 : 256;
+        timeline->events = realloc(timeline->events, timeline->capacity*sizeof(*event));
+        if(!timeline->events) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    event = &timeline->events[timeline->count++];
+    event->time = time;
+    event->offset = offset;
+    event->bus = bus;
+    event->field = field;
+    event->value = value;
+}
+
+/* adds field to the timeline if it changed, every value goes there without last */
+static void analyse_observe(struct analyse_timeline *timeline, struct analyse_last *last, unsigned int bus,
+    unsigned int field, int32_t value, uint64_t time, uint64_t offset)
+{
+    if(last) {
+        if(last->known[bus] & 1<<field && last->value[bus][field] == value)
+            return;
+        last->known[bus] |= 1<<field;
+        last->value[bus][field] = value;
+    }
+    analyse_event_add(timeline, bus, field, value, time, offset);
+}
+
+/* counts one valid frame and decodes the state it tells */
+static void analyse_message(struct analyse_totals *totals, struct analyse_timeline *timeline, struct analyse_last *last,
+    unsigned int bus, enum EIbusBusType type, const unsigned char *msg, unsigned int length, uint64_t time, uint64_t offset)
+{
+    int32_t values[EVehicleFieldCount];
+    unsigned char sender,message;
+    unsigned int fields,field;
+    enum EIbusState state;
+
+    if(type == EBusDBus) {
+        sender = msg[0];
+        message = length > 3 ? msg[2] : 0;
+    }
+    else {
+        sender = get_sender(msg);
+        message = get_message(msg);
+    }
+    totals->stats[bus].messages++;
+    totals->frames[bus][sender]++;
+    totals->bytes[bus][sender] += length;
+    totals->messages[bus][sender][message]++;
+    if(type == EBusDBus)
+        return;
+
+    fields = ibus_vehicle_decode(msg, values);
+    for(field = 0; field < EVehicleFieldCount; field++) {
+        if(!(fields & 1<<field))
+            continue;
+        if(!(totals->seen & 1<<field) || values[field] < totals->min[field])
+            totals->min[field] = values[field];
+        if(!(totals->seen & 1<<field) || values[field] > totals->max[field])
+            totals->max[field] = values[field];
+        totals->seen |= 1<<field;
+        if(ANALYSE_TIMELINE_FIELDS & 1<<field)
+            analyse_observe(timeline, last, bus, field, values[field], time, offset);
+    }
+
+    state = ibus_radio_state(msg);
+    if(state != EStateUnknown)
+        analyse_observe(timeline, last, bus, ANALYSE_RADIO_STATE, state, time, offset);
+}
+
+/*
+ * Frame of the chunk being decoded. Frames starting after the chunk belong
+ * to the next one, the first of them tells where the next chunk has to
+ * continue.
+ */
+static void analyse_bus_message(struct analyse_worker *worker, unsigned int idx, const unsigned char *msg, unsigned int length)
+{
+    struct analyse_bus *bus = &worker->buses[idx];
+    struct analyse_chunk *chunk = worker->chunk;
+    struct analyse_frame *frame;
+    uint64_t offset = bus->offset + bus->rx.ring.tail;
+
+    if(bus->handed_off)
+        return;
+    if(offset >= bus->end) {
+        bus->handed_off = 1;
+        bus->rx.stats = &bus->scratch;
+        chunk->handed_off[idx] = 1;
+        chunk->handoff[idx] = offset;
+        return;
+    }
+
+    if(bus->syncing) {
+        /*synchronized, count resyncs from now on*/
+        bus->rx.stats = &worker->totals->stats[idx];
+        frame = &chunk->head[idx*ANALYSE_HEAD_FRAMES + chunk->head_count[idx]];
+        frame->time = worker->time;
+        frame->offset = offset;
+        frame->length = length;
+        memcpy(frame->data, msg, length);
+        if(++chunk->head_count[idx] == ANALYSE_HEAD_FRAMES)
+            bus->syncing = 0;
+        return;
+    }
+
+    analyse_message(worker->totals, &chunk->timeline, &worker->last, idx,
+        worker->capture->reader.buses.types[idx], msg, length, worker->time, offset);
+}
+
+/* same as process_ibus_data of the daemon */
+static void analyse_bus_data(struct analyse_worker *worker, unsigned int idx)
+{
+    struct ibus_parser *rx = &worker->buses[idx].rx;
+    unsigned int length = 0;
+    enum EIbusParseResult res;
+
+    res = ibus_parse_next(rx, &length);
+    while(res != EParseNeedMore) {
+        if(res == EParseMessage) {
+            if(rx->resyncing) {
+                if((int)(rx->recover_until - rx->ring.tail) > 0)
+                    rx->stats->recovered++;
+                else
+                    rx->resyncing = 0;
+            }
+            analyse_bus_message(worker, idx, ibus_ring_message(&rx->ring, length), length);
+            ibus_parser_consume(rx, length);
+            res = ibus_parse_next(rx, &length);
+            continue;
+        }
+        res = ibus_resync(rx, &length);
+    }
+}
+
+/* same as process_ibus_idle of the daemon */
+static void analyse_bus_idle(struct analyse_worker *worker, unsigned int idx)
+{
+    struct ibus_parser *rx = &worker->buses[idx].rx;
+    unsigned int length;
+
+    rx->stats->idle_timeouts++;
+    ibus_resync(rx, &length);
+    analyse_bus_data(worker, idx);
+}
+
+/* reads record at file offset pos, returns offset of the next record */
+static size_t analyse_record(const struct analyse_capture *capture, size_t pos, struct capture_record_header *record)
+{
+    record->bus = 0;
+    memcpy(record, &capture->map[pos], capture->record_size);
+    return pos + capture->record_size + record->length;
+}
+
+/*
+ * Decodes the records of the chunk and the records after it until every bus
+ * has reached a frame of the next chunk, at most to the end of the next chunk.
+ */
+static void analyse_chunk(struct analyse_worker *worker, struct analyse_chunk *chunk)
+{
+    const struct analyse_capture *capture = worker->capture;
+    unsigned int index = chunk - capture->chunks;
+    const struct analyse_chunk *next = index+1 < capture->chunk_count ? chunk+1 : 0;
+    struct capture_record_header record;
+    struct analyse_bus *bus;
+    size_t pos,record_pos,limit;
+    uint64_t gap_ns,timeout_ns;
+    unsigned int i,done,data_pos;
+
+    chunk->head = malloc(capture->reader.buses.count*ANALYSE_HEAD_FRAMES*sizeof(*chunk->head));
+    if(!chunk->head) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    worker->chunk = chunk;
+    worker->time = chunk->time;
+    memset(&worker->last, 0, sizeof(worker->last));
+    for(i = 0; i < capture->reader.buses.count; i++) {
+        bus = &worker->buses[i];
+        memset(bus, 0, sizeof(*bus));
+        /*first chunk starts at the start of the capture like the daemon does*/
+        bus->syncing = index > 0;
+        ibus_parser_init(&bus->rx, capture->reader.buses.types[i],
+            bus->syncing ? &bus->scratch : &worker->totals->stats[i]);
+        bus->offset = chunk->offset[i];
+        bus->end = next ? next->offset[i] : UINT64_MAX;
+        bus->last_time = chunk->time;
+    }
+
+    limit = next ? next->end : capture->size;
+    for(pos = chunk->start; pos < limit; ) {
+        record_pos = pos;
+        pos = analyse_record(capture, pos, &record);
+        worker->time += record.delta;
+        bus = &worker->buses[record.bus];
+
+        if(record_pos >= chunk->end) {
+            for(i = 0, done = 1; i < capture->reader.buses.count; i++)
+                done &= worker->buses[i].handed_off;
+            if(done)
+                break;
+            if(bus->handed_off)
+                continue;
+        }
+        else {
+            worker->totals->stats[record.bus].wakeups++;
+            worker->totals->stats[record.bus].reads++;
+            worker->totals->stats[record.bus].bytes += record.length;
+        }
+
+        /*line was idle while message was incomplete*/
+        gap_ns = (worker->time - bus->last_time)*1000;
+        bus->last_time = worker->time;
+        while(ibus_ring_count(&bus->rx.ring)) {
+            timeout_ns = (ibus_parse_needed(&bus->rx)+2)*IBUS_CHAR_TIME_NS;
+            if(gap_ns <= timeout_ns)
+                break;
+            gap_ns -= timeout_ns;
+            analyse_bus_idle(worker, record.bus);
+        }
+
+        for(data_pos = 0; data_pos < record.length; ) {
+            data_pos += ibus_ring_put(&bus->rx.ring, &capture->map[pos-record.length+data_pos], record.length-data_pos);
+            analyse_bus_data(worker, record.bus);
+        }
+    }
+
+    /*end of capture, lines stay idle*/
+    if(pos >= capture->size) {
+        for(i = 0; i < capture->reader.buses.count; i++) {
+            while(ibus_ring_count(&worker->buses[i].rx.ring))
+                analyse_bus_idle(worker, i);
+        }
+    }
+}
+
+static void* analyse_worker_run(void *arg)
+{
+    struct analyse_worker *worker = arg;
+    struct analyse_capture *capture = worker->capture;
+    unsigned int index;
+
+    for(;;) {
+        index = __atomic_fetch_add(&capture->next_chunk, 1, __ATOMIC_RELAXED);
+        if(index >= capture->chunk_count)
+            break;
+        analyse_chunk(worker, &capture->chunks[index]);
+    }
+    return 0;
+}
+
+/******************************************************************************
+ * capture
+ *****************************************************************************/
+/*
+ * Maps the capture and splits it to chunks of about analyse_chunk_size at
+ * record boundaries. Only the record headers are read here.
+ * Returns 0 or negative errno.
+ */
+static int analyse_open(struct analyse_capture *capture, const char *path)
+{
+    struct capture_file_header header;
+    struct capture_record_header record;
+    struct analyse_chunk *chunk;
+    struct stat st;
+    unsigned int capacity = 0;
+    uint64_t time = 0;
+    size_t pos;
+    void *map;
+    int fd,res;
+
+    memset(capture, 0, sizeof(*capture));
+    capture->path = path;
+    res = capture_open_read(&capture->reader, path);
+    if(res < 0)
+        return res;
+    pos = ftell(capture->reader.fp);
+    rewind(capture->reader.fp);
+    if(fread(&header, sizeof(header), 1, capture->reader.fp) != 1) {
+        capture_close_read(&capture->reader);
+        return -EIO;
+    }
+    capture->start = header.start;
+    capture->record_size = capture->reader.version == 1 ?
+        offsetof(struct capture_record_header, bus) : sizeof(struct capture_record_header);
+
+    fd = fileno(capture->reader.fp);
+    if(fstat(fd, &st) < 0)
+        goto err;
+    capture->map_size = capture->size = st.st_size;
+    map = mmap(0, capture->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+        goto err;
+    capture->map = map;
+    madvise(map, capture->map_size, MADV_SEQUENTIAL);
+
+    while(pos + capture->record_size <= capture->size) {
+        if(!capture->chunk_count || pos - capture->chunks[capture->chunk_count-1].start >= analyse_chunk_size) {
+            if(capture->chunk_count == capacity) {
+                capacity = capacity ? capacity*2 : 64;
+                capture->chunks = realloc(capture->chunks, capacity*sizeof(*chunk));
+                if(!capture->chunks) {
+                    errno = ENOMEM;
+                    goto err;
+                }
+            }
+            if(capture->chunk_count)
+                capture->chunks[capture->chunk_count-1].end = pos;
+            chunk = &capture->chunks[capture->chunk_count++];
+            memset(chunk, 0, sizeof(*chunk));
+            chunk->start = pos;
+            chunk->time = time;
+            memcpy(chunk->offset, capture->bus_bytes, sizeof(chunk->offset));
+        }
+        analyse_record(capture, pos, &record);
+        if(record.length > IBUS_RING_SIZE || record.bus >= capture->reader.buses.count ||
+           pos + capture->record_size + record.length > capture->size) {
+            fprintf(stderr, "%s: truncated or corrupted at %zu, analysing up to it\n", path, pos);
+            break;
+        }
+        time += record.delta;
+        capture->bus_bytes[record.bus] += record.length;
+        pos += capture->record_size + record.length;
+    }
+    if(capture->chunk_count)
+        capture->chunks[capture->chunk_count-1].end = pos;
+    /*records after a corrupted one are not decoded*/
+    capture->size = pos;
+    capture->duration = time;
+    return 0;
+
+err:
+    res = -errno;
+    if(capture->map)
+        munmap((void*)capture->map, capture->map_size);
+    capture_close_read(&capture->reader);
+    free(capture->chunks);
+    return res;
+}
+
+static void analyse_close(struct analyse_capture *capture)
+{
+    unsigned int i;
+
+    for(i = 0; i < capture->chunk_count; i++) {
+        free(capture->chunks[i].head);
+        free(capture->chunks[i].timeline.events);
+    }
+    free(capture->chunks);
+    munmap((void*)capture->map, capture->map_size);
+    capture_close_read(&capture->reader);
+}
+
+/******************************************************************************
+ * merge and report
+ *****************************************************************************/
+static void analyse_sum(struct analyse_totals *to, const struct analyse_totals *from)
+{
+    unsigned int bus,sender,message,field;
+
+    for(bus = 0; bus < IBUS_MAX_BUSES; bus++) {
+        to->stats[bus].wakeups += from->stats[bus].wakeups;
+        to->stats[bus].reads += from->stats[bus].reads;
+        to->stats[bus].bytes += from->stats[bus].bytes;
+        to->stats[bus].messages += from->stats[bus].messages;
+        to->stats[bus].idle_timeouts += from->stats[bus].idle_timeouts;
+        to->stats[bus].resyncs += from->stats[bus].resyncs;
+        to->stats[bus].skipped_bytes += from->stats[bus].skipped_bytes;
+        to->stats[bus].recovered += from->stats[bus].recovered;
+        for(sender = 0; sender < 256; sender++) {
+            if(!from->frames[bus][sender])
+                continue;
+            to->frames[bus][sender] += from->frames[bus][sender];
+            to->bytes[bus][sender] += from->bytes[bus][sender];
+            for(message = 0; message < 256; message++)
+                to->messages[bus][sender][message] += from->messages[bus][sender][message];
+        }
+    }
+    for(field = 0; field < EVehicleFieldCount; field++) {
+        if(!(from->seen & 1<<field))
+            continue;
+        if(!(to->seen & 1<<field) || from->min[field] < to->min[field])
+            to->min[field] = from->min[field];
+        if(!(to->seen & 1<<field) || from->max[field] > to->max[field])
+            to->max[field] = from->max[field];
+        to->seen |= 1<<field;
+    }
+}
+
+/*
+ * Counts the kept aside frames of every chunk that are at or after the
+ * frame the previous chunk ended to. Returns number of chunk boundaries
+ * where the chunks did not agree on frame boundary.
+ */
+static unsigned int analyse_merge_heads(const struct analyse_capture *capture, struct analyse_totals *totals,
+    struct analyse_timeline *timeline)
+{
+    const struct analyse_chunk *chunk,*prev;
+    const struct analyse_frame *frame;
+    unsigned int i,bus,j,matched,mismatches = 0;
+    uint64_t handoff;
+
+    for(i = 1; i < capture->chunk_count; i++) {
+        chunk = &capture->chunks[i];
+        prev = &capture->chunks[i-1];
+        for(bus = 0; bus < capture->reader.buses.count; bus++) {
+            if(!chunk->head_count[bus])
+                continue;
+            handoff = prev->handed_off[bus] ? prev->handoff[bus] : chunk->offset[bus];
+            matched = !prev->handed_off[bus];
+            for(j = 0; j < chunk->head_count[bus]; j++) {
+                frame = &chunk->head[bus*ANALYSE_HEAD_FRAMES + j];
+                if(frame->offset < handoff)
+                    continue;
+                matched |= frame->offset == handoff;
+                analyse_message(totals, timeline, 0, bus, capture->reader.buses.types[bus],
+                    frame->data, frame->length, frame->time, frame->offset);
+            }
+            if(!matched)
+                mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+static int analyse_event_compare(const void *a, const void *b)
+{
+    const struct analyse_event *x = a, *y = b;
+
+    if(x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    if(x->bus != y->bus)
+        return x->bus < y->bus ? -1 : 1;
+    if(x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return (int)x->field - (int)y->field;
+}
+
+static const char* analyse_field_name(unsigned int field)
+{
+    return field == ANALYSE_RADIO_STATE ? "radio" : ibus_vehicle_field_names[field];
+}
+
+/* timeline of all chunks in capture order, values that did not change are dropped */
+static void print_timeline(const struct analyse_capture *capture, const struct analyse_timeline *heads)
+{
+    struct analyse_timeline all;
+    struct analyse_last last;
+    const struct analyse_event *event;
+    unsigned int i;
+    size_t n;
+
+    memset(&all, 0, sizeof(all));
+    memset(&last, 0, sizeof(last));
+    for(i = 0; i <= capture->chunk_count; i++) {
+        const struct analyse_timeline *timeline = i < capture->chunk_count ? &capture->chunks[i].timeline : heads;
+        for(n = 0; n < timeline->count; n++) {
+            event = &timeline->events[n];
+            analyse_event_add(&all, event->bus, event->field, event->value, event->time, event->offset);
+        }
+    }
+    qsort(all.events, all.count, sizeof(*all.events), analyse_event_compare);
+
+    printf("timeline:\n");
+    for(n = 0; n < all.count; n++) {
+        event = &all.events[n];
+        if(last.known[event->bus] & 1<<event->field && last.value[event->bus][event->field] == event->value)
+            continue;
+        last.known[event->bus] |= 1<<event->field;
+        last.value[event->bus][event->field] = event->value;
+
+        printf("  %12.6f %s %-8s ", event->time/1000000.0,
+            ibus_bus_names[capture->reader.buses.types[event->bus]], analyse_field_name(event->field));
+        if(event->field == ANALYSE_RADIO_STATE)
+            printf("%s\n", analyse_state_names[event->value]);
+        else
+            printf("%02x\n", event->value);
+    }
+    free(all.events);
+}
+
+static void print_report(const struct analyse_capture *capture, const struct analyse_totals *totals)
+{
+    static const char *units[EVehicleFieldCount] = { "", "km/h", "rpm", "C", "C", "km", "", "", "" };
+    const struct ibus_ingest_stats *stats;
+    const char *name;
+    unsigned int bus,sender,message,field;
+    int dbus;
+
+    printf("%s: %u buses, %.3f s, %u chunks\n", capture->path, capture->reader.buses.count,
+        capture->duration/1000000.0, capture->chunk_count);
+    for(bus = 0; bus < capture->reader.buses.count; bus++) {
+        stats = &totals->stats[bus];
+        printf("bus %u %s: %lu bytes, %lu messages, %lu idle timeouts, %lu resyncs, %lu bytes skipped, %lu messages recovered\n",
+            bus, ibus_bus_names[capture->reader.buses.types[bus]], stats->bytes, stats->messages,
+            stats->idle_timeouts, stats->resyncs, stats->skipped_bytes, stats->recovered);
+    }
+
+    printf("devices:\n");
+    for(bus = 0; bus < capture->reader.buses.count; bus++) {
+        dbus = capture->reader.buses.types[bus] == EBusDBus;
+        for(sender = 0; sender < 256; sender++) {
+            if(!totals->frames[bus][sender])
+                continue;
+            name = dbus ? "DS2" : IBUSDevices[sender];
+            printf("  %u %-6s %02x %-42s %10llu frames %12llu bytes\n", bus, ibus_bus_names[capture->reader.buses.types[bus]],
+                sender, name, (unsigned long long)totals->frames[bus][sender],
+                (unsigned long long)totals->bytes[bus][sender]);
+        }
+    }
+
+    printf("messages:\n");
+    for(bus = 0; bus < capture->reader.buses.count; bus++) {
+        dbus = capture->reader.buses.types[bus] == EBusDBus;
+        for(sender = 0; sender < 256; sender++) {
+            if(!totals->frames[bus][sender])
+                continue;
+            for(message = 0; message < 256; message++) {
+                if(!totals->messages[bus][sender][message])
+                    continue;
+                printf("  %u %02x %02x %10llu %s\n", bus, sender, message,
+                    (unsigned long long)totals->messages[bus][sender][message],
+                    dbus ? "" : IBUSMessages[message]);
+            }
+        }
+    }
+
+    printf("vehicle:\n");
+    for(field = 0; field < EVehicleFieldCount; field++) {
+        if(!(totals->seen & 1<<field) || ANALYSE_TIMELINE_FIELDS & 1<<field)
+            continue;
+        printf("  %-20s %d..%d %s\n", ibus_vehicle_field_names[field],
+            totals->min[field], totals->max[field], units[field]);
+    }
+}
+
+/*
+ * Decodes the capture with the workers and prints the report.
+ * Returns 0 or negative errno.
+ */
+static int analyse_capture(const char *path)
+{
+    struct analyse_capture capture;
+    struct analyse_worker *workers;
+    struct analyse_totals *totals;
+    struct analyse_timeline heads;
+    struct timespec start,end;
+    unsigned int i,threads,mismatches;
+    double wall;
+    int res;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res = analyse_open(&capture, path);
+    if(res < 0)
+        return res;
+
+    threads = analyse_threads < capture.chunk_count ? analyse_threads : capture.chunk_count;
+    if(threads == 0)
+        threads = 1;
+    workers = calloc(threads, sizeof(*workers));
+    /*last one collects the kept aside frames*/
+    totals = calloc(threads+1, sizeof(*totals));
+    if(!workers || !totals) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for(i = 0; i < threads; i++) {
+        workers[i].capture = &capture;
+        workers[i].totals = &totals[i];
+        res = pthread_create(&workers[i].thread, 0, analyse_worker_run, &workers[i]);
+        if(res != 0) {
+            fprintf(stderr, "Can't create thread: %s\n", strerror(res));
+            exit(1);
+        }
+    }
+    for(i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, 0);
+
+    memset(&heads, 0, sizeof(heads));
+    mismatches = analyse_merge_heads(&capture, &totals[threads], &heads);
+    for(i = 0; i < threads; i++)
+        analyse_sum(&totals[threads], &totals[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    print_report(&capture, &totals[threads]);
+    if(analyse_print_timeline)
+        print_timeline(&capture, &heads);
+    printf("\n");
+    fflush(stdout);
+
+    wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1000000000.0;
+    fprintf(stderr, "%s: %zu bytes in %.3f s with %u threads, %.1f MB/s, %u chunk boundaries resynchronized differently\n",
+        path, capture.size, wall, threads, wall > 0 ? capture.size/wall/1000000.0 : 0.0, mismatches);
+
+    free(heads.events);
+    free(totals);
+    free(workers);
+    analyse_close(&capture);
+    return 0;
+}
+
+static void print_help(char* name)
+{
+	fprintf(stderr, "Usage: %s <options> <capture files>\n",name);
+	fprintf(stderr, "-j <threads> decode with threads, default is number of cores\n");
+	fprintf(stderr, "-s <MB> chunk size, default %d\n", ANALYSE_DEFAULT_CHUNK_MB);
+	fprintf(stderr, "-t print timeline of ignition, doors, windows, lamps and radio state\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "example: %s -t ~/capture.bin > ~/capture.txt\n",name);
+	fprintf(stderr, "\n");
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned long chunk_mb;
+    long cores;
+    int opt,res,i;
+    int ret = 0;
+
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    analyse_threads = cores > 0 ? cores : 1;
+
+    while ((opt = getopt(argc, argv, "j:s:t")) != -1) {
+        switch (opt) {
+        case 'j':
+            analyse_threads = strtoul(optarg, 0, 0);
+            if(analyse_threads == 0) {
+                print_help(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            chunk_mb = strtoul(optarg, 0, 0);
+            if(chunk_mb == 0 || chunk_mb > ANALYSE_MAX_CHUNK_MB) {
+                fprintf(stderr, "chunk size must be 1..%d MB\n", ANALYSE_MAX_CHUNK_MB);
+                return 1;
+            }
+            analyse_chunk_size = chunk_mb<<20;
+            break;
+        case 't':
+            analyse_print_timeline = 1;
+            break;
+        default: /* '?' */
+            print_help(argv[0]);
+            return 1;
+        }
+    }
+    if(optind == argc) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    /*shared tables are built before the workers start*/
+    ibus_select_kernels();
+    ibus_init_known_devices();
+    if(ibus_build_text_matcher() < 0) {
+        fprintf(stderr, "Can't build text matcher\n");
+        return 1;
+    }
+
+    for(i = optind; i < argc; i++) {
+        res = analyse_capture(argv[i]);
+        if(res < 0) {
+            fprintf(stderr, "Can't analyse %s: %s\n", argv[i], strerror(-res));
+            ret = 1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,689 @@
+/**
+ *   Throughput benchmark for the BMW IBus Daemon message path. Drives the
+ *   parser, dispatch, state detection and message printing over generated
+ *   traffic mixes and recorded captures (-c of the daemon). With -k the
+ *   checksum and resync scan kernels are measured on their own.
+ *
+ *   Copyright (C) 2012 Kari Suvanto karis79@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* benchmarked code is the daemon itself */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define IBUS_NO_MAIN
+#include "bmw-ibus.c"
+
+
+/* bytes handed to the parser at once, about what one read returns */
+#define BENCH_READ_SIZE 64
+#define BENCH_DEFAULT_FRAMES 100000
+#define BENCH_KERNEL_BYTES (64*1024*1024)
+#define BENCH_KERNEL_ROUNDS 8
+
+struct bench_corpus {
+    const char *name;
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+};
+
+enum EBenchStage
+    {
+    EStageParse = 0, /*framing, checksum and resynchronization*/
+    EStageDispatch, /*handlers and state detection*/
+    EStagePrint, /*message pretty printing*/
+    EStageInput, /*uinput write*/
+    EStageCount
+    };
+
+static const char *bench_stage_names[EStageCount] = { "parse", "dispatch", "print", "input" };
+
+/* per message latency of each stage in ns */
+static uint32_t *bench_samples[EStageCount];
+static size_t bench_sample_count;
+static size_t bench_sample_capacity;
+
+static unsigned int bench_random_state;
+static FILE *report;
+static struct ibus_bus *bench_bus;
+
+/******************************************************************************
+ * allocation counting, glibc only
+ *****************************************************************************/
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long bench_allocations;
+
+void *malloc(size_t size)
+{
+    bench_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    bench_allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    bench_allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+/******************************************************************************
+ * corpus generation
+ *****************************************************************************/
+/* xorshift, same corpus on every run and board */
+static unsigned int bench_random(unsigned int range)
+{
+    bench_random_state ^= bench_random_state << 13;
+    bench_random_state ^= bench_random_state >> 17;
+    bench_random_state ^= bench_random_state << 5;
+    return bench_random_state % range;
+}
+
+static void bench_append(struct bench_corpus *corpus, const unsigned char *data, size_t length)
+{
+    if(corpus->size + length > corpus->capacity) {
+        corpus->capacity = (corpus->size + length)*2;
+        corpus->data = realloc(corpus->data, corpus->capacity);
+        if(!corpus->data) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(&corpus->data[corpus->size], data, length);
+    corpus->size += length;
+}
+
+/* builds valid frame to out and returns its length */
+static unsigned int bench_frame(unsigned char *out, unsigned char sender, unsigned char receiver,
+                                unsigned char message, const unsigned char *data, unsigned int length)
+{
+    unsigned char checksum = 0;
+    unsigned int i;
+
+    out[EPosSender] = sender;
+    out[EPosLength] = length + 3;
+    out[EPosReceiver] = receiver;
+    out[EPosMessage] = message;
+    memcpy(&out[EPosDataStart], data, length);
+    for(i = 0; i < length + 4; i++)
+        checksum ^= out[i];
+    out[length + 4] = checksum;
+    return length + 5;
+}
+
+/* BMBT and MFL button presses, releases and knob turns */
+static unsigned int bench_button_frame(unsigned char *out)
+{
+    unsigned char data[2];
+    unsigned char button;
+
+    switch(bench_random(5)) {
+    case 0:
+    case 1:
+        do
+            button = bench_random(ButtonMenu+1);
+        while(button == ButtonRadioPower);
+        data[0] = button | (bench_random(2) ? ButtonRelease : 0);
+        return bench_frame(out, BMBT, RAD, BMBTB1, data, 1);
+    case 2:
+        data[0] = 0x00;
+        data[1] = ButtonSelectInTapeMode | (bench_random(2) ? ButtonRelease : 0);
+        return bench_frame(out, BMBT, RAD, BMBTB0, data, 2);
+    case 3:
+        data[0] = (1 + bench_random(3)) | (bench_random(2) ? ButtonMenuKnobClockwiseMask : 0);
+        return bench_frame(out, BMBT, GT, KNOB, data, 1);
+    default:
+        data[0] = (bench_random(2) ? MFL2ButtonChannelUp : MFL2ButtonChannelDown) |
+                  (bench_random(2) ? MFL2ButtonRelease : 0);
+        return bench_frame(out, MFL, RAD, MFLB2, data, 1);
+    }
+}
+
+/* radio display text, every pattern of the state detection and noise */
+static unsigned int bench_text_frame(unsigned char *out)
+{
+    static const char *texts[] = { "AUX", "TAPE A", "FM 101.1", "RDS", "REG", "MWA",
+                                    "CD 1-01", "TR 12 0:31", "NO DISC", "SCAN" };
+    unsigned char data[32];
+    unsigned int length,i;
+
+    data[0] = 0x62; /*layout RadioDisplay*/
+    data[1] = 0x30;
+    if(bench_random(4)) {
+        i = bench_random(sizeof(texts)/sizeof(texts[0]));
+        length = strlen(texts[i]);
+        memcpy(&data[2], texts[i], length);
+    }
+    else {
+        length = 1 + bench_random(20);
+        for(i = 0; i < length; i++)
+            data[2+i] = ' ' + bench_random(95);
+    }
+
+    switch(bench_random(8)) {
+    case 0:
+        data[0] = 0x01;
+        return bench_frame(out, RAD, GT, LCDC, data, 1);
+    case 1:
+    case 2:
+        data[1] = 0x01;
+        return bench_frame(out, RAD, GT, ST, data, length+2);
+    default:
+        return bench_frame(out, RAD, GT, UMID, data, length+2);
+    }
+}
+
+/* status traffic nobody has handler for, most of the real bus */
+static unsigned int bench_other_frame(unsigned char *out)
+{
+    static const unsigned char senders[] = { 0x80 /*IKE*/, 0xD0 /*LCM*/, 0xC8 /*TEL*/, 0x7F /*NAVE*/, 0x18 /*CDC*/ };
+    static const unsigned char messages[] = { 0x18, 0x19, 0x11, 0x13, 0x5B, 0x39, 0x02, 0x01 };
+    unsigned char data[16];
+    unsigned int length,i;
+
+    length = 1 + bench_random(sizeof(data));
+    for(i = 0; i < length; i++)
+        data[i] = bench_random(256);
+    return bench_frame(out, senders[bench_random(sizeof(senders))], GLO,
+                       messages[bench_random(sizeof(messages))], data, length);
+}
+
+static void bench_generate(struct bench_corpus *corpus, const char *mix, unsigned long frames)
+{
+    unsigned char frame[300],garbage[16];
+    unsigned int length,length_garbage,i;
+    unsigned long n;
+
+    corpus->name = mix;
+    bench_random_state = 0x12345678;
+    for(n = 0; n < frames; n++) {
+        if(strcmp(mix, "buttons") == 0)
+            length = bench_button_frame(frame);
+        else if(strcmp(mix, "text") == 0)
+            length = bench_text_frame(frame);
+        else {
+            switch(bench_random(4)) {
+            case 0:
+                length = bench_button_frame(frame);
+                break;
+            case 1:
+                length = bench_text_frame(frame);
+                break;
+            default:
+                length = bench_other_frame(frame);
+                break;
+            }
+        }
+
+        if(strcmp(mix, "corrupt") == 0) {
+            switch(bench_random(50)) {
+            case 0: /*bit error*/
+                frame[bench_random(length)] ^= 1 << bench_random(8);
+                break;
+            case 1: /*noise between messages*/
+                length_garbage = 1 + bench_random(sizeof(garbage));
+                for(i = 0; i < length_garbage; i++)
+                    garbage[i] = bench_random(256);
+                bench_append(corpus, garbage, length_garbage);
+                break;
+            case 2: /*collision cut the message*/
+                length = 1 + bench_random(length-1);
+                break;
+            }
+        }
+        bench_append(corpus, frame, length);
+    }
+}
+
+/*
+ * Concatenates received bytes of the first bus of the capture, timing and
+ * other buses are ignored.
+ */
+static int bench_load_capture(struct bench_corpus *corpus, const char *path)
+{
+    static unsigned char data[IBUS_RING_SIZE];
+    struct capture_reader reader;
+    struct capture_record_header record;
+    int res;
+
+    corpus->name = path;
+    res = capture_open_read(&reader, path);
+    if(res < 0)
+        return res;
+    while((res = capture_read(&reader, &record, data)) > 0) {
+        if(record.bus == 0)
+            bench_append(corpus, data, record.length);
+    }
+    capture_close_read(&reader);
+    return res;
+}
+
+/******************************************************************************
+ * measurement
+ *****************************************************************************/
+static inline uint64_t bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+static void bench_reset()
+{
+    ibus_bus_reset(bench_bus);
+    memset(&input_stats, 0, sizeof(input_stats));
+    memset(&ibus_latency, 0, sizeof(ibus_latency));
+    ibus_change_state(EStateUnknown);
+}
+
+/*
+ * Feeds the corpus through the daemon message path in read sized chunks.
+ * Bytes left at the end are handled as if the line went idle.
+ */
+static void bench_run(const struct bench_corpus *corpus)
+{
+    size_t pos = 0;
+    unsigned int length;
+
+    while(pos < corpus->size) {
+        length = corpus->size - pos;
+        if(length > BENCH_READ_SIZE)
+            length = BENCH_READ_SIZE;
+        clock_gettime(CLOCK_MONOTONIC, &bench_bus->rx_time);
+        pos += ibus_ring_put(&bench_bus->rx.ring, &corpus->data[pos], length);
+        process_ibus_data(bench_bus);
+    }
+    while(ibus_ring_count(&bench_bus->rx.ring))
+        process_ibus_idle(bench_bus);
+}
+
+static inline void bench_sample(enum EBenchStage stage, uint64_t ns)
+{
+    bench_samples[stage][bench_sample_count] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static void bench_message(const unsigned char *msg, unsigned int length, int print, uint64_t parse_ns)
+{
+    uint64_t t0,t1,t2,t3;
+
+    if(bench_sample_count == bench_sample_capacity)
+        return;
+
+    t0 = bench_now();
+    ibus_dispatch(msg);
+    t1 = bench_now();
+    if(print)
+        print_bus_message_text(ibus_bus_trace_id(bench_bus), msg, length);
+    t2 = bench_now();
+    send_input_events();
+    t3 = bench_now();
+
+    bench_sample(EStageParse, parse_ns);
+    bench_sample(EStageDispatch, t1 - t0);
+    bench_sample(EStagePrint, t2 - t1);
+    bench_sample(EStageInput, t3 - t2);
+    bench_sample_count++;
+}
+
+/*
+ * Same path as bench_run but every stage of every message is timed. Parser
+ * time includes the resynchronization done before the message was found.
+ */
+static void bench_run_stages(const struct bench_corpus *corpus, int print)
+{
+    enum EIbusParseResult res;
+    size_t pos = 0;
+    unsigned int length;
+    uint64_t start,parse_ns = 0;
+    int idle = 0;
+
+    bench_sample_count = 0;
+    while(pos < corpus->size || ibus_ring_count(&bench_bus->rx.ring)) {
+        if(pos < corpus->size) {
+            length = corpus->size - pos;
+            if(length > BENCH_READ_SIZE)
+                length = BENCH_READ_SIZE;
+            clock_gettime(CLOCK_MONOTONIC, &ibus_rx_time);
+            pos += ibus_ring_put(&bench_bus->rx.ring, &corpus->data[pos], length);
+        }
+        else
+            idle = 1;
+
+        start = bench_now();
+        res = idle ? ibus_resync(&bench_bus->rx, &length) : ibus_parse_next(&bench_bus->rx, &length);
+        while(res != EParseNeedMore) {
+            if(res == EParseMessage) {
+                parse_ns += bench_now() - start;
+                bench_message(ibus_ring_message(&bench_bus->rx.ring, length), length, print, parse_ns);
+                ibus_parser_consume(&bench_bus->rx, length);
+                parse_ns = 0;
+                start = bench_now();
+                res = ibus_parse_next(&bench_bus->rx, &length);
+            }
+            else
+                res = ibus_resync(&bench_bus->rx, &length);
+        }
+        parse_ns += bench_now() - start;
+    }
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_report_stages()
+{
+    unsigned int stage;
+    uint32_t *samples;
+    size_t n = bench_sample_count;
+
+    if(!n)
+        return;
+    for(stage = 0; stage < EStageCount; stage++) {
+        samples = bench_samples[stage];
+        qsort(samples, n, sizeof(samples[0]), bench_compare);
+        fprintf(report, "  %-9s p50 %6u ns  p90 %6u ns  p99 %6u ns  max %8u ns\n",
+            bench_stage_names[stage], samples[n/2], samples[n*90/100], samples[n*99/100], samples[n-1]);
+    }
+}
+
+static void bench_corpus(const struct bench_corpus *corpus, int print)
+{
+    unsigned long allocations;
+    uint64_t start,elapsed;
+    unsigned int stage;
+    double seconds;
+
+    /* throughput of the real path, print is included by trace level */
+    trace_level = print ? TRACE_IBUS : 0;
+    bench_reset();
+    allocations = bench_allocations;
+    start = bench_now();
+    bench_run(corpus);
+    elapsed = bench_now() - start;
+    allocations = bench_allocations - allocations;
+    trace_level = 0;
+
+    seconds = elapsed/1000000000.0;
+    if(seconds <= 0)
+        seconds = 1e-9;
+    fprintf(report, "%s: %zu bytes, %lu frames, %lu resyncs, %lu bytes skipped\n",
+        corpus->name, corpus->size, bench_bus->stats.messages, bench_bus->stats.resyncs, bench_bus->stats.skipped_bytes);
+    fprintf(report, "  %.0f frames/s, %.2f MB/s, %.1f ns/frame, %lu allocations\n",
+        bench_bus->stats.messages/seconds, corpus->size/seconds/1000000.0,
+        bench_bus->stats.messages ? (double)elapsed/bench_bus->stats.messages : 0.0, allocations);
+
+    /* per stage latencies */
+    if(bench_bus->stats.messages > bench_sample_capacity) {
+        bench_sample_capacity = bench_bus->stats.messages;
+        for(stage = 0; stage < EStageCount; stage++) {
+            free(bench_samples[stage]);
+            bench_samples[stage] = malloc(bench_sample_capacity*sizeof(uint32_t));
+            if(!bench_samples[stage]) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+    }
+    bench_reset();
+    bench_run_stages(corpus, print);
+    bench_report_stages();
+}
+
+/******************************************************************************
+ * kernel microbenchmark
+ *****************************************************************************/
+struct bench_xor_kernel {
+    const char *name;
+    unsigned char (*xor_block)(const unsigned char *data, size_t length);
+    void (*prefix_xor)(const unsigned char *data, unsigned char *out, size_t length);
+};
+
+/* results of the kernels go here so they are not optimised away */
+static volatile unsigned int bench_sink;
+
+/* the old resync scan, checksum of every candidate byte by byte */
+static unsigned int bench_scan_bytewise(const struct ibus_parser *parser, unsigned int start)
+{
+    const struct ibus_ring *ring = &parser->ring;
+    unsigned int available = ibus_ring_count(ring);
+    unsigned int offset,mes_len,i;
+    unsigned char checksum;
+
+    for(offset = start; offset + parser->min_length <= available; offset++) {
+        if(parser->known_senders && !ibus_is_known_device(ibus_ring_peek(ring, offset+EPosSender)))
+            continue;
+        mes_len = ibus_ring_peek(ring, offset+EPosLength)+parser->length_offset;
+        if(mes_len < parser->min_length || offset + mes_len > available)
+            continue;
+        for(i = 0, checksum = 0; i < mes_len; i++)
+            checksum ^= ibus_ring_peek(ring, offset+i);
+        if(checksum == 0)
+            return offset;
+    }
+    return 0;
+}
+
+static void bench_report_rate(const char *name, uint64_t ns, uint64_t bytes, uint64_t calls)
+{
+    fprintf(report, "  %-22s %8.2f GB/s %10.1f ns/call\n", name,
+        ns ? (double)bytes/ns : 0.0, calls ? (double)ns/calls : 0.0);
+}
+
+/*
+ * XOR and prefix XOR kernels over a large block and over maximum length
+ * frames, then resync scan of a full ring of garbage with plausible
+ * senders, which is the worst case of the scan.
+ */
+static void bench_kernels()
+{
+    struct bench_xor_kernel kernels[3];
+    unsigned int kernel_count = 0;
+    unsigned char *data,*prefix;
+    unsigned char expected,result = 0;
+    char name[64];
+    uint64_t start,elapsed;
+    unsigned int i,k,round,found = 0;
+    size_t pos;
+
+    kernels[kernel_count++] = (struct bench_xor_kernel){ "scalar", ibus_xor_scalar, ibus_prefix_xor_scalar };
+#ifdef IBUS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+        kernels[kernel_count++] = (struct bench_xor_kernel){ "sse2", ibus_xor_sse2, ibus_prefix_xor_sse2 };
+    if(__builtin_cpu_supports("avx2"))
+        kernels[kernel_count++] = (struct bench_xor_kernel){ "avx2", ibus_xor_avx2, 0 };
+#endif
+
+    data = malloc(BENCH_KERNEL_BYTES);
+    prefix = malloc(BENCH_KERNEL_BYTES);
+    if(!data || !prefix) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    bench_random_state = 0x12345678;
+    for(pos = 0; pos < BENCH_KERNEL_BYTES; pos++)
+        data[pos] = bench_random(256);
+    expected = ibus_xor_scalar(data, BENCH_KERNEL_BYTES);
+
+    fprintf(report, "xor kernels: %d MB block, %d byte frames\n", BENCH_KERNEL_BYTES>>20, EMaximumMessageLength);
+    for(k = 0; k < kernel_count; k++) {
+        start = bench_now();
+        for(round = 0; round < BENCH_KERNEL_ROUNDS; round++)
+            result ^= kernels[k].xor_block(data, BENCH_KERNEL_BYTES);
+        elapsed = bench_now() - start;
+        if(kernels[k].xor_block(data, BENCH_KERNEL_BYTES) != expected)
+            fprintf(report, "  %s xor MISMATCH\n", kernels[k].name);
+        snprintf(name, sizeof(name), "%s block", kernels[k].name);
+        bench_report_rate(name, elapsed, (uint64_t)BENCH_KERNEL_BYTES*BENCH_KERNEL_ROUNDS, BENCH_KERNEL_ROUNDS);
+
+        start = bench_now();
+        for(pos = 0; pos + EMaximumMessageLength <= BENCH_KERNEL_BYTES; pos += EMaximumMessageLength)
+            result ^= kernels[k].xor_block(&data[pos], EMaximumMessageLength);
+        elapsed = bench_now() - start;
+        snprintf(name, sizeof(name), "%s frame", kernels[k].name);
+        bench_report_rate(name, elapsed, pos, pos/EMaximumMessageLength);
+    }
+    for(k = 0; k < kernel_count; k++) {
+        if(!kernels[k].prefix_xor)
+            continue;
+        start = bench_now();
+        for(round = 0; round < BENCH_KERNEL_ROUNDS; round++)
+            kernels[k].prefix_xor(data, prefix, BENCH_KERNEL_BYTES);
+        elapsed = bench_now() - start;
+        if(prefix[BENCH_KERNEL_BYTES-1] != expected)
+            fprintf(report, "  %s prefix xor MISMATCH\n", kernels[k].name);
+        snprintf(name, sizeof(name), "%s prefix", kernels[k].name);
+        bench_report_rate(name, elapsed, (uint64_t)BENCH_KERNEL_BYTES*BENCH_KERNEL_ROUNDS, BENCH_KERNEL_ROUNDS);
+    }
+
+    /* every byte is a known sender, so every offset is a candidate */
+    ibus_bus_reset(bench_bus);
+    for(i = 0; i < IBUS_RING_SIZE; i++) {
+        bench_bus->rx.ring.data[i] = i%2 ? 0x80 + bench_random(0x40) : IKE;
+        if(i%4 == 0)
+            bench_bus->rx.ring.data[i] ^= 0x01; /*GM, break accidental checksums*/
+    }
+    bench_bus->rx.ring.head = IBUS_RING_SIZE;
+    fprintf(report, "resync scan: %d byte ring, found %u/%u\n", IBUS_RING_SIZE,
+        bench_scan_bytewise(&bench_bus->rx, 1), ibus_next_complete_message(&bench_bus->rx, 1));
+
+    start = bench_now();
+    for(round = 0; round < BENCH_KERNEL_ROUNDS*16; round++)
+        found += bench_scan_bytewise(&bench_bus->rx, 1);
+    elapsed = bench_now() - start;
+    bench_report_rate("bytewise", elapsed, (uint64_t)IBUS_RING_SIZE*BENCH_KERNEL_ROUNDS*16, BENCH_KERNEL_ROUNDS*16);
+
+    start = bench_now();
+    for(round = 0; round < BENCH_KERNEL_ROUNDS*16; round++)
+        found += ibus_next_complete_message(&bench_bus->rx, 1);
+    elapsed = bench_now() - start;
+    bench_report_rate("prefix", elapsed, (uint64_t)IBUS_RING_SIZE*BENCH_KERNEL_ROUNDS*16, BENCH_KERNEL_ROUNDS*16);
+
+    bench_sink = result + found;
+    free(data);
+    free(prefix);
+}
+
+static void print_help(char* name)
+{
+	fprintf(stderr, "Usage: %s <options> [capture files]\n",name);
+	fprintf(stderr, "-m traffic mix. buttons/text/mixed/corrupt, default all. Can be given many times\n");
+	fprintf(stderr, "-n frames per generated mix, default %d\n",BENCH_DEFAULT_FRAMES);
+	fprintf(stderr, "-p include message printing\n");
+	fprintf(stderr, "-k measure checksum and resync scan kernels only\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "example: %s -n 1000000 -p ~/capture.bin\n",name);
+	fprintf(stderr, "\n");
+}
+
+int main (int argc, char *argv[])
+{
+    static const char *all_mixes[] = { "buttons", "text", "mixed", "corrupt" };
+    const char *mixes[8];
+    unsigned int mix_count = 0;
+    unsigned long frames = BENCH_DEFAULT_FRAMES;
+    struct bench_corpus corpus;
+    unsigned int i;
+    int print = 0;
+    int kernels = 0;
+    int opt,res;
+
+    while ((opt = getopt(argc, argv, "m:n:pk")) != -1) {
+        switch (opt) {
+        case 'm':
+            for(i = 0; i < sizeof(all_mixes)/sizeof(all_mixes[0]); i++)
+                if(strcmp(optarg, all_mixes[i]) == 0)
+                    break;
+            if(i == sizeof(all_mixes)/sizeof(all_mixes[0]) || mix_count == sizeof(mixes)/sizeof(mixes[0])) {
+                fprintf(stderr, "invalid mix %s\n",optarg);
+                print_help(argv[0]);
+                return 1;
+            }
+            mixes[mix_count++] = all_mixes[i];
+            break;
+        case 'n':
+            frames = strtoul(optarg, 0, 0);
+            break;
+        case 'p':
+            print = 1;
+            break;
+        case 'k':
+            kernels = 1;
+            break;
+        default: /* '?' */
+            print_help(argv[0]);
+            return 1;
+        }
+    }
+    if(!mix_count && optind == argc) {
+        for(i = 0; i < sizeof(all_mixes)/sizeof(all_mixes[0]); i++)
+            mixes[mix_count++] = all_mixes[i];
+    }
+
+    /* messages and handler output are printed to stdout, which is discarded */
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if(!report || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Can't redirect stdout: %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* key events are written to /dev/null to include the write call */
+    IbusHijackState = EStateAUX;
+    uinput_device_fd = open("/dev/null", O_WRONLY);
+    bench_bus = ibus_bus_add(EBusIBus, "bench");
+    ibus_init_known_devices();
+    if(ibus_build_text_matcher() < 0) {
+        fprintf(stderr, "Can't build text matcher\n");
+        return 1;
+    }
+    ibus_register_default_handlers();
+
+    if(kernels) {
+        bench_kernels();
+        fclose(report);
+        return 0;
+    }
+
+    for(i = 0; i < mix_count; i++) {
+        memset(&corpus, 0, sizeof(corpus));
+        bench_generate(&corpus, mixes[i], frames);
+        bench_corpus(&corpus, print);
+        free(corpus.data);
+    }
+
+    for(i = optind; i < (unsigned int)argc; i++) {
+        memset(&corpus, 0, sizeof(corpus));
+        res = bench_load_capture(&corpus, argv[i]);
+        if(res < 0)
+            fprintf(stderr, "Can't load capture %s: %s\n", argv[i], strerror(-res));
+        else
+            bench_corpus(&corpus, print);
+        free(corpus.data);
+    }
+
+    fclose(report);
+    return 0;
+}
@@ -0,0 +1,278 @@
+/**
+ *   Shared memory frame ring and vehicle state of BMW IBus Daemon. Daemon
+ *   started with -u <socket> publishes every valid frame of every bus to a
+ *   memfd ring and keeps decoded vehicle state next to it. Local clients
+ *   map both read-only. This header is all a client needs.
+ *
+ *   Copyright (C) 2012 Kari Suvanto karis79@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BMW_IBUS_SHM_H
+#define BMW_IBUS_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Protocol:
+ * 1. client connects to the SOCK_SEQPACKET unix socket given with -u
+ * 2. daemon sends struct ibus_shm_hello with read-only memfd of the ring
+ *    as SCM_RIGHTS
+ * 3. client maps size bytes PROT_READ, MAP_SHARED
+ * 4. after every batch of frames daemon sends head (uint64_t) as wakeup.
+ *    Wakeups are dropped if client does not read them, the ring is the
+ *    truth and clients may also just poll head.
+ *
+ * Ring has one producer and any number of consumers, the producer never
+ * waits for them. Frame of position p is in slot p%slots and its sequence
+ * is p+1 when it is valid. Sequence is 0 while the slot is written, so a
+ * consumer reads the frame in place and checks the sequence again after
+ * it, see ibus_shm_peek and ibus_shm_valid. Consumer that falls more than
+ * slots behind has lost frames and continues from head-slots.
+ *
+ * Vehicle state is protected by a seqlock: sequence is odd while the daemon
+ * updates it. ibus_shm_read_state copies a consistent snapshot without
+ * syscalls. Every update increments generation and every changed field
+ * gets it as its field generation, so pollers can tell what changed.
+ *
+ * Mapping is header, vehicle state at state_offset and frames at
+ * header_size.
+ */
+#define IBUS_SHM_MAGIC 0x48534249 /*"IBSH"*/
+#define IBUS_SHM_VERSION 2
+#define IBUS_SHM_SLOTS 1024 /*power of two*/
+#define IBUS_SHM_MAX_FRAME 257
+
+/* bus types */
+#define IBUS_SHM_BUS_IBUS 0
+#define IBUS_SHM_BUS_KBUS 1
+#define IBUS_SHM_BUS_DBUS 2
+
+struct ibus_shm_frame {
+    uint64_t sequence; /*position+1 when valid, 0 while written*/
+    uint64_t timestamp; /*ns CLOCK_MONOTONIC of the read that completed the frame*/
+    uint8_t bus; /*IBUS_SHM_BUS_...*/
+    uint8_t bus_index; /*order of -d options*/
+    uint8_t sender; /*D-Bus: address*/
+    uint8_t receiver; /*D-Bus: 0*/
+    uint8_t message; /*D-Bus: command*/
+    uint8_t reserved;
+    uint16_t length;
+    uint8_t data[IBUS_SHM_MAX_FRAME]; /*whole frame, checksum included*/
+} __attribute__((aligned(64)));
+
+/* fields of the vehicle state */
+enum EIbusVehicleField
+    {
+    EVehicleIgnition = 0,
+    EVehicleSpeed,
+    EVehicleRpm,
+    EVehicleOutsideTemperature,
+    EVehicleCoolantTemperature,
+    EVehicleOdometer,
+    EVehicleDoors,
+    EVehicleWindows,
+    EVehicleLamps,
+    EVehicleFieldCount
+    };
+
+/* ignition, IS */
+#define IBUS_IGNITION_OFF   0x00
+#define IBUS_IGNITION_POS1  0x01 /*KL-R*/
+#define IBUS_IGNITION_POS2  0x03 /*KL-15*/
+#define IBUS_IGNITION_START 0x07 /*KL-50*/
+
+/* doors and locks, first data byte of DWS */
+#define IBUS_DOOR_DRIVER_FRONT    0x01
+#define IBUS_DOOR_PASSENGER_FRONT 0x02
+#define IBUS_DOOR_DRIVER_REAR     0x04
+#define IBUS_DOOR_PASSENGER_REAR  0x08
+#define IBUS_DOOR_UNLOCKED        0x10
+#define IBUS_DOOR_LOCKED          0x20
+
+/* windows, trunk and hood, second data byte of DWS */
+#define IBUS_WINDOW_DRIVER_FRONT    0x01
+#define IBUS_WINDOW_PASSENGER_FRONT 0x02
+#define IBUS_WINDOW_DRIVER_REAR     0x04
+#define IBUS_WINDOW_PASSENGER_REAR  0x08
+#define IBUS_WINDOW_SUNROOF         0x10
+#define IBUS_WINDOW_TRUNK           0x20
+#define IBUS_WINDOW_HOOD            0x40
+
+/* lamps, first data byte of LS */
+#define IBUS_LAMP_PARKING    0x01
+#define IBUS_LAMP_LOW_BEAM   0x02
+#define IBUS_LAMP_HIGH_BEAM  0x04
+#define IBUS_LAMP_FOG_FRONT  0x08
+#define IBUS_LAMP_FOG_REAR   0x10
+#define IBUS_LAMP_TURN_LEFT  0x20
+#define IBUS_LAMP_TURN_RIGHT 0x40
+#define IBUS_LAMP_TURN_FAST  0x80
+
+struct ibus_vehicle_state {
+    uint32_t sequence; /*odd while written*/
+    uint32_t generation; /*incremented on every update*/
+    uint64_t timestamp; /*ns CLOCK_MONOTONIC of the last update*/
+    uint32_t field_generation[EVehicleFieldCount]; /*0 until the field is received*/
+    uint32_t odometer; /*km*/
+    uint16_t speed; /*km/h*/
+    uint16_t rpm;
+    int8_t outside_temperature; /*C*/
+    int8_t coolant_temperature; /*C*/
+    uint8_t ignition; /*IBUS_IGNITION_...*/
+    uint8_t doors; /*IBUS_DOOR_...*/
+    uint8_t windows; /*IBUS_WINDOW_...*/
+    uint8_t lamps; /*IBUS_LAMP_...*/
+} __attribute__((aligned(64)));
+
+struct ibus_shm_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size; /*frames start here*/
+    uint32_t frame_size;
+    uint32_t slots;
+    uint32_t state_offset; /*struct ibus_vehicle_state*/
+    uint64_t head __attribute__((aligned(64))); /*frames published*/
+} __attribute__((aligned(64)));
+
+/* first message of the socket */
+struct ibus_shm_hello {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t size; /*bytes to map*/
+};
+
+static inline uint64_t ibus_shm_head(const struct ibus_shm_header *shm)
+{
+    return __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+}
+
+static inline const struct ibus_shm_frame* ibus_shm_slot(const struct ibus_shm_header *shm, uint64_t position)
+{
+    const unsigned char *frames = (const unsigned char*)shm + shm->header_size;
+    return (const struct ibus_shm_frame*)(frames + (position&(shm->slots-1))*shm->frame_size);
+}
+
+/*
+ * Returns frame of position or 0 if it is not published yet or it was
+ * overwritten. Frame must be checked with ibus_shm_valid after reading it.
+ */
+static inline const struct ibus_shm_frame* ibus_shm_peek(const struct ibus_shm_header *shm, uint64_t position)
+{
+    const struct ibus_shm_frame *frame = ibus_shm_slot(shm, position);
+
+    if(__atomic_load_n(&frame->sequence, __ATOMIC_ACQUIRE) != position+1)
+        return 0;
+    return frame;
+}
+
+/* returns 1 if frame was not overwritten while it was read */
+static inline int ibus_shm_valid(const struct ibus_shm_frame *frame, uint64_t position)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&frame->sequence, __ATOMIC_RELAXED) == position+1;
+}
+
+static inline const struct ibus_vehicle_state* ibus_shm_state(const struct ibus_shm_header *shm)
+{
+    return (const struct ibus_vehicle_state*)((const unsigned char*)shm + shm->state_offset);
+}
+
+/* copies consistent snapshot of the vehicle state, retries while it is written */
+static inline void ibus_shm_read_state(const struct ibus_shm_header *shm, struct ibus_vehicle_state *copy)
+{
+    const struct ibus_vehicle_state *state = ibus_shm_state(shm);
+    uint32_t sequence;
+
+    for(;;) {
+        sequence = __atomic_load_n(&state->sequence, __ATOMIC_ACQUIRE);
+        if(sequence & 1)
+            continue;
+        memcpy(copy, state, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&state->sequence, __ATOMIC_RELAXED) == sequence)
+            break;
+    }
+    copy->sequence = sequence;
+}
+
+/*
+ * Connects to the daemon and maps the ring. Returns the ring or 0 with
+ * errno set. Socket is left open for wakeups.
+ */
+static inline const struct ibus_shm_header* ibus_shm_subscribe(const char *path, int *socket_fd)
+{
+    struct sockaddr_un addr;
+    struct ibus_shm_hello hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    const struct ibus_shm_header *shm;
+    void *map;
+    int fd,memfd = -1,error;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        goto err;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello))
+        goto proto;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        goto proto;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(memfd));
+    if(hello.magic != IBUS_SHM_MAGIC || hello.version != IBUS_SHM_VERSION)
+        goto proto;
+
+    map = mmap(0, hello.size, PROT_READ, MAP_SHARED, memfd, 0);
+    if(map == MAP_FAILED)
+        goto err;
+    close(memfd);
+    shm = map;
+    *socket_fd = fd;
+    return shm;
+
+proto:
+    errno = EPROTO;
+err:
+    error = errno;
+    if(memfd >= 0)
+        close(memfd);
+    close(fd);
+    errno = error;
+    return 0;
+}
+
+#endif /*BMW_IBUS_SHM_H*/
@@ -0,0 +1,156 @@
+/**
+ *   Prints the frames BMW IBus Daemon publishes with -u <socket>, or with
+ *   -s the vehicle state whenever it changes. Example client of the shared
+ *   memory, frames are read in place and state is polled without syscalls.
+ *
+ *   Copyright (C) 2012 Kari Suvanto karis79@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <poll.h>
+#include "bmw-ibus-shm.h"
+
+static const char *bus_names[] = { "ibus", "kbus", "dbus" };
+
+/* returns 1 if the frame was printed, 0 if it was overwritten meanwhile */
+static int print_frame(const struct ibus_shm_frame *frame, uint64_t position)
+{
+    char line[64 + 3*IBUS_SHM_MAX_FRAME];
+    unsigned int i,length,pos;
+
+    length = frame->length;
+    if(length > IBUS_SHM_MAX_FRAME)
+        length = IBUS_SHM_MAX_FRAME;
+    pos = snprintf(line, sizeof(line), "%llu.%06llu: [%s] %02x->%02x %02x:",
+        (unsigned long long)(frame->timestamp/1000000000ULL),
+        (unsigned long long)(frame->timestamp%1000000000ULL)/1000,
+        frame->bus < 3 ? bus_names[frame->bus] : "?",
+        frame->sender, frame->receiver, frame->message);
+    for(i = 0; i < length; i++)
+        pos += snprintf(&line[pos], sizeof(line)-pos, " %02x", frame->data[i]);
+
+    if(!ibus_shm_valid(frame, position))
+        return 0;
+    puts(line);
+    return 1;
+}
+
+/*
+ * Polls the state 10 times per second and prints it when it changes. Reading
+ * the state needs no syscalls, socket is only waited to see daemon exit.
+ */
+static void follow_state(const struct ibus_shm_header *shm, int fd)
+{
+    struct ibus_vehicle_state state;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    uint32_t generation = 0;
+    uint64_t wakeup;
+
+    for(;;) {
+        ibus_shm_read_state(shm, &state);
+        if(state.generation != generation) {
+            generation = state.generation;
+            printf("%llu.%06llu: ignition %02x, %u km/h, %u rpm, outside %d C, coolant %d C, %u km, doors %02x, windows %02x, lamps %02x\n",
+                (unsigned long long)(state.timestamp/1000000000ULL),
+                (unsigned long long)(state.timestamp%1000000000ULL)/1000,
+                state.ignition, state.speed, state.rpm,
+                state.outside_temperature, state.coolant_temperature,
+                state.odometer, state.doors, state.windows, state.lamps);
+            fflush(stdout);
+        }
+        if(poll(&pfd, 1, 100) < 0 && errno != EINTR)
+            break;
+        if(pfd.revents & (POLLHUP | POLLERR))
+            break;
+        while(recv(fd, &wakeup, sizeof(wakeup), MSG_DONTWAIT) > 0)
+            ;
+    }
+}
+
+static void print_help(char* name)
+{
+	fprintf(stderr, "Usage: %s [-s] <publish socket of the daemon>\n",name);
+	fprintf(stderr, "-s print vehicle state when it changes instead of frames\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "example: %s /tmp/bmw-ibus.sock\n",name);
+	fprintf(stderr, "\n");
+}
+
+int main (int argc, char *argv[])
+{
+    const struct ibus_shm_header *shm;
+    const struct ibus_shm_frame *frame;
+    struct pollfd pfd;
+    uint64_t position,head,wakeup;
+    unsigned long lost = 0;
+    const char *path = argv[1];
+    int state = 0;
+    int fd,res;
+
+    if(argc == 3 && strcmp(argv[1], "-s") == 0) {
+        state = 1;
+        path = argv[2];
+    }
+    else if(argc != 2) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    shm = ibus_shm_subscribe(path, &fd);
+    if(!shm) {
+        fprintf(stderr, "Can't subscribe %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if(state) {
+        follow_state(shm, fd);
+        close(fd);
+        return 0;
+    }
+
+    /* only new frames */
+    position = ibus_shm_head(shm);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for(;;) {
+        head = ibus_shm_head(shm);
+        if(head - position > shm->slots) {
+            lost += head - position - shm->slots;
+            position = head - shm->slots;
+        }
+        while(position < head) {
+            frame = ibus_shm_peek(shm, position);
+            if(!frame || !print_frame(frame, position))
+                lost++;
+            position++;
+        }
+        fflush(stdout);
+
+        res = poll(&pfd, 1, -1);
+        if(res < 0 && errno != EINTR)
+            break;
+        if(pfd.revents & (POLLHUP | POLLERR))
+            break;
+        if(pfd.revents & POLLIN) {
+            /*wakeups only tell that head moved*/
+            while(recv(fd, &wakeup, sizeof(wakeup), MSG_DONTWAIT) > 0)
+                ;
+        }
+    }
+
+    if(lost)
+        fprintf(stderr, "%lu frames lost\n", lost);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,228 @@
+/**
+ *   Decodes the binary trace file written by BMW IBus Daemon with -b -f <file>
+ *   to the same text the daemon writes without -b.
+ *
+ *   Copyright (C) 2012 Kari Suvanto karis79@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* message printing and trace file format are shared with the daemon */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define IBUS_NO_MAIN
+#include "bmw-ibus.c"
+
+
+#define TRACEDUMP_MAX_FORMATS 4096
+
+struct tracedump_format {
+    char *format;
+    int argc; /*negative if format could not be parsed*/
+    unsigned char args[TRACE_MAX_ARGS];
+};
+
+static struct tracedump_format formats[TRACEDUMP_MAX_FORMATS];
+
+static void reset_formats()
+{
+    unsigned int i;
+    for(i = 0; i < TRACEDUMP_MAX_FORMATS; i++) {
+        free(formats[i].format);
+        formats[i].format = 0;
+    }
+}
+
+static void print_timestamp(uint64_t timestamp)
+{
+    printf("%ld.%06ld: ", (long)(timestamp/1000000000ULL), (long)(timestamp%1000000000ULL)/1000);
+}
+
+/*
+ * Renders the event like printf would have done in the daemon. Integer
+ * arguments are recorded as 64 bit so conversions are printed with ll.
+ */
+static void print_event(const struct tracedump_format *fmt, const unsigned char *payload, unsigned int length)
+{
+    const char *p = fmt->format;
+    const char *start;
+    char spec[32],string[TRACE_MAX_STRING+1];
+    unsigned int pos = 0;
+    unsigned int spec_len,string_len;
+    int i = 0;
+    uint64_t value;
+    double dvalue;
+
+    while(*p) {
+        if(*p != '%') {
+            putchar(*p++);
+            continue;
+        }
+        if(p[1] == '%') {
+            putchar('%');
+            p += 2;
+            continue;
+        }
+
+        /*copy flags, width and precision and drop the length modifiers*/
+        start = p++;
+        p += strspn(p, "-+ #0123456789.");
+        spec_len = p - start;
+        if(spec_len > sizeof(spec) - 4)
+            spec_len = sizeof(spec) - 4;
+        memcpy(spec, start, spec_len);
+        while(*p == 'l' || *p == 'h' || *p == 'z')
+            p++;
+        if(!*p || i >= fmt->argc)
+            break;
+
+        if(fmt->args[i] == ETraceArgString) {
+            string_len = pos < length ? payload[pos++] : 0;
+            if(pos + string_len > length)
+                string_len = length - pos;
+            memcpy(string, &payload[pos], string_len);
+            string[string_len] = '\0';
+            pos += string_len;
+            spec[spec_len++] = 's';
+            spec[spec_len] = '\0';
+            printf(spec, string);
+        }
+        else {
+            value = 0;
+            if(pos + sizeof(value) <= length)
+                memcpy(&value, &payload[pos], sizeof(value));
+            pos += sizeof(value);
+
+            switch(fmt->args[i]) {
+            case ETraceArgDouble:
+                memcpy(&dvalue, &value, sizeof(dvalue));
+                spec[spec_len++] = *p;
+                spec[spec_len] = '\0';
+                printf(spec, dvalue);
+                break;
+            case ETraceArgPointer:
+                printf("%p", (void*)(uintptr_t)value);
+                break;
+            default:
+                if(*p == 'c') {
+                    spec[spec_len++] = 'c';
+                    spec[spec_len] = '\0';
+                    printf(spec, (int)value);
+                }
+                else {
+                    spec[spec_len++] = 'l';
+                    spec[spec_len++] = 'l';
+                    spec[spec_len++] = *p;
+                    spec[spec_len] = '\0';
+                    printf(spec, (long long)value);
+                }
+                break;
+            }
+        }
+        i++;
+        p++;
+    }
+}
+
+static void print_help(char* name)
+{
+	fprintf(stderr, "Usage: %s <binary trace file>\n",name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "example: %s ~/tracefile.bin > ~/tracefile.log\n",name);
+	fprintf(stderr, "\n");
+}
+
+int main (int argc, char *argv[])
+{
+    struct trace_file_header file_header;
+    struct trace_record_header header;
+    unsigned char payload[0x10000];
+    struct tracedump_format *fmt;
+    uint32_t dropped;
+    FILE *fp;
+    int c;
+
+    if(argc != 2) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if(!fp) {
+        fprintf(stderr, "Can't open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    while((c = fgetc(fp)) != EOF) {
+        ungetc(c, fp);
+
+        /* every daemon session starts with the file header */
+        if(c == TRACE_FILE_MAGIC[0]) {
+            if(fread(&file_header, sizeof(file_header), 1, fp) != 1)
+                break;
+            if(memcmp(file_header.magic, TRACE_FILE_MAGIC, sizeof(file_header.magic)) != 0 ||
+               file_header.version != TRACE_FILE_VERSION ||
+               file_header.byte_order != TRACE_FILE_BYTE_ORDER) {
+                fprintf(stderr, "Unsupported trace file\n");
+                break;
+            }
+            reset_formats();
+            continue;
+        }
+
+        if(fread(&header, sizeof(header), 1, fp) != 1)
+            break;
+        if(header.length && fread(payload, header.length, 1, fp) != 1)
+            break;
+
+        switch(header.type) {
+        case ETraceRecordFormat:
+            if(header.id >= TRACEDUMP_MAX_FORMATS)
+                break;
+            fmt = &formats[header.id];
+            free(fmt->format);
+            fmt->format = strndup((const char*)payload, header.length);
+            fmt->argc = trace_parse_format(fmt->format, fmt->args);
+            break;
+        case ETraceRecordEvent:
+            if(header.id >= TRACEDUMP_MAX_FORMATS || !formats[header.id].format || formats[header.id].argc < 0) {
+                print_timestamp(header.timestamp);
+                printf("unknown trace format %d\n", header.id);
+                break;
+            }
+            print_timestamp(header.timestamp);
+            print_event(&formats[header.id], payload, header.length);
+            break;
+        case ETraceRecordMessage:
+            /*id tells the bus, D-Bus messages have different framing*/
+            if((header.id >> 8) != EBusDBus &&
+               (header.length < EMinimumMessageLength || header.length < get_message_length(payload)))
+                break;
+            print_timestamp(header.timestamp);
+            print_bus_message_text(header.id, payload, header.length);
+            break;
+        case ETraceRecordDropped:
+            memcpy(&dropped, payload, sizeof(dropped));
+            print_timestamp(header.timestamp);
+            printf("%u trace records dropped\n", dropped);
+            break;
+        default:
+            fprintf(stderr, "Unknown record %d\n", header.type);
+            break;
+        }
+    }
+
+    reset_formats();
+    fclose(fp);
+    return 0;
+}
@@ -10,6 +10,9 @@
  *
  *   It can be configured to control video input pin(reverse cam) via CTS,RTS
  *
+ *   It can emulate a CD changer, which is then a hijack state that needs no
+ *   display text parsing.
+ *
  *   IBUS device,message and data codes are mostly found from following web sites:
  *   http://autos.groups.yahoo.com/group/HackTheIBus/
  *   http://ibus.stuge.se/IBus_Messages
@@ -31,8 +34,16 @@
  */
 
 
+#define _GNU_SOURCE /*memmem*/
 #include <sys/select.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -40,23 +51,34 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <error.h>
 #include <termios.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
+#include <linux/gpio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IBUS_X86
+#endif
+#include "bmw-ibus-shm.h"
 
 
 /**
  * TODO
  * 1.1-6 buttons change volume in aux, do nothing in aux, can be used in tape
- * 2.EStateCDChanger handle this also
- * 3.Language support for other than english?
+ * 2.Language support for other than english?
  *
  */
 
@@ -789,6 +811,9 @@ const unsigned char MFL2ChannelDown = 0x39;
 struct ibus_buttons {
     const char * name;
     const uint16_t key_code;
+    const uint16_t long_key_code; /*sent instead of key_code when held, 0 if none*/
+    const uint16_t repeat_delay; /*ms held before the first repeat, 0 if key does not repeat*/
+    const uint16_t repeat_rate; /*ms between repeats*/
 };
 
 /**
@@ -800,14 +825,18 @@ struct ibus_buttons {
  * This is the key mapping from BMW IBUS to Linux key codes
  *
  * Do not map buttons that changes the state like power, fm, mode
+ *
+ * Button with long key code sends key code when released before
+ * BUTTON_LONG_PRESS_MS and long key code when held longer. Button with repeat
+ * delay sends repeats (value 2) while it is held. See button repeat functions.
  */
 const struct ibus_buttons headunit_buttons[] = {
-    {  "ButtonArrowRight",  KEY_UP  },   		/*0x00*/
+    {  "ButtonArrowRight",  KEY_UP, 0, 500, 100  },   		/*0x00*/
     {  "Button2",           KEY_BACKSPACE  },   /*0x01*/
     {  "Button4",           KEY_4  },       	/*0x02*/
     {  "Button6",           KEY_6  },       	/*0x03*/
     {  "ButtonTone",        RESERVED_BUTTON  },    	/*0x04*/ /*TONE can be used in tape mode but not in AUX mode*/
-    {  "ButtonMenuKnob",    KEY_ENTER  },   	/*0x05*/ /*knob push*/
+    {  "ButtonMenuKnob",    KEY_ENTER, KEY_CONTEXT_MENU  },   	/*0x05*/ /*knob push*/
     {  "ButtonRadioPower",  RESERVED_BUTTON  }, 	/*0x06*/ /*power button not passed forward*/
     {  "ButtonClock",       KEY_SETUP  },   	/*0x07*/
     {  "ButtonTelephone",   KEY_SETUP  },   	/*0x08*/
@@ -818,7 +847,7 @@ const struct ibus_buttons headunit_buttons[] = {
     {  "0x0C",              KEY_UNKNOWN  }, 	/*0x0D*/
     {  "0x0D",              KEY_UNKNOWN  }, 	/*0x0E*/
     {  "0x0F",              KEY_UNKNOWN  }, 	/*0x0F*/
-    {  "ButtonArrowLeft",   KEY_DOWN  },   		/*0x10*/
+    {  "ButtonArrowLeft",   KEY_DOWN, 0, 500, 100  },   		/*0x10*/
     {  "Button1",           KEY_MENU  },       	/*0x11*/
     {  "Button3",           KEY_SPACE  },       /*0x12*/
     {  "Button5",           KEY_5  },       	/*0x13*/
@@ -857,9 +886,9 @@ const struct ibus_buttons headunit_buttons[] = {
     {  "ButtonMenu",        RESERVED_BUTTON  }, 	/*0x34*/
     {  "ButtonMenuKnobClockwiseMask",           KEY_RIGHT  },    /*0x35*/
     {  "ButtonMenuKnobCounterClockwiseMask",    KEY_LEFT  },    /*0x36*/
-    {  "ButtonSelectInTapeMode",                KEY_ESC },    /*0x37*/
-    {  "MFL2ButtonChannelUp",                   KEY_UP  },    /*0x38*/
-    {  "MFL2ButtonChannelDown",                 KEY_DOWN  }    /*0x39*/
+    {  "ButtonSelectInTapeMode",                KEY_ESC, KEY_HOME },    /*0x37*/
+    {  "MFL2ButtonChannelUp",                   KEY_UP, 0, 500, 100  },    /*0x38*/
+    {  "MFL2ButtonChannelDown",                 KEY_DOWN, 0, 500, 100  }    /*0x39*/
 };
 
 enum EIbusState
@@ -870,7 +899,8 @@ enum EIbusState
     EStateFM,
     EStateTAPE,
     EStateAUX,
-    EStateCDChanger
+    EStateCDChanger,
+    EStateCount
     };
 
 enum EVideoInputSwitch
@@ -888,21 +918,661 @@ enum EVideoInputSwitch
 static volatile int exit_request = 0;
 
 static int uinput_device_fd;
+
+/* input events of one IBus message are written to uinput together */
+#define IBUS_INPUT_BATCH_SIZE 64
+struct ibus_input_batch {
+    struct input_event events[IBUS_INPUT_BATCH_SIZE];
+    unsigned int count;
+};
+static struct ibus_input_batch input_batch;
+
+struct ibus_input_stats {
+    unsigned long key_events;
+    unsigned long writes;
+    unsigned long saved_writes; /*compared to event and sync write per key or wheel event*/
+    unsigned long repeats;
+    unsigned long repeats_skipped; /*timer ran late*/
+    unsigned long long_presses;
+    unsigned long stuck; /*released after BUTTON_HOLD_MAX_MS without release frame*/
+    unsigned long knob_detents;
+    unsigned long wheel_events; /*knob detents coalesced to one event each*/
+};
+static struct ibus_input_stats input_stats;
 static unsigned char send_key_events = 0;
 
-static int ibus_device_fd;
-static unsigned char ibus_data[257*8]; /*EMaximumMessageLength*/
-static unsigned int ibus_data_max_length = 257*8;
-static unsigned int ibus_data_index;
+/*
+ * -w knob as wheel. Detents of the KNOB frames received within window are
+ * sent as one REL_WHEEL event, accelerated when the knob is turned fast.
+ */
+struct ibus_knob_wheel {
+    unsigned int window; /*ms, 0 when knob sends arrow keys*/
+    unsigned int acceleration; /*% of gain added per detent in the window*/
+    int detents; /*coalesced, clockwise positive*/
+};
+static struct ibus_knob_wheel knob_wheel;
+
+#define BUTTON_COUNT (sizeof(headunit_buttons)/sizeof(struct ibus_buttons))
+
+/* mapping of one button, see headunit_buttons */
+struct ibus_key {
+    uint16_t key_code;
+    uint16_t long_key_code;
+    uint16_t repeat_delay;
+    uint16_t repeat_rate;
+};
+
+/*
+ * -k keymap. Every state has a layer indexed by the button code. Keys are
+ * sent in the hijack state and in the states the keymap has a layer for.
+ * Reload builds a new keymap and swaps the pointer, held buttons keep the
+ * mapping they were pressed with.
+ */
+struct ibus_keymap {
+    struct ibus_key layers[EStateCount][BUTTON_COUNT];
+    unsigned char enabled[EStateCount];
+};
+static struct ibus_keymap default_keymap; /*headunit_buttons*/
+static struct ibus_keymap *keymap = &default_keymap;
+static const char *keymap_path;
+
+/* keyboard keys, buttons of mice and joysticks would change the device class */
+#define KEYMAP_KEY_VALID(code) \
+    (((code) >= KEY_ESC && (code) < BTN_MISC) || ((code) >= KEY_OK && (code) < BTN_TRIGGER_HAPPY))
+
+/**
+ * Receive ring. Serial data is read in bulk to the head and IBUS messages are
+ * consumed from the tail. head and tail are free running and masked on access
+ * so head-tail is always the amount of buffered data.
+ * Size must be power of two and bigger than EMaximumMessageLength
+ */
+#define IBUS_RING_SIZE 4096
+#define IBUS_RING_MASK (IBUS_RING_SIZE-1)
+struct ibus_ring {
+    unsigned char data[IBUS_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+};
+
+/* ingestion counters, one set per bus */
+struct ibus_ingest_stats {
+    unsigned long wakeups; /*epoll reported the line readable*/
+    unsigned long reads; /*read() syscalls returning data*/
+    unsigned long bytes;
+    unsigned long overflows; /*ring full*/
+    unsigned long vmin_updates; /*tcsetattr calls to move VMIN*/
+    unsigned long messages;
+    unsigned long idle_timeouts; /*incomplete message timed out*/
+    unsigned long resyncs; /*invalid data found*/
+    unsigned long skipped_bytes; /*bytes discarded while resynchronizing*/
+    unsigned long recovered; /*valid messages found behind invalid data*/
+    struct timespec start;
+};
+
+/**
+ * Streaming parser. Messages are validated from the ring tail as the bytes
+ * arrive: the length byte tells when the message is complete and checksum is
+ * calculated incrementally so it is ready when the last byte arrives.
+ * I-Bus and K-Bus length counts the bytes after it, D-Bus (DS2) length is
+ * the whole message.
+ */
+struct ibus_parser {
+    struct ibus_ring ring;
+    unsigned int scanned; /*bytes of the tail message included in checksum*/
+    unsigned char checksum;
+    unsigned char resyncing; /*invalid data found, sliding to next message*/
+    unsigned int recover_until; /*ring head when invalid data was found*/
+    /*message format of the bus*/
+    unsigned char length_offset; /*message length is length byte + offset*/
+    unsigned char min_length;
+    unsigned char known_senders; /*resynchronize only to known senders*/
+    struct ibus_ingest_stats *stats;
+};
+
+enum EIbusBusType
+    {
+    EBusIBus = 0,
+    EBusKBus,
+    EBusDBus
+    };
+static const char *ibus_bus_names[] = { "ibus", "kbus", "dbus" };
+#define IBUS_MAX_BUSES 4
+
+/**
+ * Message dispatch. IBUS_ANY as sender or receiver matches all devices
+ */
+#define IBUS_ANY 0x100
+#define IBUS_MAX_HANDLERS 32
+typedef void (*ibus_message_handler)(const unsigned char *msg);
+struct ibus_handler {
+    uint16_t sender;
+    uint16_t receiver;
+    unsigned char message;
+    ibus_message_handler handler;
+};
+struct ibus_dispatch_slot {
+    unsigned char senders[256/8];
+    unsigned char receivers[256/8];
+    unsigned char first; /*first handler in ibus_dispatch_handlers*/
+    unsigned char count;
+};
+static struct ibus_handler ibus_handlers[IBUS_MAX_HANDLERS]; /*in registration order*/
+static unsigned int ibus_handler_count;
+static struct ibus_handler ibus_dispatch_handlers[IBUS_MAX_HANDLERS]; /*grouped by message*/
+static struct ibus_dispatch_slot ibus_dispatch_slots[IBUS_MAX_HANDLERS+1];
+static unsigned char ibus_dispatch_index[256]; /*message id to slot*/
+
+/**
+ * Frame filter, checked right after framing before tracing, publishing and
+ * dispatch. A field passes if it is in the allow list of the field, or
+ * there is none, and it is not in the deny list. Lists are folded to one
+ * pass bitset per field so a frame costs three bit tests.
+ */
+enum EIbusFilterField
+    {
+    EFilterSender = 0,
+    EFilterReceiver,
+    EFilterMessage,
+    EFilterFieldCount
+    };
+static const char *ibus_filter_field_names[EFilterFieldCount] = { "sender", "receiver", "message" };
+struct ibus_filter {
+    int enabled;
+    unsigned char allow[EFilterFieldCount][256/8];
+    unsigned char deny[EFilterFieldCount][256/8];
+    unsigned char has_allow[EFilterFieldCount];
+    unsigned char pass[EFilterFieldCount][256/8];
+    /*counters*/
+    unsigned long passed;
+    unsigned long allow_misses[EFilterFieldCount]; /*dropped, not allowed*/
+    unsigned long deny_hits[EFilterFieldCount]; /*dropped, denied*/
+};
+static struct ibus_filter ibus_filter;
+
+/**
+ * Radio display text patterns telling the state of the radio. All patterns
+ * are compiled to one Aho-Corasick automaton
+ */
+struct ibus_text_pattern {
+    const char *text;
+    enum EIbusState state;
+    unsigned char message; /*UMID or ST*/
+};
+#define IBUS_MAX_TEXT_PATTERNS 32
+#define IBUS_MATCHER_MAX_STATES 256
+static const struct ibus_text_pattern default_text_patterns[] = {
+    { "AUX",  EStateAUX,  0x23 /*UMID*/ },
+    { "TAPE", EStateTAPE, 0x23 /*UMID*/ }, /*mode button and cassette frames predict it earlier, see state prediction functions*/
+    { "RDS",  EStateFM,   0xa5 /*ST*/ },
+    { "FM",   EStateFM,   0xa5 /*ST*/ },
+    { "REG",  EStateFM,   0xa5 /*ST*/ },
+    { "MWA",  EStateFM,   0xa5 /*ST*/ }
+};
+#define IBUS_DEFAULT_TEXT_PATTERNS (sizeof(default_text_patterns)/sizeof(default_text_patterns[0]))
+static struct ibus_text_pattern ibus_text_patterns[IBUS_MAX_TEXT_PATTERNS];
+static unsigned int ibus_text_pattern_count;
+static unsigned char ibus_matcher_next[IBUS_MATCHER_MAX_STATES][256];
+static uint32_t ibus_matcher_output[IBUS_MATCHER_MAX_STATES]; /*patterns ending to the state*/
+static uint32_t ibus_text_message_patterns[256]; /*patterns matched in each message*/
+
+/* bitset of devices with known name */
+static unsigned char ibus_known_devices[256/8];
+
+enum EIbusParseResult
+    {
+    EParseNeedMore = 0,
+    EParseMessage,
+    EParseInvalidLength,
+    EParseInvalidChecksum
+    };
+
+/* message is copied here only if it wraps around the end of the ring.
+ * Scratch buffers of the parser are per thread, bmw-ibus-analyse runs
+ * parsers in parallel */
+static __thread unsigned char ibus_linear_message[257]; /*EMaximumMessageLength*/
+
+/* kernel side batching. serial driver reports the line readable only after VMIN bytes.
+ * VMIN is kept at the amount of bytes missing from the message being received,
+ * starting from the minimum message of the bus */
+
+/* 9600baud, 1 start bit, 8 data bits,1 stop bit, even parity = 11 bit = 1,15ms/char */
+#define IBUS_CHAR_TIME_NS 1150000L
+
+/* how often ingestion stats are traced with TRACE_STATS */
+#define IBUS_STATS_INTERVAL 60
+
+/**
+ * Latency from the read that completed a message to its dispatch and to the
+ * uinput write of its key events, CLOCK_MONOTONIC. Histograms are kept per
+ * dispatch slot, that is per message id with handlers, and slot 0 has the
+ * rest. Buckets are log2 of us with 4 sub-buckets. Traced with the stats
+ * and on SIGUSR1.
+ */
+#define IBUS_LATENCY_BUCKETS 64
+struct ibus_latency_histogram {
+    uint32_t count;
+    uint32_t max; /*us*/
+    uint32_t buckets[IBUS_LATENCY_BUCKETS];
+};
+
+struct ibus_latency {
+    struct ibus_latency_histogram dispatch; /*last byte read to dispatch*/
+    struct ibus_latency_histogram inject; /*last byte read to uinput write*/
+};
+static struct ibus_latency ibus_latency[IBUS_MAX_HANDLERS+1];
+
+/**
+ * Traffic statistics of a bus, updated for every valid frame before it is
+ * filtered. Bus load is the time the frames take on the wire, 11 bits a
+ * byte at 9600 baud, counted in one second slots so load over the last 1,
+ * 10 and 60 seconds is a sum of slots. Gap is the quiet time from the end
+ * of the previous frame, as exact as the reads are. Traced on SIGUSR1 and
+ * written to the clients of the stats socket (-S).
+ */
+#define IBUS_TRAFFIC_SLOTS 64 /*seconds, power of two*/
+#define IBUS_LENGTH_BUCKETS 7 /*frame length 3-4, 5-8, ... 129-257*/
+struct ibus_traffic {
+    unsigned long sender_frames[256]; /*D-Bus by address*/
+    unsigned long long sender_bytes[256];
+    unsigned long message_frames[256]; /*D-Bus by command*/
+    unsigned long lengths[IBUS_LENGTH_BUCKETS];
+    struct ibus_latency_histogram gaps; /*us*/
+    uint32_t slot_bytes[IBUS_TRAFFIC_SLOTS];
+    time_t slot_second; /*CLOCK_MONOTONIC second of the newest slot*/
+    uint32_t peak_bytes; /*busiest second before the newest slot*/
+    struct timespec last_frame;
+};
+
+static struct timespec ibus_rx_time; /*read that completed the messages being processed, any bus*/
+static struct timespec input_write_time;
+static volatile int stats_request = 0;
 
 static enum EIbusState ibus_state = EStateUnknown;
 static enum EIbusState IbusHijackState = EStateUnknown;
 static enum EVideoInputSwitch VideoInputSwitch = ESwitchUnknown;
 
+/* video switch, see enable_video_input */
+struct ibus_video {
+    int output; /*-1 until set and after a failed switch*/
+    int hijack; /*hijack state*/
+    int reverse; /*reverse gear*/
+    int gpio_fd; /*-g line*/
+    unsigned long switches;
+    unsigned long skipped; /*switch was already there*/
+    unsigned long failed; /*tried again on the next update*/
+    unsigned long reverse_changes;
+    struct ibus_latency_histogram latency; /*gear frame to pin change*/
+};
+static struct ibus_video ibus_video = { -1, 0, 0, -1 };
+
+/**
+ * -C emulates CD changer. Radio polls it with device status request and
+ * sends CD status request for every command, changer that does not reply in
+ * time is dropped. Replies go to the high priority queue and are dropped if
+ * the line does not let them out within IBUS_CDC_REPLY_DEADLINE_MS, radio
+ * asks again. Latency is measured from the request to the echo of the reply.
+ *
+ * Radio sends play when CD changer is selected and stop when it is left, so
+ * the state needs no display text. Commands are sent as keys in that state.
+ */
+#define IBUS_CDC_REPLY_DEADLINE_MS 100
+#define IBUS_CDC_DISCS 6
+#define IBUS_CDC_TRACKS 99
+
+/* commands of CD status request, first data byte */
+#define CDC_CMD_STATUS 0x00
+#define CDC_CMD_STOP   0x01
+#define CDC_CMD_PAUSE  0x02
+#define CDC_CMD_PLAY   0x03
+#define CDC_CMD_SCAN   0x04 /*forward 0x00, rewind 0x01*/
+#define CDC_CMD_DISC   0x06 /*disc 1-6*/
+#define CDC_CMD_RANDOM 0x08
+#define CDC_CMD_TRACK  0x0A /*next 0x00, previous 0x01*/
+
+/* first two data bytes of CD status */
+#define CDC_STATUS_STOPPED 0x00
+#define CDC_STATUS_PAUSED  0x01
+#define CDC_STATUS_PLAYING 0x02
+#define CDC_STATUS_FORWARD 0x03
+#define CDC_STATUS_REWIND  0x04
+#define CDC_AUDIO_STOPPED  0x02
+#define CDC_AUDIO_PLAYING  0x09
+#define CDC_DISCS_LOADED   0x3F /*bit per disc*/
+
+/* device status ready data */
+#define CDC_DEVICE_READY    0x00
+#define CDC_DEVICE_ANNOUNCE 0x01
+
+#define CDC_ANY_PARAMETER 0xFF
+
+/* keys of the commands, sent in CD changer state */
+static const struct {
+    unsigned char command;
+    unsigned char parameter;
+    uint16_t key_code;
+} ibus_cdc_keys[] = {
+    { CDC_CMD_TRACK,  0x00,              KEY_NEXTSONG },
+    { CDC_CMD_TRACK,  0x01,              KEY_PREVIOUSSONG },
+    { CDC_CMD_SCAN,   0x00,              KEY_FASTFORWARD },
+    { CDC_CMD_SCAN,   0x01,              KEY_REWIND },
+    { CDC_CMD_PLAY,   CDC_ANY_PARAMETER, KEY_PLAYCD }, /*resumed, not when selected*/
+    { CDC_CMD_PAUSE,  CDC_ANY_PARAMETER, KEY_PAUSECD },
+    { CDC_CMD_STOP,   CDC_ANY_PARAMETER, KEY_STOPCD },
+    { CDC_CMD_RANDOM, CDC_ANY_PARAMETER, KEY_SHUFFLE },
+    { CDC_CMD_DISC,   0x01,              KEY_1 },
+    { CDC_CMD_DISC,   0x02,              KEY_2 },
+    { CDC_CMD_DISC,   0x03,              KEY_3 },
+    { CDC_CMD_DISC,   0x04,              KEY_4 },
+    { CDC_CMD_DISC,   0x05,              KEY_5 },
+    { CDC_CMD_DISC,   0x06,              KEY_6 }
+};
+
+struct ibus_cdc {
+    unsigned char enabled;
+    struct ibus_bus *bus; /*first I-Bus or K-Bus*/
+    unsigned char status; /*CDC_STATUS_...*/
+    unsigned char disc;
+    unsigned char track;
+    unsigned char waiting; /*reply queued, echo not seen yet*/
+    struct timespec request; /*receive time of the request replied*/
+    unsigned long polls;
+    unsigned long requests;
+    unsigned long replies; /*echo seen*/
+    unsigned long late; /*echo after IBUS_CDC_REPLY_DEADLINE_MS*/
+    unsigned long missed; /*reply expired or was not queued*/
+    unsigned long unchecked; /*queued to adapter without echo, not measured*/
+    struct ibus_latency_histogram latency; /*request to echo of the reply*/
+};
+static struct ibus_cdc ibus_cdc = { 0, 0, CDC_STATUS_STOPPED, 1, 1 };
+
 static unsigned int trace_level = 0;
 
 static FILE* stdout_fp = 0;
 
+/**
+ * Binary trace. Trace points record format id, timestamp and raw arguments
+ * to a preallocated lock-free ring and a background thread writes them to
+ * the trace file. Formatting is done offline by bmw-ibus-tracedump.
+ *
+ * Trace file is header followed by records. Each record is
+ * struct trace_record_header and length bytes of payload:
+ * - ETraceRecordFormat: format string of id, recorded on first use
+ * - ETraceRecordEvent: arguments of format id, 8 bytes each, strings are
+ *   length byte and characters
+ * - ETraceRecordMessage: valid IBus message
+ * - ETraceRecordDropped: 32 bit count of records lost because ring was full
+ */
+#define TRACE_FILE_MAGIC "IBTR"
+#define TRACE_FILE_VERSION 1
+#define TRACE_FILE_BYTE_ORDER 0x0102
+
+enum ETraceRecord
+    {
+    ETraceRecordFormat = 1,
+    ETraceRecordEvent,
+    ETraceRecordMessage,
+    ETraceRecordDropped
+    };
+
+enum ETraceArg
+    {
+    ETraceArgInt = 1,
+    ETraceArgUInt,
+    ETraceArgLong,
+    ETraceArgULong,
+    ETraceArgLLong,
+    ETraceArgULLong,
+    ETraceArgDouble,
+    ETraceArgString,
+    ETraceArgPointer
+    };
+
+#define TRACE_MAX_ARGS 8
+#define TRACE_MAX_STRING 64
+
+/* one per trace point, id is assigned on first use */
+struct trace_format {
+    const char *format;
+    uint16_t id;
+    unsigned char argc;
+    unsigned char args[TRACE_MAX_ARGS]; /*ETraceArg*/
+    unsigned char rejected; /*format can't be recorded, told once*/
+};
+
+struct trace_file_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t byte_order;
+} __attribute__((packed));
+
+struct trace_record_header {
+    uint8_t type; /*ETraceRecord*/
+    uint8_t reserved;
+    uint16_t length; /*payload length*/
+    uint16_t id; /*format id*/
+    uint64_t timestamp; /*ns, CLOCK_REALTIME*/
+} __attribute__((packed));
+
+/* ring slots are big enough for the longest IBus message */
+#define TRACE_RING_SIZE 1024 /*power of two*/
+#define TRACE_SLOT_PAYLOAD 272
+struct trace_slot {
+    unsigned int sequence; /*slot is free when sequence equals the position*/
+    struct trace_record_header header;
+    unsigned char payload[TRACE_SLOT_PAYLOAD];
+};
+
+static int trace_binary_fd = -1;
+static struct trace_slot trace_ring[TRACE_RING_SIZE];
+static unsigned int trace_enqueue_pos;
+static unsigned int trace_dequeue_pos; /*only used by the writer thread*/
+static unsigned int trace_format_count;
+static unsigned int trace_dropped;
+static volatile int trace_writer_exit;
+static pthread_t trace_writer_thread;
+
+static void trace_record(struct trace_format *fmt, ...);
+
+/**
+ * Bus capture and replay. With -c every byte read from the serial line is
+ * written to the capture file with its monotonic receive time. -r feeds a
+ * capture directly to the parser and -R through a pseudo terminal and the
+ * normal serial line path, both with original timing scaled by -x.
+ *
+ * Capture file is header followed by records. Each record is
+ * struct capture_record_header and length received bytes.
+ */
+#define CAPTURE_FILE_MAGIC "IBCP"
+#define CAPTURE_FILE_VERSION 2 /*version 1 has single I-Bus and no bus in records*/
+#define CAPTURE_FILE_BYTE_ORDER 0x0102
+
+struct capture_file_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t byte_order;
+    uint64_t start; /*ns, CLOCK_REALTIME when capture was started*/
+} __attribute__((packed));
+
+/* follows file header since version 2 */
+struct capture_bus_header {
+    uint8_t count;
+    uint8_t types[IBUS_MAX_BUSES]; /*EIbusBusType*/
+} __attribute__((packed));
+
+struct capture_record_header {
+    uint32_t delta; /*us from previous record or from start*/
+    uint16_t length;
+    uint8_t bus; /*since version 2*/
+} __attribute__((packed));
+
+struct capture_reader {
+    FILE *fp;
+    uint16_t version;
+    struct capture_bus_header buses;
+};
+
+static FILE *capture_fp = 0;
+static struct timespec capture_last; /*CLOCK_MONOTONIC of previous record*/
+
+static double replay_speed = 1.0; /*0 as fast as possible*/
+static int replay_master_fds[IBUS_MAX_BUSES]; /*pseudo terminal replay, one per bus of the capture*/
+static unsigned int replay_master_count;
+static const char *replay_pty_path;
+static pthread_t replay_feeder_thread;
+static int replay_feeder_running;
+
+/**
+ * Event loop. File descriptors are registered to epoll with a handler.
+ * When many sources are ready at the same time, priority sources (the IBus
+ * lines) are handled first so timers, signals and later sockets do not add
+ * latency to the read path.
+ */
+#define EVENT_MAX_EVENTS 16
+struct event_source;
+typedef void (*event_handler)(struct event_source *source, uint32_t events);
+struct event_source {
+    int fd;
+    int priority;
+    event_handler handler;
+    void *context;
+};
+static int event_epoll_fd = -1;
+
+/**
+ * Transmit. Frames are queued by priority and sent one at a time when the
+ * line has been quiet for IBUS_TX_IDLE_CHARS. The adapter receives what we
+ * send, so the frame is sent when its echo is read back. Corrupted data or
+ * no echo means that another device talked at the same time and the frame
+ * is sent again after random backoff.
+ */
+enum EIbusTxPriority
+    {
+    ETxPriorityHigh = 0,
+    ETxPriorityNormal,
+    ETxPriorityLow,
+    ETxPriorityCount
+    };
+#define IBUS_TX_QUEUE_SIZE 16 /*frames per priority, power of two*/
+#define IBUS_TX_IDLE_CHARS 10 /*quiet line before sending*/
+#define IBUS_TX_ECHO_SLACK_NS 20000000L /*USB adapters deliver the echo late*/
+#define IBUS_TX_MAX_ATTEMPTS 5
+struct ibus_tx_frame {
+    unsigned char data[257]; /*EMaximumMessageLength*/
+    unsigned int length;
+    unsigned char priority;
+    unsigned char attempts;
+    struct timespec queued;
+    struct timespec deadline; /*not written after this, tv_sec 0 for none*/
+};
+struct ibus_tx_queue {
+    struct ibus_tx_frame frames[IBUS_TX_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int tail; /*frame being sent*/
+};
+struct ibus_tx_stats {
+    unsigned long queued;
+    unsigned long sent; /*echo received*/
+    unsigned long collisions;
+    unsigned long retries;
+    unsigned long dropped; /*IBUS_TX_MAX_ATTEMPTS used*/
+    unsigned long queue_full;
+    unsigned long expired; /*deadline passed before the line was free*/
+    unsigned long unchecked; /*sent without echo, adapter does not echo*/
+    struct ibus_latency_histogram latency; /*queued to echo*/
+};
+struct ibus_tx {
+    struct ibus_tx_queue queues[ETxPriorityCount];
+    struct ibus_tx_frame *inflight; /*written, waiting for echo*/
+    struct timespec due; /*echo deadline or end of backoff*/
+    struct timespec written; /*write of the frame in flight*/
+    unsigned char echo_seen; /*adapter echoes sent frames*/
+    unsigned char no_echo; /*nothing came back for the first frame, frames are not checked*/
+    unsigned int seed;
+    struct ibus_tx_stats stats;
+};
+
+/**
+ * Bus context. Every serial line has its own parser, VMIN, frame timer and
+ * counters. Decoded messages of all buses are handled by the same handlers
+ * and state machine in the order they were read, see ibus_process_pending.
+ */
+struct ibus_bus {
+    enum EIbusBusType type;
+    unsigned char index;
+    char device[128];
+    int fd;
+    struct termios tio; /*VMIN follows the message being received*/
+    struct termios oldtio;
+    struct ibus_parser rx;
+    struct ibus_ingest_stats stats;
+    struct ibus_traffic traffic;
+    struct timespec rx_time; /*read of the data not processed yet*/
+    int pending; /*data read but not processed yet*/
+    struct event_source serial_source;
+    struct event_source frame_timer;
+    int frame_timer_armed;
+    int readable; /*read in this round of the event loop*/
+    int hung_up;
+    struct ibus_tx tx;
+    struct event_source tx_timer;
+};
+static struct ibus_bus ibus_buses[IBUS_MAX_BUSES];
+static unsigned int ibus_bus_count;
+
+/**
+ * Frame publishing to local clients, see bmw-ibus-shm.h. Only the main
+ * thread writes the ring. Unix socket is used for handshake and wakeups.
+ */
+#define IBUS_SHM_MAX_CLIENTS 8
+#define IBUS_SHM_SOCKET_MODE 0660 /*owner and group may subscribe*/
+struct ibus_shm_stats {
+    unsigned long frames;
+    unsigned long connects;
+    unsigned long refused; /*too many clients*/
+    unsigned long wakeups;
+    unsigned long wakeups_dropped; /*client did not read*/
+};
+static struct ibus_shm_header *shm_ring;
+static size_t shm_size;
+static int shm_fd = -1;
+static int shm_readonly_fd = -1; /*given to clients*/
+static const char *shm_socket_path;
+static struct event_source shm_listen_source;
+static struct event_source shm_clients[IBUS_SHM_MAX_CLIENTS];
+static unsigned int shm_client_count;
+static uint64_t shm_notified; /*head sent to clients*/
+static struct ibus_shm_stats shm_stats;
+
+/*
+ * stats socket, every client gets the full stats as text and is closed.
+ * Stats are formatted to a memory file and sent without blocking, the rest
+ * when the client can take it.
+ */
+#define IBUS_STATS_MAX_CLIENTS 4
+struct ibus_stats_client {
+    struct event_source source; /*fd -1 when free*/
+    int dump_fd; /*memory file of the stats*/
+    off_t sent;
+    off_t length;
+    unsigned long serial; /*oldest is dropped when all are taken*/
+};
+static const char *stats_socket_path;
+static struct event_source stats_listen_source = { -1 };
+static struct ibus_stats_client stats_clients[IBUS_STATS_MAX_CLIENTS];
+static unsigned long stats_client_serial;
+
+/**
+ * Vehicle state decoded from IKE, LCM and GM broadcasts. Lives in the
+ * shared memory when frames are published so clients can poll it, see
+ * ibus_shm_read_state. Written only by the main thread.
+ */
+static struct ibus_vehicle_state ibus_vehicle_local;
+static struct ibus_vehicle_state *ibus_vehicle = &ibus_vehicle_local;
+static int ibus_vehicle_writing; /*sequence is odd*/
+static const char *ibus_vehicle_field_names[EVehicleFieldCount] = {
+    "ignition", "speed", "rpm", "outside temperature", "coolant temperature",
+    "odometer", "doors", "windows", "lamps" };
+
 /******************************************************************************
  * trace macros
  *****************************************************************************/
@@ -910,34 +1580,54 @@ static FILE* stdout_fp = 0;
 #define TRACE_IBUS     1<<1
 #define TRACE_INPUT    1<<2
 #define TRACE_STATE    1<<3
-#define TRACE_ALL      (TRACE_FUNCTION|TRACE_IBUS|TRACE_INPUT|TRACE_STATE)
+#define TRACE_STATS    1<<4
+#define TRACE_ALL      (TRACE_FUNCTION|TRACE_IBUS|TRACE_INPUT|TRACE_STATE|TRACE_STATS)
 
 #define CHECK_TRACELEVEL(level) (level&trace_level)
 
+/* in binary trace mode (-b) only format id and raw arguments are recorded, see trace_record */
 #define TRACE_WARGS(debug_level, format, ...) \
 ({ \
     if(CHECK_TRACELEVEL(debug_level)) { \
-        struct timeval now; \
-        gettimeofday(&now, 0); \
-        printf("%ld.%06ld: " format ,(long)now.tv_sec, (long)now.tv_usec, __VA_ARGS__); \
+        if(trace_binary_fd >= 0) { \
+            static struct trace_format trace_fmt = { format }; \
+            trace_record(&trace_fmt, __VA_ARGS__); \
+        } \
+        else { \
+            struct timeval now; \
+            gettimeofday(&now, 0); \
+            printf("%ld.%06ld: " format ,(long)now.tv_sec, (long)now.tv_usec, __VA_ARGS__); \
+        } \
     } \
 })
 
 #define TRACE(debug_level, format) \
 ({ \
     if(CHECK_TRACELEVEL(debug_level)) { \
-        struct timeval now; \
-        gettimeofday(&now, 0); \
-        printf("%ld.%06ld: " format ,(long)now.tv_sec, (long)now.tv_usec); \
+        if(trace_binary_fd >= 0) { \
+            static struct trace_format trace_fmt = { format }; \
+            trace_record(&trace_fmt); \
+        } \
+        else { \
+            struct timeval now; \
+            gettimeofday(&now, 0); \
+            printf("%ld.%06ld: " format ,(long)now.tv_sec, (long)now.tv_usec); \
+        } \
     } \
 })
 
 #define TRACE_ERROR(format) \
 ({ \
-	struct timeval now; \
-	gettimeofday(&now, 0); \
-	printf("%ld.%06ld: %s:%d ERROR=%d=%s: " format "\n",(long)now.tv_sec, (long)now.tv_usec, __FILE__,__LINE__, -errno, strerror(errno)); \
-	if(stdout_fp) fflush(stdout_fp); \
+	if(trace_binary_fd >= 0) { \
+		static struct trace_format trace_fmt = { "%s:%d ERROR=%d=%s: " format "\n" }; \
+		trace_record(&trace_fmt, __FILE__,__LINE__, -errno, strerror(errno)); \
+	} \
+	else { \
+		struct timeval now; \
+		gettimeofday(&now, 0); \
+		printf("%ld.%06ld: %s:%d ERROR=%d=%s: " format "\n",(long)now.tv_sec, (long)now.tv_usec, __FILE__,__LINE__, -errno, strerror(errno)); \
+		if(stdout_fp) fflush(stdout_fp); \
+	} \
 })
 
 #define TRACE_HEX(debug_level,message, data, length) \
@@ -954,676 +1644,5252 @@ static FILE* stdout_fp = 0;
     } \
 })
 
+/* stats are traced or written to stats socket client fd */
+#define STATS_PRINT(fd, format, ...) \
+({ \
+    if(fd >= 0) \
+        dprintf(fd, format, __VA_ARGS__); \
+    else \
+        TRACE_WARGS(TRACE_STATS, format, __VA_ARGS__); \
+})
+
 #define TRACE_ENTRY(debug_level) TRACE_WARGS(debug_level, "++ %s\n",__func__);
 #define TRACE_ENTRY_WARGS(debug_level,format, ...) TRACE_WARGS(debug_level, "++ %s " format,__func__,__VA_ARGS__);
 #define TRACE_EXIT(debug_level) TRACE_WARGS(debug_level, "-- %s\n",__func__);
 #define TRACE_EXIT_WARGS(debug_level,format, ...) TRACE_WARGS(debug_level, "-- %s " format,__func__,__VA_ARGS__);
 
 /******************************************************************************
- * signal functions
- *****************************************************************************/
-static void signal_handler(int sig)
-{
-    TRACE_ENTRY_WARGS(TRACE_FUNCTION, "%s got %d\n",__func__,sig);
-	exit_request = 1;
-	TRACE_EXIT(TRACE_FUNCTION);
-}
-
-/******************************************************************************
- * uinput functions
+ * binary trace functions
  *****************************************************************************/
-static int uinput_create()
+/*
+ * Parses argument types from printf format. Returns argument count or
+ * negative errno if format has conversions not supported by the binary trace.
+ */
+static int trace_parse_format(const char *format, unsigned char *args)
 {
-	struct uinput_user_dev dev;
-	int fd;
-	unsigned int i;
-	TRACE_ENTRY((TRACE_INPUT|TRACE_FUNCTION));
-
-	fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-	if (fd < 0) {
-		fd = open("/dev/input/uinput", O_WRONLY | O_NONBLOCK);
-		if (fd < 0) {
-			fd = open("/dev/misc/uinput", O_WRONLY | O_NONBLOCK);
-			if (fd < 0) {
-				TRACE_ERROR("Can't open input device");
-				goto err;
-			}
-		}
-	}
-
-	memset(&dev, 0, sizeof(dev));
-	snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "BMW IBUS");
+    const char *p = format;
+    unsigned int argc = 0;
+    int longs;
+
+    while((p = strchr(p, '%')) != 0) {
+        p++;
+        if(*p == '%') {
+            p++;
+            continue;
+        }
 
-	dev.id.bustype = BUS_RS232;
-	dev.id.vendor  = 0x0000;
-	dev.id.product = 0x0000;
-	dev.id.version = 0x0100;
+        /*flags, width and precision*/
+        p += strspn(p, "-+ #0123456789.");
 
-	if (write(fd, &dev, sizeof(dev)) < 0) {
-		TRACE_ERROR("Can't write device information");
-		goto close;
-	}
+        longs = 0;
+        while(*p == 'l' || *p == 'h' || *p == 'z') {
+            if(*p == 'l' || *p == 'z')
+                longs++;
+            p++;
+        }
 
-	if(ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0){
-		TRACE_ERROR("Can't set event bit");
-		goto close;
-	}
+        if(argc == TRACE_MAX_ARGS)
+            return -E2BIG;
 
-	for(i=0; i < sizeof(headunit_buttons)/sizeof(struct ibus_buttons); i++){
-        if(headunit_buttons[i].key_code!=KEY_UNKNOWN) {
-            if(ioctl(fd, UI_SET_KEYBIT, headunit_buttons[i].key_code) < 0){
-            	TRACE_ERROR("Can't set key bit");
-                goto close;
-            }
+        switch(*p) {
+        case 'd': case 'i': case 'c':
+            args[argc++] = longs == 0 ? ETraceArgInt : longs == 1 ? ETraceArgLong : ETraceArgLLong;
+            break;
+        case 'u': case 'x': case 'X': case 'o':
+            args[argc++] = longs == 0 ? ETraceArgUInt : longs == 1 ? ETraceArgULong : ETraceArgULLong;
+            break;
+        case 'f': case 'e': case 'g': case 'E': case 'G':
+            args[argc++] = ETraceArgDouble;
+            break;
+        case 's':
+            args[argc++] = ETraceArgString;
+            break;
+        case 'p':
+            args[argc++] = ETraceArgPointer;
+            break;
+        default:
+            return -EINVAL;
         }
-	}
+        p++;
+    }
+    return argc;
+}
 
-	if (ioctl(fd, UI_DEV_CREATE, NULL) < 0) {
-		TRACE_ERROR("Can't create uinput device");
-		goto close;
-	}
+/*
+ * Reserves next free slot from the ring. Multiple producers are allowed,
+ * e.g. signal handler interrupting the main loop. Returns 0 if ring is full.
+ */
+static struct trace_slot* trace_reserve(unsigned int *position)
+{
+    struct trace_slot *slot;
+    unsigned int pos = __atomic_load_n(&trace_enqueue_pos, __ATOMIC_RELAXED);
+    int diff;
+
+    for(;;) {
+        slot = &trace_ring[pos&(TRACE_RING_SIZE-1)];
+        diff = (int)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&trace_enqueue_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(diff < 0) {
+            __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&trace_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
 
-    TRACE_EXIT((TRACE_INPUT|TRACE_FUNCTION));
-	return fd;
+    *position = pos;
+    return slot;
+}
 
-close:
-	close(fd);
-err:
-    TRACE_EXIT_WARGS((TRACE_INPUT|TRACE_FUNCTION)," error %d\n",-errno);
-    return -errno;
+/* hands the slot over to the writer thread */
+static inline void trace_commit(struct trace_slot *slot, unsigned int position)
+{
+    __atomic_store_n(&slot->sequence, position+1, __ATOMIC_RELEASE);
 }
 
-static void uinput_close()
+static inline uint64_t trace_timestamp()
 {
-    TRACE_ENTRY((TRACE_INPUT|TRACE_FUNCTION));
-    if (uinput_device_fd >= 0) {
-		ioctl(uinput_device_fd, UI_DEV_DESTROY);
-		close(uinput_device_fd);
-		uinput_device_fd = -1;
-	}
-	TRACE_EXIT((TRACE_INPUT|TRACE_FUNCTION));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec*1000000000ULL + now.tv_nsec;
 }
 
-static int send_key_event(uint16_t key, uint16_t value)
+static int trace_put(uint8_t type, uint16_t id, const void *payload, unsigned int length)
 {
-    struct input_event key_event;
+    struct trace_slot *slot;
+    unsigned int pos;
+
+    slot = trace_reserve(&pos);
+    if(!slot)
+        return -ENOBUFS;
+
+    if(length > TRACE_SLOT_PAYLOAD)
+        length = TRACE_SLOT_PAYLOAD;
+    slot->header.type = type;
+    slot->header.reserved = 0;
+    slot->header.length = length;
+    slot->header.id = id;
+    slot->header.timestamp = trace_timestamp();
+    memcpy(slot->payload, payload, length);
+    trace_commit(slot, pos);
+    return 0;
+}
 
-    TRACE_ENTRY_WARGS((TRACE_INPUT|TRACE_FUNCTION), "key event %d, value %d\n",key,value);
+/* assigns id to the trace point and records its format string */
+static int trace_register_format(struct trace_format *fmt)
+{
+    int argc = trace_parse_format(fmt->format, fmt->args);
+    uint16_t id;
 
-    /*send key press event*/
-    memset(&key_event, 0, sizeof(key_event));
-	key_event.type	= EV_KEY;
-	key_event.code	= key;
-	key_event.value	= value;
-	if(write(uinput_device_fd, &key_event, sizeof(key_event)) < 0){
-		TRACE_ERROR("Can't write key event");
-		goto err;
-	}
+    if(argc < 0)
+        return argc;
+    fmt->argc = argc;
 
-    /*send sync event*/
-    memset(&key_event, 0, sizeof(key_event));
-	key_event.type	= EV_SYN;
-	key_event.code	= SYN_REPORT;
-	key_event.value	= 0;
-	if(write(uinput_device_fd, &key_event, sizeof(key_event)) < 0){
-		TRACE_ERROR("Can't write syn event");
-		goto err;
-	}
+    id = __atomic_add_fetch(&trace_format_count, 1, __ATOMIC_RELAXED);
+    if(trace_put(ETraceRecordFormat, id, fmt->format, strlen(fmt->format)) < 0)
+        return -ENOBUFS;
 
-	TRACE_EXIT((TRACE_INPUT|TRACE_FUNCTION));
-	return 0;
-err:
-    TRACE_EXIT_WARGS((TRACE_INPUT|TRACE_FUNCTION),"error %d",-errno);
-    return -errno;
+    fmt->id = id;
+    return 0;
 }
 
-static void handle_ibus_button(unsigned char button, unsigned char released,unsigned char longPress)
+/*
+ * Trace point with too many arguments or unsupported conversions would be
+ * lost without a word. It is told once to stderr and to the trace instead.
+ */
+static void trace_reject_format(struct trace_format *fmt, int error)
 {
-    TRACE_ENTRY_WARGS((TRACE_INPUT|TRACE_FUNCTION), "button %d, released %d, longPress %d\n",button,released,longPress);
-
-    if(send_key_events){
-    	/**
-    	 * todo: long press/repeat not supported at the moment
-    	 */
-
-		if( headunit_buttons[button].key_code!=KEY_UNKNOWN ||
-		    headunit_buttons[button].key_code!=RESERVED_BUTTON){
-			if(send_key_event(headunit_buttons[button].key_code,released?0:1) < 0){
-				TRACE_ERROR("Can't set key event");
-			}
-		}
-    }
+    static struct trace_format rejected_fmt = { "binary trace can't record format (%s): %s\n" };
 
-    TRACE_EXIT((TRACE_INPUT|TRACE_FUNCTION));
+    fmt->rejected = 1;
+    fprintf(stderr, "binary trace can't record format (%s): %s", strerror(-error), fmt->format);
+    trace_record(&rejected_fmt, strerror(-error), fmt->format);
 }
 
-
-/******************************************************************************
- * IBUS functions
- *****************************************************************************/
 /*
- * Set/Disable line.
+ * Records trace event. Arguments are copied as they are, only strings are
+ * copied by value as they may not exist anymore when the event is decoded.
+ * Strings are truncated so that the rest of the arguments fit to the slot.
  */
-static int set_line(int line,int enable)
+static void trace_record(struct trace_format *fmt, ...)
 {
-    int status;
-    TRACE_ENTRY_WARGS(TRACE_STATE, "line=%x,enable=%d\n",line,enable);
-
-    if(line < TIOCM_LE || line > TIOCM_DSR){
-    	printf("invalid line %d",line);
-    	errno = EINVAL;
-    	goto err;
+    struct trace_slot *slot;
+    unsigned char *payload;
+    unsigned int pos,i,length = 0;
+    const char *string;
+    uint64_t value;
+    double dvalue;
+    int err = errno;
+    int res,room;
+    va_list ap;
+
+    if(fmt->rejected)
+        goto exit;
+    if(!fmt->id) {
+        res = trace_register_format(fmt);
+        if(res == -E2BIG || res == -EINVAL)
+            trace_reject_format(fmt, res);
+        if(res < 0)
+            goto exit;
     }
 
-    if(ioctl(ibus_device_fd, TIOCMGET, &status) < 0){
-    	TRACE_ERROR("Can't get TIOCM");
-        goto err;
-    }
+    slot = trace_reserve(&pos);
+    if(!slot)
+        goto exit;
+
+    payload = slot->payload;
+    va_start(ap, fmt);
+    for(i = 0; i < fmt->argc; i++) {
+        switch(fmt->args[i]) {
+        case ETraceArgInt: value = (int64_t)va_arg(ap, int); break;
+        case ETraceArgUInt: value = va_arg(ap, unsigned int); break;
+        case ETraceArgLong: value = (int64_t)va_arg(ap, long); break;
+        case ETraceArgULong: value = va_arg(ap, unsigned long); break;
+        case ETraceArgLLong: value = va_arg(ap, long long); break;
+        case ETraceArgULLong: value = va_arg(ap, unsigned long long); break;
+        case ETraceArgPointer: value = (uintptr_t)va_arg(ap, void*); break;
+        case ETraceArgDouble:
+            dvalue = va_arg(ap, double);
+            memcpy(&value, &dvalue, sizeof(value));
+            break;
+        case ETraceArgString:
+        default:
+            string = va_arg(ap, const char*);
+            if(!string)
+                string = "(null)";
+            value = strnlen(string, TRACE_MAX_STRING);
+            /*length byte and the largest size of every argument after this*/
+            room = TRACE_SLOT_PAYLOAD - (int)length - 1 - (int)(fmt->argc-i-1)*(int)sizeof(value);
+            if((int)value > room)
+                value = room > 0 ? room : 0;
+            payload[length++] = value;
+            memcpy(&payload[length], string, value);
+            length += value;
+            continue;
+        }
+        memcpy(&payload[length], &value, sizeof(value));
+        length += sizeof(value);
+    }
+    va_end(ap);
+
+    slot->header.type = ETraceRecordEvent;
+    slot->header.reserved = 0;
+    slot->header.length = length;
+    slot->header.id = fmt->id;
+    slot->header.timestamp = trace_timestamp();
+    trace_commit(slot, pos);
+
+exit:
+    errno = err;
+}
+
+/* id tells the bus of the message */
+static inline void trace_record_data(uint16_t id, const unsigned char *data, unsigned int length)
+{
+    trace_put(ETraceRecordMessage, id, data, length);
+}
+
+static int trace_write_all(int fd, const unsigned char *data, size_t length)
+{
+    ssize_t res;
+    while(length) {
+        res = write(fd, data, length);
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            return -errno;
+        }
+        data += res;
+        length -= res;
+    }
+    return 0;
+}
+
+/*
+ * Background writer. Moves records from the ring to the trace file in
+ * batches and sleeps while the ring is empty.
+ */
+static void* trace_writer(void *arg)
+{
+    static unsigned char buffer[64*1024];
+    struct trace_record_header dropped_header;
+    struct timespec idle = { 0, 20000000L };
+    struct trace_slot *slot;
+    unsigned int used,record_length;
+    uint32_t dropped;
+    int stop;
+
+    (void)arg;
+    for(;;) {
+        /*read before draining so that everything recorded before exit is written*/
+        stop = trace_writer_exit;
+        used = 0;
+
+        dropped = __atomic_exchange_n(&trace_dropped, 0, __ATOMIC_RELAXED);
+        if(dropped) {
+            memset(&dropped_header, 0, sizeof(dropped_header));
+            dropped_header.type = ETraceRecordDropped;
+            dropped_header.length = sizeof(dropped);
+            dropped_header.timestamp = trace_timestamp();
+            memcpy(&buffer[used], &dropped_header, sizeof(dropped_header));
+            used += sizeof(dropped_header);
+            memcpy(&buffer[used], &dropped, sizeof(dropped));
+            used += sizeof(dropped);
+        }
+
+        for(;;) {
+            slot = &trace_ring[trace_dequeue_pos&(TRACE_RING_SIZE-1)];
+            if(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != trace_dequeue_pos+1)
+                break; /*empty*/
+            record_length = sizeof(slot->header) + slot->header.length;
+            if(used + record_length > sizeof(buffer))
+                break;
+            memcpy(&buffer[used], &slot->header, record_length);
+            used += record_length;
+            /*free the slot for the next round*/
+            __atomic_store_n(&slot->sequence, trace_dequeue_pos+TRACE_RING_SIZE, __ATOMIC_RELEASE);
+            trace_dequeue_pos++;
+        }
+
+        if(used) {
+            if(trace_write_all(trace_binary_fd, buffer, used) < 0)
+                break;
+        }
+        else if(stop) {
+            break;
+        }
+        else {
+            nanosleep(&idle, 0);
+        }
+    }
+    return 0;
+}
+
+/* opens binary trace file and starts the writer thread */
+static int trace_binary_open(const char *path)
+{
+    struct trace_file_header header;
+    sigset_t mask,orig_mask;
+    unsigned int i;
+    int fd,res;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd < 0)
+        return -errno;
+
+    /*every session starts with header so the file can be appended*/
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FILE_VERSION;
+    header.byte_order = TRACE_FILE_BYTE_ORDER;
+    if((res = trace_write_all(fd, (const unsigned char*)&header, sizeof(header))) < 0) {
+        close(fd);
+        return res;
+    }
+
+    for(i = 0; i < TRACE_RING_SIZE; i++)
+        trace_ring[i].sequence = i;
+    trace_enqueue_pos = 0;
+    trace_dequeue_pos = 0;
+    trace_writer_exit = 0;
+
+    trace_binary_fd = fd;
+    /*signals must wake up the main loop, not the writer*/
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &orig_mask);
+    res = pthread_create(&trace_writer_thread, 0, trace_writer, 0);
+    pthread_sigmask(SIG_SETMASK, &orig_mask, 0);
+    if(res) {
+        trace_binary_fd = -1;
+        close(fd);
+        return -res;
+    }
+    return 0;
+}
+
+/* writes the remaining records and closes the trace file */
+static void trace_binary_close()
+{
+    int fd = trace_binary_fd;
+
+    if(fd < 0)
+        return;
+    trace_writer_exit = 1;
+    pthread_join(trace_writer_thread, 0);
+    trace_binary_fd = -1;
+    close(fd);
+}
+
+/******************************************************************************
+ * event loop functions
+ *****************************************************************************/
+static int event_init()
+{
+    event_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(event_epoll_fd < 0)
+        return -errno;
+    return 0;
+}
+
+static void event_close()
+{
+    if(event_epoll_fd >= 0)
+        close(event_epoll_fd);
+    event_epoll_fd = -1;
+}
+
+static int event_add(struct event_source *source, int fd, int priority, event_handler handler, void *context)
+{
+    struct epoll_event event;
+
+    source->fd = fd;
+    source->priority = priority;
+    source->handler = handler;
+    source->context = context;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+    if(epoll_ctl(event_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        return -errno;
+    return 0;
+}
+
+/* events is EPOLLIN, EPOLLOUT or both */
+static int event_modify(struct event_source *source, uint32_t events)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = source;
+    if(epoll_ctl(event_epoll_fd, EPOLL_CTL_MOD, source->fd, &event) < 0)
+        return -errno;
+    return 0;
+}
+
+/* source stays open, handler is not called anymore */
+static void event_del(struct event_source *source)
+{
+    if(epoll_ctl(event_epoll_fd, EPOLL_CTL_DEL, source->fd, 0) < 0)
+        TRACE_ERROR("epoll_ctl DEL");
+}
+
+/*
+ * Waits for one batch of events and calls the handlers, priority sources
+ * first. Returns number of events or negative errno.
+ */
+static int event_dispatch()
+{
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    struct event_source *source;
+    int count,i,priority;
+
+    count = epoll_wait(event_epoll_fd, events, EVENT_MAX_EVENTS, -1);
+    if(count < 0)
+        return errno == EINTR ? 0 : -errno;
+
+    for(priority = 1; priority >= 0; priority--) {
+        for(i = 0; i < count; i++) {
+            source = events[i].data.ptr;
+            if(source->priority == priority)
+                source->handler(source, events[i].events);
+        }
+    }
+    return count;
+}
+
+/* non-blocking monotonic timer, expired timer is readable */
+static int event_timer_create()
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return fd < 0 ? -errno : fd;
+}
+
+/* arms one-shot or periodic timer, zero timeout disarms */
+static int event_timer_set(int fd, const struct timespec *timeout, int periodic)
+{
+    struct itimerspec value;
+
+    memset(&value, 0, sizeof(value));
+    value.it_value = *timeout;
+    if(periodic)
+        value.it_interval = *timeout;
+    if(timerfd_settime(fd, 0, &value, 0) < 0)
+        return -errno;
+    return 0;
+}
+
+/* consumes timer expiration, returns 0 if timer was rearmed or disarmed meanwhile */
+static uint64_t event_timer_expired(int fd)
+{
+    uint64_t expirations;
+
+    if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return 0;
+    return expirations;
+}
+
+/******************************************************************************
+ * signal functions
+ *****************************************************************************/
+static void signal_handler(int sig)
+{
+    TRACE_ENTRY_WARGS(TRACE_FUNCTION, "%s got %d\n",__func__,sig);
+	if(sig == SIGUSR1)
+		stats_request = 1;
+	else
+		exit_request = 1;
+	TRACE_EXIT(TRACE_FUNCTION);
+}
+
+/******************************************************************************
+ * uinput functions
+ *****************************************************************************/
+static int send_input_events();
+
+static int uinput_create()
+{
+	struct uinput_user_dev dev;
+	int fd;
+	unsigned int i;
+	TRACE_ENTRY((TRACE_INPUT|TRACE_FUNCTION));
+
+	fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		fd = open("/dev/input/uinput", O_WRONLY | O_NONBLOCK);
+		if (fd < 0) {
+			fd = open("/dev/misc/uinput", O_WRONLY | O_NONBLOCK);
+			if (fd < 0) {
+				TRACE_ERROR("Can't open input device");
+				goto err;
+			}
+		}
+	}
+
+	memset(&dev, 0, sizeof(dev));
+	snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "BMW IBUS");
+
+	dev.id.bustype = BUS_RS232;
+	dev.id.vendor  = 0x0000;
+	dev.id.product = 0x0000;
+	dev.id.version = 0x0100;
+
+	if (write(fd, &dev, sizeof(dev)) < 0) {
+		TRACE_ERROR("Can't write device information");
+		goto close;
+	}
+
+	if(ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0){
+		TRACE_ERROR("Can't set event bit");
+		goto close;
+	}
+
+	if(knob_wheel.window &&
+	   (ioctl(fd, UI_SET_EVBIT, EV_REL) < 0 || ioctl(fd, UI_SET_RELBIT, REL_WHEEL) < 0)){
+		TRACE_ERROR("Can't set wheel bit");
+		goto close;
+	}
+
+	/*keymap can be reloaded with any keys, device is not created again*/
+	for(i=0; keymap_path && i <= KEY_MAX; i++){
+        if(KEYMAP_KEY_VALID(i) && ioctl(fd, UI_SET_KEYBIT, i) < 0){
+            TRACE_ERROR("Can't set key bit");
+            goto close;
+        }
+	}
+
+	for(i=0; ibus_cdc.enabled && i < sizeof(ibus_cdc_keys)/sizeof(ibus_cdc_keys[0]); i++){
+        if(ioctl(fd, UI_SET_KEYBIT, ibus_cdc_keys[i].key_code) < 0){
+            TRACE_ERROR("Can't set key bit");
+            goto close;
+        }
+	}
+
+	for(i=0; !keymap_path && i < sizeof(headunit_buttons)/sizeof(struct ibus_buttons); i++){
+        if(headunit_buttons[i].key_code!=KEY_UNKNOWN &&
+           headunit_buttons[i].key_code!=RESERVED_BUTTON) {
+            if(ioctl(fd, UI_SET_KEYBIT, headunit_buttons[i].key_code) < 0){
+            	TRACE_ERROR("Can't set key bit");
+                goto close;
+            }
+        }
+        if(headunit_buttons[i].long_key_code &&
+           ioctl(fd, UI_SET_KEYBIT, headunit_buttons[i].long_key_code) < 0){
+            TRACE_ERROR("Can't set key bit");
+            goto close;
+        }
+	}
+
+	if (ioctl(fd, UI_DEV_CREATE, NULL) < 0) {
+		TRACE_ERROR("Can't create uinput device");
+		goto close;
+	}
+
+    TRACE_EXIT((TRACE_INPUT|TRACE_FUNCTION));
+	return fd;
+
+close:
+	close(fd);
+err:
+    TRACE_EXIT_WARGS((TRACE_INPUT|TRACE_FUNCTION)," error %d\n",-errno);
+    return -errno;
+}
+
+static void uinput_close()
+{
+    TRACE_ENTRY((TRACE_INPUT|TRACE_FUNCTION));
+    if (uinput_device_fd >= 0) {
+		ioctl(uinput_device_fd, UI_DEV_DESTROY);
+		close(uinput_device_fd);
+		uinput_device_fd = -1;
+	}
+	TRACE_EXIT((TRACE_INPUT|TRACE_FUNCTION));
+}
+
+/*
+ * Queues input event. Events are written to uinput when the IBus message has
+ * been handled, see send_input_events
+ */
+static int send_input_event(uint16_t type, uint16_t code, int32_t value)
+{
+    struct input_event *event;
+
+    TRACE_ENTRY_WARGS((TRACE_INPUT|TRACE_FUNCTION), "event %d %d, value %d\n",type,code,value);
+
+    /*leave room for the sync event*/
+    if(input_batch.count == IBUS_INPUT_BATCH_SIZE-1) {
+        if(send_input_events() < 0)
+            goto err;
+    }
+
+    event = &input_batch.events[input_batch.count++];
+    memset(event, 0, sizeof(*event));
+    /*arrival of the message, evdev restamps the event on delivery*/
+    event->input_event_sec = ibus_rx_time.tv_sec;
+    event->input_event_usec = ibus_rx_time.tv_nsec/1000;
+	event->type	= type;
+	event->code	= code;
+	event->value	= value;
+
+	TRACE_EXIT((TRACE_INPUT|TRACE_FUNCTION));
+	return 0;
+err:
+    TRACE_EXIT_WARGS((TRACE_INPUT|TRACE_FUNCTION),"error %d",-errno);
+    return -errno;
+}
+
+static int send_key_event(uint16_t key, uint16_t value)
+{
+    int res = send_input_event(EV_KEY, key, value);
+
+    if(!res)
+        input_stats.key_events++;
+    return res;
+}
+
+/*
+ * Writes queued key and wheel events and one sync event with single write
+ * call. Returns number of events written, sync excluded, or negative errno.
+ */
+static int send_input_events()
+{
+    struct input_event *syn_event;
+    unsigned int events = input_batch.count;
+    int res = 0;
+
+    if(!events)
+        return 0;
+
+    TRACE_ENTRY_WARGS((TRACE_INPUT|TRACE_FUNCTION), "%d events\n",events);
+
+    syn_event = &input_batch.events[input_batch.count++];
+    memset(syn_event, 0, sizeof(*syn_event));
+    syn_event->input_event_sec = input_batch.events[0].input_event_sec;
+    syn_event->input_event_usec = input_batch.events[0].input_event_usec;
+	syn_event->type	= EV_SYN;
+	syn_event->code	= SYN_REPORT;
+	syn_event->value	= 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &input_write_time);
+	/*uinput is optional when replaying a capture*/
+	if(uinput_device_fd >= 0 &&
+	   write(uinput_device_fd, input_batch.events, input_batch.count*sizeof(struct input_event)) < 0){
+		TRACE_ERROR("Can't write key events");
+		res = -errno;
+	}
+	input_batch.count = 0;
+
+	/*one event and one sync write per event without batching*/
+	input_stats.writes++;
+	input_stats.saved_writes += 2*events - 1;
+
+	TRACE_EXIT_WARGS((TRACE_INPUT|TRACE_FUNCTION), "res %d\n",res);
+	return res < 0 ? res : (int)events;
+}
+
+/******************************************************************************
+ * button repeat functions
+ *****************************************************************************/
+/**
+ * Held buttons are timers on a hashed timer wheel of BUTTON_WHEEL_SLOTS ticks.
+ * One timerfd is armed to the next tick that has timers and disarmed when
+ * no button is held. Ticks are counted from CLOCK_MONOTONIC, so a late
+ * expiration processes all ticks it missed and repeats stay on the grid
+ * of the press instead of drifting. Repeats missed meanwhile are skipped.
+ */
+#define BUTTON_WHEEL_SLOTS 64 /*power of two*/
+#define BUTTON_WHEEL_TICK_NS 10000000ULL /*10ms*/
+#define BUTTON_LONG_PRESS_MS 800
+#define BUTTON_HOLD_MAX_MS 30000 /*release frame was lost*/
+enum EButtonHold
+    {
+    EButtonReleased = 0,
+    EButtonPressed,
+    EButtonLong /*long key code sent*/
+    };
+
+struct button_hold {
+    struct button_hold *next; /*wheel slot*/
+    struct button_hold **pprev; /*0 when not on the wheel*/
+    uint64_t expires; /*tick*/
+    uint64_t pressed; /*tick*/
+    enum EButtonHold state;
+    struct ibus_key map; /*layer may change or keymap be reloaded while held*/
+};
+
+struct button_wheel {
+    struct button_hold *slots[BUTTON_WHEEL_SLOTS];
+    uint64_t tick; /*last processed tick*/
+    uint64_t armed; /*tick timer expires, 0 if disarmed*/
+    unsigned int count; /*timers on the wheel*/
+};
+
+static struct button_hold button_holds[BUTTON_COUNT];
+static struct button_wheel button_wheel;
+static struct event_source button_timer = { -1 };
+
+static uint64_t button_ticks(unsigned int ms)
+{
+    return (ms*1000000ULL + BUTTON_WHEEL_TICK_NS-1)/BUTTON_WHEEL_TICK_NS;
+}
+
+static uint64_t button_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec*1000000000ULL + now.tv_nsec)/BUTTON_WHEEL_TICK_NS;
+}
+
+static void button_wheel_add(struct button_hold *hold, uint64_t expires)
+{
+    struct button_hold **slot = &button_wheel.slots[expires & (BUTTON_WHEEL_SLOTS-1)];
+
+    hold->expires = expires;
+    hold->next = *slot;
+    if(*slot)
+        (*slot)->pprev = &hold->next;
+    hold->pprev = slot;
+    *slot = hold;
+    button_wheel.count++;
+}
+
+static void button_wheel_del(struct button_hold *hold)
+{
+    if(!hold->pprev)
+        return;
+    *hold->pprev = hold->next;
+    if(hold->next)
+        hold->next->pprev = hold->pprev;
+    hold->next = 0;
+    hold->pprev = 0;
+    button_wheel.count--;
+}
+
+/*
+ * Arms the timer to the next tick that has timers. Timers of later rounds
+ * in that slot only cause one extra wakeup per BUTTON_WHEEL_SLOTS ticks.
+ */
+static void button_wheel_arm(uint64_t now)
+{
+    struct timespec timeout = { 0, 0 };
+    uint64_t tick = 0;
+    int64_t ns;
+    unsigned int i;
+
+    if(button_timer.fd < 0)
+        return;
+    if(button_wheel.count) {
+        for(i = 1; i <= BUTTON_WHEEL_SLOTS; i++) {
+            if(button_wheel.slots[(button_wheel.tick+i) & (BUTTON_WHEEL_SLOTS-1)])
+                break;
+        }
+        tick = button_wheel.tick + i;
+        if(tick <= now)
+            tick = now + 1;
+    }
+    if(tick == button_wheel.armed)
+        return;
+
+    if(tick) {
+        clock_gettime(CLOCK_MONOTONIC, &timeout);
+        /*now may be from the receive time, the tick can have started already*/
+        ns = (int64_t)(tick*BUTTON_WHEEL_TICK_NS - ((uint64_t)timeout.tv_sec*1000000000ULL + timeout.tv_nsec));
+        if(ns < 1)
+            ns = 1;
+        timeout.tv_sec = ns/1000000000LL;
+        timeout.tv_nsec = ns%1000000000LL;
+    }
+    if(event_timer_set(button_timer.fd, &timeout, 0) < 0)
+        TRACE_ERROR("Can't set button timer");
+    button_wheel.armed = tick;
+}
+
+/*
+ * Release of a button that is not held is ignored. Cancel does not send the
+ * key code of a long press button that is still pending.
+ */
+static void button_release(unsigned char button, int cancel)
+{
+    struct button_hold *hold = &button_holds[button];
+    const struct ibus_key *map = &hold->map;
+
+    button_wheel_del(hold);
+    if(hold->state == EButtonReleased) {
+        return;
+    }
+    else if(hold->state == EButtonLong) {
+        send_key_event(map->long_key_code, 0);
+    }
+    else if(map->long_key_code) {
+        /*released before long press, short press is sent now*/
+        if(!cancel) {
+            send_key_event(map->key_code, 1);
+            send_key_event(map->key_code, 0);
+        }
+    }
+    else {
+        send_key_event(map->key_code, 0);
+    }
+    hold->state = EButtonReleased;
+}
+
+static void button_press(unsigned char button, const struct ibus_key *map, uint64_t now)
+{
+    struct button_hold *hold = &button_holds[button];
+
+    /*bus repeats frames, key is already down*/
+    if(hold->state != EButtonReleased)
+        return;
+
+    hold->state = EButtonPressed;
+    hold->pressed = now;
+    hold->map = *map;
+    if(map->long_key_code) {
+        button_wheel_add(hold, now + button_ticks(BUTTON_LONG_PRESS_MS));
+        return;
+    }
+    send_key_event(map->key_code, 1);
+    if(map->repeat_delay)
+        button_wheel_add(hold, now + button_ticks(map->repeat_delay));
+}
+
+static void button_long_press(unsigned char button)
+{
+    struct button_hold *hold = &button_holds[button];
+
+    button_wheel_del(hold);
+    send_key_event(hold->map.long_key_code, 1);
+    input_stats.long_presses++;
+    hold->state = EButtonLong;
+    button_wheel_add(hold, hold->pressed + button_ticks(BUTTON_HOLD_MAX_MS));
+}
+
+static void button_expired(unsigned char button, uint64_t now)
+{
+    struct button_hold *hold = &button_holds[button];
+    const struct ibus_key *map = &hold->map;
+    uint64_t rate,expires;
+
+    if(now - hold->pressed >= button_ticks(BUTTON_HOLD_MAX_MS)) {
+        TRACE_WARGS(TRACE_INPUT, "%s held %dms without release\n", headunit_buttons[button].name, BUTTON_HOLD_MAX_MS);
+        input_stats.stuck++;
+        button_release(button, 1);
+        return;
+    }
+    if(hold->state == EButtonPressed && map->long_key_code) {
+        button_long_press(button);
+        return;
+    }
+    if(!map->repeat_delay)
+        return;
+
+    send_key_event(map->key_code, 2);
+    input_stats.repeats++;
+    rate = button_ticks(map->repeat_rate);
+    if(!rate)
+        rate = 1;
+    expires = hold->expires + rate;
+    if(expires <= now) {
+        input_stats.repeats_skipped += (now - expires)/rate + 1;
+        expires += ((now - expires)/rate + 1)*rate;
+    }
+    button_wheel_add(hold, expires);
+}
+
+/*
+ * Processes the ticks since the last expiration. A slot is detached before
+ * it is walked because repeats are added back to the wheel.
+ */
+static void on_button_timeout(struct event_source *source, uint32_t events)
+{
+    struct button_hold *hold,*next;
+    uint64_t now,steps;
+    unsigned int slot;
+
+    if(!event_timer_expired(source->fd))
+        return;
+    button_wheel.armed = 0;
+
+    now = button_now();
+    steps = now - button_wheel.tick;
+    if(steps > BUTTON_WHEEL_SLOTS)
+        steps = BUTTON_WHEEL_SLOTS;
+    for(; steps; steps--) {
+        slot = (++button_wheel.tick) & (BUTTON_WHEEL_SLOTS-1);
+        hold = button_wheel.slots[slot];
+        button_wheel.slots[slot] = 0;
+        for(; hold; hold = next) {
+            next = hold->next;
+            hold->next = 0;
+            hold->pprev = 0;
+            button_wheel.count--;
+            if(hold->expires <= now)
+                button_expired(hold - button_holds, now);
+            else
+                button_wheel_add(hold, hold->expires);
+        }
+    }
+    button_wheel.tick = now;
+
+    send_input_events();
+    button_wheel_arm(now);
+}
+
+/* releases held buttons without sending pending long press buttons */
+static void button_release_all()
+{
+    unsigned int i;
+
+    for(i = 0; i < BUTTON_COUNT; i++) {
+        if(button_holds[i].state != EButtonReleased)
+            button_release(i, 1);
+    }
+    button_wheel_arm(button_wheel.tick);
+}
+
+static void handle_ibus_button(unsigned char button, unsigned char released,unsigned char longPress)
+{
+    const struct ibus_key *map;
+    uint64_t now;
+
+    TRACE_ENTRY_WARGS((TRACE_INPUT|TRACE_FUNCTION), "button %d, released %d, longPress %d\n",button,released,longPress);
+
+    if(send_key_events && button < BUTTON_COUNT){
+        map = &keymap->layers[ibus_state][button];
+        now = button_now();
+        /*wheel has been idle, it starts from now*/
+        if(!button_wheel.count)
+            button_wheel.tick = now;
+
+        if(released) {
+            button_release(button, 0);
+        }
+        else if(map->key_code!=KEY_UNKNOWN && map->key_code!=RESERVED_BUTTON) {
+            button_press(button, map, now);
+            /*bus noticed the long press before the timer*/
+            if(longPress && button_holds[button].state == EButtonPressed &&
+               button_holds[button].map.long_key_code)
+                button_long_press(button);
+        }
+        button_wheel_arm(now);
+    }
+
+    TRACE_EXIT((TRACE_INPUT|TRACE_FUNCTION));
+}
+
+
+/******************************************************************************
+ * knob functions
+ *****************************************************************************/
+#define KNOB_WINDOW_DEFAULT 40 /*ms*/
+#define KNOB_ACCELERATION_DEFAULT 25 /*%*/
+
+static struct event_source knob_timer = { -1 };
+
+/* parses -w window ms[,acceleration %] */
+static int knob_wheel_parse(const char *arg)
+{
+    unsigned int window = KNOB_WINDOW_DEFAULT,acceleration = KNOB_ACCELERATION_DEFAULT;
+    char end;
+    int n;
+
+    n = sscanf(arg, "%u,%u%c", &window, &acceleration, &end);
+    if(n < 1 || n > 2 || window < 1 || window > 1000 || acceleration > 1000)
+        return -EINVAL;
+    knob_wheel.window = window;
+    knob_wheel.acceleration = acceleration;
+    return 0;
+}
+
+/*
+ * Sends the coalesced detents. Every detent after the first one in the
+ * window adds acceleration % to the gain, e.g. with 25% 4 detents scroll 7
+ * lines and 8 detents 22 lines. Clockwise is sent as negative REL_WHEEL,
+ * which scrolls down, because clockwise moves the board monitor cursor down
+ * the list and KEY_RIGHT it replaces selects the next item.
+ */
+static void knob_wheel_flush()
+{
+    int detents = knob_wheel.detents;
+    unsigned int count = detents < 0 ? -detents : detents;
+    int value;
+
+    if(!count)
+        return;
+    knob_wheel.detents = 0;
+    value = (count*(100 + knob_wheel.acceleration*(count-1)) + 50)/100;
+    if(send_input_event(EV_REL, REL_WHEEL, detents > 0 ? -value : value) == 0)
+        input_stats.wheel_events++;
+}
+
+/*
+ * First detents open the window, detents to the other direction close it.
+ * Without the event loop, e.g. when replaying a capture, every frame is
+ * one event.
+ */
+static void knob_wheel_turn(int detents)
+{
+    struct timespec timeout = { 0, 0 };
+
+    input_stats.knob_detents += detents < 0 ? -detents : detents;
+    if((knob_wheel.detents < 0) != (detents < 0))
+        knob_wheel_flush();
+    if(!knob_wheel.detents && knob_timer.fd >= 0) {
+        timeout.tv_nsec = knob_wheel.window*1000000L;
+        timeout.tv_sec = timeout.tv_nsec/1000000000L;
+        timeout.tv_nsec %= 1000000000L;
+        if(event_timer_set(knob_timer.fd, &timeout, 0) < 0)
+            TRACE_ERROR("Can't set knob timer");
+    }
+    knob_wheel.detents += detents;
+    if(knob_timer.fd < 0)
+        knob_wheel_flush();
+}
+
+static void on_knob_timeout(struct event_source *source, uint32_t events)
+{
+    if(!event_timer_expired(source->fd))
+        return;
+    knob_wheel_flush();
+    send_input_events();
+}
+
+
+/******************************************************************************
+ * IBUS functions
+ *****************************************************************************/
+/*
+ * Set/Disable line. Bits are set or cleared with one ioctl, other modem
+ * lines are not touched.
+ */
+static int set_line(int line,int enable)
+{
+    TRACE_ENTRY_WARGS(TRACE_STATE, "line=%x,enable=%d\n",line,enable);
+
+    if(line < TIOCM_LE || line > TIOCM_DSR){
+    	printf("invalid line %d",line);
+    	errno = EINVAL;
+    	goto err;
+    }
+
+    /*video switch is wired to the modem lines of the first bus*/
+    if(ioctl(ibus_buses[0].fd, enable ? TIOCMBIS : TIOCMBIC, &line) < 0){
+    	TRACE_ERROR("Can't set TIOCM");
+    	goto err;
+    }
+
+    TRACE_EXIT(TRACE_STATE);
+    return 0;
+err:
+	TRACE_EXIT_WARGS(TRACE_STATE, "error %d",-errno);
+	return -errno;
+}
+
+/*
+ * -g chip:line[:low] requests the line of GPIO character device as output.
+ * Returns 0 or negative errno.
+ */
+static int video_gpio_open(const char *spec)
+{
+    struct gpio_v2_line_request request;
+    char chip[PATH_MAX];
+    unsigned int line;
+    char flags[8] = "";
+    int fd,res;
+
+    if(sscanf(spec, "%4095[^:]:%u:%7s", chip, &line, flags) < 2 ||
+       (flags[0] && strcmp(flags, "low")!=0))
+        return -EINVAL;
+
+    fd = open(chip, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -errno;
+    memset(&request, 0, sizeof(request));
+    request.offsets[0] = line;
+    request.num_lines = 1;
+    request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    if(flags[0])
+        request.config.flags |= GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+    strncpy(request.consumer, "bmw-ibus video", sizeof(request.consumer)-1);
+    res = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &request);
+    res = res < 0 ? -errno : 0;
+    close(fd);
+    if(res < 0)
+        return res;
+
+    ibus_video.gpio_fd = request.fd;
+    VideoInputSwitch = ESwitchGPIO;
+    return 0;
+}
+
+static void video_gpio_close()
+{
+    if(ibus_video.gpio_fd >= 0)
+        close(ibus_video.gpio_fd);
+    ibus_video.gpio_fd = -1;
+}
+
+static int set_gpio(int enable)
+{
+    struct gpio_v2_line_values values = { enable ? 1 : 0, 1 };
+
+    if(ibus_video.gpio_fd < 0) {
+        errno = ENODEV;
+        return -errno;
+    }
+    if(ioctl(ibus_video.gpio_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+        TRACE_ERROR("Can't set GPIO");
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Output is cached, nothing is done if the switch is already there. Only a
+ * successful switch is cached, a failed one is tried again.
+ */
+static void enable_video_input(int enable)
+{
+	int res;
+
+	TRACE_ENTRY_WARGS(TRACE_STATE, "enable %d\n",enable);
+
+	if(enable == ibus_video.output) {
+		ibus_video.skipped++;
+		goto exit;
+	}
+
+	switch(VideoInputSwitch)
+		{
+		case ESwitchCTS:
+			{
+			res = set_line(TIOCM_CTS,enable);
+			break;
+			}
+		case ESwitchRTS:
+			{
+			res = set_line(TIOCM_RTS,enable);
+			break;
+			}
+		case ESwitchGPIO:
+			{
+			res = set_gpio(enable);
+			break;
+			}
+		case ESwitchUnknown:
+		default:
+			{
+			/*no switch, nothing to cache*/
+			goto exit;
+			}
+		}
+	if(res < 0) {
+		ibus_video.output = -1;
+		ibus_video.failed++;
+		goto exit;
+	}
+	ibus_video.output = enable;
+	ibus_video.switches++;
+
+exit:
+	TRACE_EXIT(TRACE_STATE);
+}
+
+/* video is on in the hijack state and in reverse gear */
+static void ibus_video_update()
+{
+    enable_video_input(ibus_video.hijack || ibus_video.reverse);
+}
+
+/* returns the state for hijack and text pattern options */
+static enum EIbusState ibus_state_from_name(const char *name)
+{
+    if(strcmp(name,"TAPE")==0)
+        return EStateTAPE;
+    else if(strcmp(name,"AUX")==0)
+        return EStateAUX;
+    else if(strcmp(name,"FM")==0)
+        return EStateFM;
+    else if(strcmp(name,"MENU")==0)
+        return EStateMenu;
+    else if(strcmp(name,"CDC")==0)
+        return EStateCDChanger;
+    return EStateUnknown;
+}
+
+/* keys are sent in the hijack state and in the states keymap has a layer for */
+static void ibus_update_key_events()
+{
+    send_key_events = (ibus_state==IbusHijackState && IbusHijackState!=EStateUnknown) ||
+                      keymap->enabled[ibus_state];
+    if(!send_key_events)
+        button_release_all();
+}
+
+/*
+ * Change the IBUS state machine state. This controls when video output is
+ * enabled and when buttons events are injected to the system queue
+ */
+static void ibus_change_state(enum EIbusState aNewState)
+    {
+    TRACE_ENTRY_WARGS(TRACE_STATE, "new state %d\n",aNewState);
+
+    if(ibus_state==aNewState){
+    	TRACE_WARGS(TRACE_STATE, "state already %d -> do nothing\n",aNewState);
+    	goto exit;
+    }
+
+    ibus_state = aNewState;
+
+    ibus_update_key_events();
+    ibus_video.hijack = ibus_state==IbusHijackState && IbusHijackState!=EStateUnknown;
+    ibus_video_update();
+
+    if(ibus_state==EStateAUX)
+        TRACE(TRACE_STATE,"IBUS STATE changed to AUX\n");
+    else if(ibus_state==EStateFM)
+        TRACE(TRACE_STATE,"IBUS STATE changed to FM\n");
+    else if(ibus_state==EStateMenu)
+        TRACE(TRACE_STATE,"IBUS STATE changed to MENU\n");
+    else if(ibus_state==EStatePowerOff)
+        TRACE(TRACE_STATE,"IBUS STATE changed to POWEROFF\n");
+    else if(ibus_state==EStateTAPE)
+        TRACE(TRACE_STATE,"IBUS STATE changed to TAPE\n");
+    else if(ibus_state==EStateCDChanger)
+        TRACE(TRACE_STATE,"IBUS STATE changed to CDC\n");
+    else if(ibus_state==EStateUnknown)
+        TRACE(TRACE_STATE,"IBUS STATE changed to UNKNOWN\n");
+
+exit:
+    TRACE_EXIT(TRACE_STATE);
+    }
+
+
+/******************************************************************************
+ * keymap functions
+ *****************************************************************************/
+#define KEYMAP_KEY(key) { #key, key }
+static const struct {
+    const char *name;
+    uint16_t code;
+} keymap_key_names[] = {
+    KEYMAP_KEY(KEY_ESC), KEYMAP_KEY(KEY_1), KEYMAP_KEY(KEY_2), KEYMAP_KEY(KEY_3),
+    KEYMAP_KEY(KEY_4), KEYMAP_KEY(KEY_5), KEYMAP_KEY(KEY_6), KEYMAP_KEY(KEY_7),
+    KEYMAP_KEY(KEY_8), KEYMAP_KEY(KEY_9), KEYMAP_KEY(KEY_0), KEYMAP_KEY(KEY_BACKSPACE),
+    KEYMAP_KEY(KEY_TAB), KEYMAP_KEY(KEY_ENTER), KEYMAP_KEY(KEY_SPACE),
+    KEYMAP_KEY(KEY_F1), KEYMAP_KEY(KEY_F2), KEYMAP_KEY(KEY_F3), KEYMAP_KEY(KEY_F4),
+    KEYMAP_KEY(KEY_F5), KEYMAP_KEY(KEY_F6), KEYMAP_KEY(KEY_F7), KEYMAP_KEY(KEY_F8),
+    KEYMAP_KEY(KEY_F9), KEYMAP_KEY(KEY_F10), KEYMAP_KEY(KEY_F11), KEYMAP_KEY(KEY_F12),
+    KEYMAP_KEY(KEY_HOME), KEYMAP_KEY(KEY_END), KEYMAP_KEY(KEY_PAGEUP), KEYMAP_KEY(KEY_PAGEDOWN),
+    KEYMAP_KEY(KEY_UP), KEYMAP_KEY(KEY_DOWN), KEYMAP_KEY(KEY_LEFT), KEYMAP_KEY(KEY_RIGHT),
+    KEYMAP_KEY(KEY_MENU), KEYMAP_KEY(KEY_SETUP), KEYMAP_KEY(KEY_BACK), KEYMAP_KEY(KEY_CONTEXT_MENU),
+    KEYMAP_KEY(KEY_MUTE), KEYMAP_KEY(KEY_VOLUMEDOWN), KEYMAP_KEY(KEY_VOLUMEUP),
+    KEYMAP_KEY(KEY_PLAYPAUSE), KEYMAP_KEY(KEY_STOPCD), KEYMAP_KEY(KEY_NEXTSONG),
+    KEYMAP_KEY(KEY_PREVIOUSSONG), KEYMAP_KEY(KEY_FASTFORWARD), KEYMAP_KEY(KEY_REWIND),
+    KEYMAP_KEY(KEY_SELECT), KEYMAP_KEY(KEY_OK), KEYMAP_KEY(KEY_INFO), KEYMAP_KEY(KEY_PHONE),
+    KEYMAP_KEY(KEY_RADIO), KEYMAP_KEY(KEY_TAPE), KEYMAP_KEY(KEY_AUX), KEYMAP_KEY(KEY_CAMERA)
+};
+
+/* layers of all states are the compiled-in table, no state has own layer */
+static void ibus_keymap_default(struct ibus_keymap *map)
+{
+    struct ibus_key *key;
+    unsigned int state,i;
+
+    memset(map, 0, sizeof(*map));
+    for(state = 0; state < EStateCount; state++) {
+        for(i = 0; i < BUTTON_COUNT; i++) {
+            key = &map->layers[state][i];
+            key->key_code = headunit_buttons[i].key_code;
+            key->long_key_code = headunit_buttons[i].long_key_code;
+            key->repeat_delay = headunit_buttons[i].repeat_delay;
+            key->repeat_rate = headunit_buttons[i].repeat_rate;
+        }
+    }
+}
+
+/* button code or name of headunit_buttons */
+static int ibus_keymap_button(const char *name)
+{
+    unsigned long code;
+    unsigned int i;
+    char *end;
+
+    code = strtoul(name, &end, 0);
+    if(end != name && !*end)
+        return code < BUTTON_COUNT ? (int)code : -EINVAL;
+    for(i = 0; i < BUTTON_COUNT; i++) {
+        if(strcmp(name, headunit_buttons[i].name)==0)
+            return i;
+    }
+    return -EINVAL;
+}
+
+/* key name, code or none */
+static int ibus_keymap_key(const char *name)
+{
+    unsigned long code;
+    unsigned int i;
+    char *end;
+
+    if(strcmp(name, "none")==0)
+        return KEY_UNKNOWN;
+    code = strtoul(name, &end, 0);
+    if(end != name && !*end)
+        return KEYMAP_KEY_VALID(code) ? (int)code : -EINVAL;
+    for(i = 0; i < sizeof(keymap_key_names)/sizeof(keymap_key_names[0]); i++) {
+        if(strcmp(name, keymap_key_names[i].name)==0)
+            return keymap_key_names[i].code;
+    }
+    return -EINVAL;
+}
+
+/*
+ * Parses button key [long=key] [repeat=delay,rate] to the layers of the
+ * states in the mask. Buttons that change the radio state can't be mapped.
+ */
+static int ibus_keymap_parse_line(struct ibus_keymap *map, unsigned int states, char *line)
+{
+    struct ibus_key key;
+    char *token,*save;
+    unsigned int delay,rate,state;
+    int button,code;
+    char end;
+
+    token = strtok_r(line, " \t\r\n", &save);
+    if(!token)
+        return 0;
+    button = ibus_keymap_button(token);
+    if(button < 0 || headunit_buttons[button].key_code == RESERVED_BUTTON)
+        return -EINVAL;
+    token = strtok_r(0, " \t\r\n", &save);
+    if(!token || (code = ibus_keymap_key(token)) < 0)
+        return -EINVAL;
+
+    memset(&key, 0, sizeof(key));
+    key.key_code = code;
+    while((token = strtok_r(0, " \t\r\n", &save))) {
+        if(strncmp(token, "long=", 5)==0) {
+            if((code = ibus_keymap_key(token+5)) < 0 || code == KEY_UNKNOWN)
+                return -EINVAL;
+            key.long_key_code = code;
+        }
+        else if(strncmp(token, "repeat=", 7)==0) {
+            if(sscanf(token+7, "%u,%u%c", &delay, &rate, &end) != 2 ||
+               !delay || delay > 10000 || !rate || rate > 10000)
+                return -EINVAL;
+            key.repeat_delay = delay;
+            key.repeat_rate = rate;
+        }
+        else {
+            return -EINVAL;
+        }
+    }
+
+    for(state = 0; state < EStateCount; state++) {
+        if(states & (1 << state))
+            map->layers[state][button] = key;
+    }
+    return 0;
+}
+
+/*
+ * Loads keymap file. Mappings before the first [STATE] section are for all
+ * states, mappings in a section only for that state and the section makes
+ * keys to be sent in it. Buttons that are not mapped keep the compiled-in
+ * mapping. Returns 0 or negative errno, line tells the invalid line.
+ */
+static int ibus_keymap_load(const char *path, struct ibus_keymap *map, unsigned int *line)
+{
+    char buffer[256],*p;
+    unsigned int states = (1 << EStateCount)-1;
+    enum EIbusState state;
+    FILE *fp;
+    int res = 0;
+
+    *line = 0;
+    ibus_keymap_default(map);
+    fp = fopen(path, "r");
+    if(!fp)
+        return -errno;
+
+    while(fgets(buffer, sizeof(buffer), fp)) {
+        (*line)++;
+        if((p = strchr(buffer, '#')))
+            *p = '\0';
+        p = buffer + strspn(buffer, " \t");
+        if(*p == '[') {
+            p = strtok(p+1, "]");
+            state = p ? ibus_state_from_name(p) : EStateUnknown;
+            if(state == EStateUnknown) {
+                res = -EINVAL;
+                break;
+            }
+            map->enabled[state] = 1;
+            states = 1 << state;
+        }
+        else if((res = ibus_keymap_parse_line(map, states, p)) < 0) {
+            break;
+        }
+    }
+    if(!res && ferror(fp))
+        res = -EIO;
+    fclose(fp);
+    return res;
+}
+
+/*
+ * Loads -k keymap to a new map and swaps it in. Old map stays if the file
+ * is invalid, e.g. editor has not written all of it yet.
+ */
+static int ibus_keymap_reload(unsigned int *line)
+{
+    struct ibus_keymap *map,*old = keymap;
+    int res;
+
+    *line = 0;
+    map = malloc(sizeof(*map));
+    if(!map)
+        return -ENOMEM;
+    res = ibus_keymap_load(keymap_path, map, line);
+    if(res < 0) {
+        TRACE_WARGS(TRACE_ALL, "keymap %s line %u invalid, error %d\n",keymap_path,*line,res);
+        free(map);
+        return res;
+    }
+
+    keymap = map;
+    if(old != &default_keymap)
+        free(old);
+    ibus_update_key_events();
+    TRACE_WARGS(TRACE_ALL, "keymap %s loaded\n",keymap_path);
+    return 0;
+}
+
+
+/******************************************************************************
+ * capture functions
+ *****************************************************************************/
+/* buses must be added before capture is opened */
+static int capture_open(const char *path)
+{
+    struct capture_file_header header;
+    struct capture_bus_header buses;
+    struct timespec now;
+    unsigned int i;
+
+    capture_fp = fopen(path, "wb");
+    if(!capture_fp)
+        return -errno;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memcpy(header.magic, CAPTURE_FILE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_FILE_VERSION;
+    header.byte_order = CAPTURE_FILE_BYTE_ORDER;
+    header.start = (uint64_t)now.tv_sec*1000000000ULL + now.tv_nsec;
+    memset(&buses, 0, sizeof(buses));
+    buses.count = ibus_bus_count;
+    for(i = 0; i < ibus_bus_count; i++)
+        buses.types[i] = ibus_buses[i].type;
+    if(fwrite(&header, sizeof(header), 1, capture_fp) != 1 ||
+       fwrite(&buses, sizeof(buses), 1, capture_fp) != 1) {
+        fclose(capture_fp);
+        capture_fp = 0;
+        return -EIO;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &capture_last);
+    return 0;
+}
+
+/*
+ * Writes length bytes received to the ring of the bus at position start as
+ * one record. Capture is buffered by stdio, write errors stop the capture.
+ */
+static void capture_write(const struct ibus_bus *bus, unsigned int start, unsigned int length)
+{
+    const struct ibus_ring *ring = &bus->rx.ring;
+    struct capture_record_header record;
+    struct timespec now;
+    uint64_t delta;
+    unsigned int first;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    delta = (uint64_t)(now.tv_sec - capture_last.tv_sec)*1000000 +
+            (now.tv_nsec - capture_last.tv_nsec)/1000;
+    capture_last = now;
+
+    record.delta = delta > UINT32_MAX ? UINT32_MAX : delta;
+    record.length = length;
+    record.bus = bus->index;
+
+    /*received bytes may wrap around the end of the ring*/
+    start &= IBUS_RING_MASK;
+    first = IBUS_RING_SIZE - start;
+    if(first > length)
+        first = length;
+    if(fwrite(&record, sizeof(record), 1, capture_fp) != 1 ||
+       fwrite(&ring->data[start], first, 1, capture_fp) != 1 ||
+       (length > first && fwrite(ring->data, length-first, 1, capture_fp) != 1)) {
+        TRACE_ERROR("Can't write capture, capture stopped");
+        fclose(capture_fp);
+        capture_fp = 0;
+    }
+}
+
+static void capture_close()
+{
+    if(!capture_fp)
+        return;
+    if(fclose(capture_fp) != 0)
+        TRACE_ERROR("Can't close capture");
+    capture_fp = 0;
+}
+
+/* opens capture for replay and checks the header. Returns 0 or negative errno */
+static int capture_open_read(struct capture_reader *reader, const char *path)
+{
+    struct capture_file_header header;
+    unsigned int i;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->fp = fopen(path, "rb");
+    if(!reader->fp)
+        return -errno;
+
+    if(fread(&header, sizeof(header), 1, reader->fp) != 1 ||
+       memcmp(header.magic, CAPTURE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+       header.version < 1 || header.version > CAPTURE_FILE_VERSION ||
+       header.byte_order != CAPTURE_FILE_BYTE_ORDER)
+        goto invalid;
+
+    reader->version = header.version;
+    if(header.version == 1) {
+        reader->buses.count = 1;
+        reader->buses.types[0] = EBusIBus;
+    }
+    else if(fread(&reader->buses, sizeof(reader->buses), 1, reader->fp) != 1 ||
+            reader->buses.count == 0 || reader->buses.count > IBUS_MAX_BUSES)
+        goto invalid;
+
+    for(i = 0; i < reader->buses.count; i++) {
+        if(reader->buses.types[i] > EBusDBus)
+            goto invalid;
+    }
+    return 0;
+
+invalid:
+    fclose(reader->fp);
+    reader->fp = 0;
+    return -EINVAL;
+}
+
+static void capture_close_read(struct capture_reader *reader)
+{
+    if(reader->fp)
+        fclose(reader->fp);
+    reader->fp = 0;
+}
+
+/*
+ * Reads next record to data, which must hold IBUS_RING_SIZE bytes.
+ * Returns 1 if record was read, 0 at the end of capture and negative errno
+ * if capture is truncated or corrupted.
+ */
+static int capture_read(struct capture_reader *reader, struct capture_record_header *record, unsigned char *data)
+{
+    size_t size = sizeof(*record);
+
+    record->bus = 0;
+    if(reader->version == 1)
+        size = offsetof(struct capture_record_header, bus);
+    if(fread(record, size, 1, reader->fp) != 1)
+        return feof(reader->fp) ? 0 : -EIO;
+    if(record->length > IBUS_RING_SIZE || record->bus >= reader->buses.count)
+        return -EINVAL;
+    if(record->length && fread(data, record->length, 1, reader->fp) != 1)
+        return -EIO;
+    return 1;
+}
+
+/*
+ * Sleeps until capture time elapsed_us, scaled by replay speed, has passed
+ * since start of the replay.
+ */
+static void replay_wait(const struct timespec *start, uint64_t elapsed_us)
+{
+    struct timespec due;
+    uint64_t ns;
+
+    if(replay_speed <= 0)
+        return;
+
+    ns = (uint64_t)(elapsed_us*1000.0/replay_speed);
+    due.tv_sec = start->tv_sec + ns/1000000000ULL;
+    due.tv_nsec = start->tv_nsec + ns%1000000000ULL;
+    if(due.tv_nsec >= 1000000000L) {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+    }
+    while(!exit_request && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0) == EINTR)
+        ;
+}
+
+/******************************************************************************
+ * latency functions
+ *****************************************************************************/
+static inline unsigned int ibus_latency_bucket(uint32_t us)
+{
+    unsigned int msb,bucket;
+
+    if(us < 4)
+        return us;
+    msb = 31 - __builtin_clz(us);
+    bucket = 4*(msb-1) + ((us >> (msb-2))&3);
+    return bucket < IBUS_LATENCY_BUCKETS ? bucket : IBUS_LATENCY_BUCKETS-1;
+}
+
+/* largest value of the bucket */
+static inline uint32_t ibus_latency_bucket_max(unsigned int bucket)
+{
+    unsigned int msb;
+
+    if(bucket < 4)
+        return bucket;
+    msb = bucket/4 + 1;
+    return ((4 + bucket%4) << (msb-2)) + (1 << (msb-2)) - 1;
+}
+
+static inline void ibus_histogram_add(struct ibus_latency_histogram *histogram, int64_t us)
+{
+    if(us < 0)
+        us = 0;
+    if(us > UINT32_MAX)
+        us = UINT32_MAX;
+    histogram->count++;
+    histogram->buckets[ibus_latency_bucket(us)]++;
+    if(us > histogram->max)
+        histogram->max = us;
+}
+
+static void ibus_latency_add(struct ibus_latency_histogram *histogram, const struct timespec *from, const struct timespec *to)
+{
+    ibus_histogram_add(histogram, (int64_t)(to->tv_sec - from->tv_sec)*1000000 + (to->tv_nsec - from->tv_nsec)/1000);
+}
+
+/* returns upper bound of the bucket of the percentile */
+static uint32_t ibus_latency_percentile(const struct ibus_latency_histogram *histogram, unsigned int percentile)
+{
+    uint64_t wanted = ((uint64_t)histogram->count*percentile + 99)/100;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for(i = 0; i < IBUS_LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if(seen >= wanted && seen)
+            break;
+    }
+    if(i >= IBUS_LATENCY_BUCKETS-1 || ibus_latency_bucket_max(i) > histogram->max)
+        return histogram->max;
+    return ibus_latency_bucket_max(i);
+}
+
+static void print_latency(int fd)
+{
+    const struct ibus_latency *latency;
+    const char *name;
+    unsigned int slot,message;
+
+    for(slot = 0; slot <= IBUS_MAX_HANDLERS; slot++) {
+        latency = &ibus_latency[slot];
+        if(!latency->dispatch.count)
+            continue;
+
+        name = "other";
+        for(message = 0; slot && message < 256; message++) {
+            if(ibus_dispatch_index[message] == slot) {
+                name = IBUSMessages[message];
+                break;
+            }
+        }
+
+        /*binary trace takes TRACE_MAX_ARGS arguments per line*/
+        STATS_PRINT(fd, "latency %s: %u messages dispatched p50 %uus p99 %uus max %uus\n",
+            name, latency->dispatch.count,
+            ibus_latency_percentile(&latency->dispatch, 50),
+            ibus_latency_percentile(&latency->dispatch, 99),
+            latency->dispatch.max);
+        STATS_PRINT(fd, "latency %s: %u injected p50 %uus p99 %uus max %uus\n",
+            name, latency->inject.count,
+            ibus_latency_percentile(&latency->inject, 50),
+            ibus_latency_percentile(&latency->inject, 99),
+            latency->inject.max);
+    }
+}
+
+/******************************************************************************
+ * checksum kernels
+ *****************************************************************************/
+/*
+ * XOR of length bytes. Frames are short so a word at a time is enough for
+ * them, SIMD versions are for the large blocks of capture analysis.
+ */
+static unsigned char ibus_xor_scalar(const unsigned char *data, size_t length)
+{
+    uint64_t acc = 0,word;
+
+    for(; length >= sizeof(word); data += sizeof(word), length -= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        acc ^= word;
+    }
+    while(length--)
+        acc ^= *data++;
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    return acc;
+}
+
+/* out[i] is XOR of data[0..i] */
+static void ibus_prefix_xor_scalar(const unsigned char *data, unsigned char *out, size_t length)
+{
+    unsigned char acc = 0;
+    size_t i;
+
+    for(i = 0; i < length; i++)
+        out[i] = acc ^= data[i];
+}
+
+#ifdef IBUS_X86
+static inline unsigned char ibus_xor_fold128(__m128i acc)
+{
+    uint64_t words[2];
+
+    _mm_storeu_si128((__m128i*)words, acc);
+    return ibus_xor_scalar((const unsigned char*)words, sizeof(words));
+}
+
+__attribute__((target("sse2")))
+static unsigned char ibus_xor_sse2(const unsigned char *data, size_t length)
+{
+    __m128i acc = _mm_setzero_si128();
+
+    for(; length >= 16; data += 16, length -= 16)
+        acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i*)data));
+    return ibus_xor_fold128(acc) ^ ibus_xor_scalar(data, length);
+}
+
+__attribute__((target("avx2")))
+static unsigned char ibus_xor_avx2(const unsigned char *data, size_t length)
+{
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+
+    /*two accumulators keep both load ports busy*/
+    for(; length >= 64; data += 64, length -= 64) {
+        acc0 = _mm256_xor_si256(acc0, _mm256_loadu_si256((const __m256i*)data));
+        acc1 = _mm256_xor_si256(acc1, _mm256_loadu_si256((const __m256i*)(data+32)));
+    }
+    acc0 = _mm256_xor_si256(acc0, acc1);
+    return ibus_xor_fold128(_mm_xor_si128(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1))) ^
+           ibus_xor_sse2(data, length);
+}
+
+/*
+ * Prefix XOR of 16 bytes in log steps, carry is the last prefix byte of the
+ * previous block broadcast to all bytes.
+ */
+__attribute__((target("sse2")))
+static void ibus_prefix_xor_sse2(const unsigned char *data, unsigned char *out, size_t length)
+{
+    __m128i x,carry = _mm_setzero_si128();
+    unsigned char acc;
+    size_t i;
+
+    for(; length >= 16; data += 16, out += 16, length -= 16) {
+        x = _mm_loadu_si128((const __m128i*)data);
+        x = _mm_xor_si128(x, _mm_slli_si128(x, 1));
+        x = _mm_xor_si128(x, _mm_slli_si128(x, 2));
+        x = _mm_xor_si128(x, _mm_slli_si128(x, 4));
+        x = _mm_xor_si128(x, _mm_slli_si128(x, 8));
+        x = _mm_xor_si128(x, carry);
+        _mm_storeu_si128((__m128i*)out, x);
+        carry = _mm_srli_si128(x, 15);
+        carry = _mm_unpacklo_epi8(carry, carry);
+        carry = _mm_unpacklo_epi16(carry, carry);
+        carry = _mm_shuffle_epi32(carry, 0);
+    }
+    acc = _mm_cvtsi128_si32(carry);
+    for(i = 0; i < length; i++)
+        out[i] = acc ^= data[i];
+}
+#endif
+
+static unsigned char ibus_xor_select(const unsigned char *data, size_t length);
+static void ibus_prefix_xor_select(const unsigned char *data, unsigned char *out, size_t length);
+/* best kernels of the cpu, picked on first call */
+static unsigned char (*ibus_xor_block)(const unsigned char *data, size_t length) = ibus_xor_select;
+static void (*ibus_prefix_xor)(const unsigned char *data, unsigned char *out, size_t length) = ibus_prefix_xor_select;
+
+static void ibus_select_kernels()
+{
+    ibus_xor_block = ibus_xor_scalar;
+    ibus_prefix_xor = ibus_prefix_xor_scalar;
+#ifdef IBUS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) {
+        ibus_xor_block = ibus_xor_sse2;
+        ibus_prefix_xor = ibus_prefix_xor_sse2;
+    }
+    if(__builtin_cpu_supports("avx2"))
+        ibus_xor_block = ibus_xor_avx2;
+#endif
+}
+
+static unsigned char ibus_xor_select(const unsigned char *data, size_t length)
+{
+    ibus_select_kernels();
+    return ibus_xor_block(data, length);
+}
+
+static void ibus_prefix_xor_select(const unsigned char *data, unsigned char *out, size_t length)
+{
+    ibus_select_kernels();
+    ibus_prefix_xor(data, out, length);
+}
+
+/* short frames are not worth the indirect call */
+static inline unsigned char ibus_xor(const unsigned char *data, size_t length)
+{
+    return length < 64 ? ibus_xor_scalar(data, length) : ibus_xor_block(data, length);
+}
+
+/******************************************************************************
+ * state prediction functions
+ *****************************************************************************/
+/**
+ * Radio tells its state with display text, which comes hundreds of ms after
+ * the button press or cassette frame that changed it. State is changed on
+ * those already and the text confirms the prediction or rolls it back. Until
+ * then menu from LCD clear is only remembered, it is the state rolled back to
+ * if text does not come within IBUS_PREDICT_TIMEOUT_MS.
+ */
+#define IBUS_PREDICT_TIMEOUT_MS 1500
+/* screen text refresh may already be on the way when Mode is pressed */
+#define IBUS_PREDICT_SETTLE_MS 300
+/* cassette status data when tape is in and plays, 0x05 is no tape */
+#define IBUS_CASSETTE_PLAYING 0x06
+
+enum EIbusPredictEvent
+    {
+    EPredictMode = 0,
+    EPredictFM,
+    EPredictAM,
+    EPredictCassette
+    };
+
+struct ibus_predict_rule {
+    enum EIbusPredictEvent event;
+    enum EIbusState from; /*EStateCount for any state*/
+    enum EIbusState to;
+};
+
+/* first matching rule is used. With CD changer mode from TAPE misses */
+static const struct ibus_predict_rule ibus_predict_rules[] = {
+    { EPredictMode,     EStateFM,    EStateTAPE },
+    { EPredictMode,     EStateTAPE,  EStateAUX },
+    { EPredictMode,     EStateAUX,   EStateFM },
+    { EPredictFM,       EStateCount, EStateFM },
+    { EPredictAM,       EStateCount, EStateFM }, /*AM is the tuner too*/
+    { EPredictCassette, EStateCount, EStateTAPE }
+};
+
+struct ibus_predict {
+    enum EIbusState to; /*EStateUnknown when nothing is pending*/
+    enum EIbusState fallback; /*state before the prediction or menu after it*/
+    enum EIbusPredictEvent event;
+    struct timespec time; /*receive time of the message predicted from*/
+    unsigned long predictions;
+    unsigned long hits;
+    unsigned long misses; /*text told other state*/
+    unsigned long expired; /*no text in time*/
+    unsigned long cancelled; /*next prediction or power off came first*/
+    unsigned long stale; /*old screen text ignored right after Mode*/
+    struct ibus_latency_histogram lead; /*prediction to confirming text*/
+};
+static struct ibus_predict ibus_predict;
+static unsigned char ibus_predict_enabled = 1;
+static struct event_source predict_timer = { -1 };
+
+static void ibus_predict_clear()
+{
+    struct timespec timeout = { 0, 0 };
+
+    ibus_predict.to = EStateUnknown;
+    if(predict_timer.fd >= 0 && event_timer_set(predict_timer.fd, &timeout, 0) < 0)
+        TRACE_ERROR("Can't set predict timer");
+}
+
+/* rolls back the prediction that has not been confirmed in time */
+static void ibus_predict_expire(const struct timespec *now)
+{
+    int64_t ms;
+
+    if(ibus_predict.to == EStateUnknown)
+        return;
+    ms = (int64_t)(now->tv_sec - ibus_predict.time.tv_sec)*1000 + (now->tv_nsec - ibus_predict.time.tv_nsec)/1000000;
+    if(ms < IBUS_PREDICT_TIMEOUT_MS)
+        return;
+
+    TRACE_WARGS(TRACE_STATE, "state %d not confirmed, back to %d\n",ibus_predict.to,ibus_predict.fallback);
+    ibus_predict.expired++;
+    ibus_predict_clear();
+    ibus_change_state(ibus_predict.fallback);
+}
+
+static void ibus_predict_cancel()
+{
+    if(ibus_predict.to == EStateUnknown)
+        return;
+    ibus_predict.cancelled++;
+    ibus_predict_clear();
+}
+
+/* changes the state the rules tell for the event in the current state */
+static void ibus_predict_event(enum EIbusPredictEvent event)
+{
+    struct timespec timeout = { IBUS_PREDICT_TIMEOUT_MS/1000, (IBUS_PREDICT_TIMEOUT_MS%1000)*1000000L };
+    const struct ibus_predict_rule *rule;
+    enum EIbusState fallback = ibus_state;
+    unsigned int i;
+
+    /*emulated changer tells itself when it is left*/
+    if(!ibus_predict_enabled || ibus_state == EStateCDChanger)
+        return;
+    ibus_predict_expire(&ibus_rx_time);
+
+    for(i = 0; i < sizeof(ibus_predict_rules)/sizeof(ibus_predict_rules[0]); i++) {
+        rule = &ibus_predict_rules[i];
+        if(rule->event == event && (rule->from == EStateCount || rule->from == ibus_state))
+            break;
+    }
+    if(i == sizeof(ibus_predict_rules)/sizeof(ibus_predict_rules[0]) || rule->to == ibus_state)
+        return;
+
+    /*pressed again before the text, roll back to where the first one started*/
+    if(ibus_predict.to != EStateUnknown) {
+        fallback = ibus_predict.fallback;
+        ibus_predict_cancel();
+    }
+
+    TRACE_WARGS(TRACE_STATE, "predicted state %d from event %d\n",rule->to,event);
+    ibus_predict.to = rule->to;
+    ibus_predict.event = event;
+    ibus_predict.fallback = fallback;
+    ibus_predict.time = ibus_rx_time;
+    ibus_predict.predictions++;
+    if(predict_timer.fd >= 0 && event_timer_set(predict_timer.fd, &timeout, 0) < 0)
+        TRACE_ERROR("Can't set predict timer");
+    ibus_change_state(rule->to);
+}
+
+/*
+ * Called with the state radio text of message told. Returns 1 if the state
+ * is to be changed, 0 if menu is only remembered while prediction waits for
+ * text or the text is older than the Mode press.
+ */
+static int ibus_predict_confirm(enum EIbusState state, unsigned char message)
+{
+    int64_t ms;
+
+    ibus_predict_expire(&ibus_rx_time);
+    if(ibus_predict.to == EStateUnknown)
+        return 1;
+
+    ms = (int64_t)(ibus_rx_time.tv_sec - ibus_predict.time.tv_sec)*1000 + (ibus_rx_time.tv_nsec - ibus_predict.time.tv_nsec)/1000000;
+    if(ibus_predict.event == EPredictMode && message == ST &&
+       state != ibus_predict.to && ms < IBUS_PREDICT_SETTLE_MS) {
+        ibus_predict.stale++;
+        return 0;
+    }
+    if(state == EStateMenu) {
+        ibus_predict.fallback = state;
+        return 0;
+    }
+    if(state == ibus_predict.to) {
+        ibus_predict.hits++;
+        ibus_latency_add(&ibus_predict.lead, &ibus_predict.time, &ibus_rx_time);
+    }
+    else {
+        TRACE_WARGS(TRACE_STATE, "predicted state %d was %d\n",ibus_predict.to,state);
+        ibus_predict.misses++;
+    }
+    ibus_predict_clear();
+    return 1;
+}
+
+static void on_predict_timeout(struct event_source *source, uint32_t events)
+{
+    struct timespec now;
+
+    if(!event_timer_expired(source->fd))
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ibus_predict_expire(&now);
+    send_input_events();
+}
+
+static void print_predict(int fd)
+{
+    if(!ibus_predict.predictions)
+        return;
+    STATS_PRINT(fd, "predict: %lu predictions, %lu hits, %lu misses, %lu expired, %lu cancelled, %lu stale texts\n",
+        ibus_predict.predictions, ibus_predict.hits, ibus_predict.misses,
+        ibus_predict.expired, ibus_predict.cancelled, ibus_predict.stale);
+    STATS_PRINT(fd, "predict: lead p50 %uus p99 %uus max %uus\n",
+        ibus_latency_percentile(&ibus_predict.lead, 50),
+        ibus_latency_percentile(&ibus_predict.lead, 99),
+        ibus_predict.lead.max);
+}
+
+
+/******************************************************************************
+ * IBUS receive ring functions
+ *****************************************************************************/
+static inline unsigned int ibus_ring_count(const struct ibus_ring *ring)
+{
+    return ring->head - ring->tail;
+}
+
+/* returns the nth byte from the tail */
+static inline unsigned char ibus_ring_peek(const struct ibus_ring *ring, unsigned int idx)
+{
+    return ring->data[(ring->tail+idx)&IBUS_RING_MASK];
+}
+
+static inline void ibus_ring_consume(struct ibus_ring *ring, unsigned int length)
+{
+    ring->tail += length;
+}
+
+/* XOR of bytes from..to-1 counted from the tail, in at most two pieces */
+static unsigned char ibus_ring_xor(const struct ibus_ring *ring, unsigned int from, unsigned int to)
+{
+    unsigned int start = (ring->tail+from)&IBUS_RING_MASK;
+    unsigned int length = to - from;
+    unsigned int first = IBUS_RING_SIZE - start;
+
+    if(length <= first)
+        return ibus_xor(&ring->data[start], length);
+    return ibus_xor(&ring->data[start], first) ^ ibus_xor(ring->data, length-first);
+}
+
+/* copies length bytes from the tail to out */
+static void ibus_ring_copy(const struct ibus_ring *ring, unsigned char *out, unsigned int length)
+{
+    unsigned int start = ring->tail&IBUS_RING_MASK;
+    unsigned int first = IBUS_RING_SIZE - start;
+
+    if(length <= first) {
+        memcpy(out, &ring->data[start], length);
+        return;
+    }
+    memcpy(out, &ring->data[start], first);
+    memcpy(&out[first], ring->data, length-first);
+}
+
+/*
+ * Returns length bytes from the tail of the ring as one contiguous message.
+ * Points directly to the ring unless the message wraps around the end of it.
+ */
+static const unsigned char* ibus_ring_message(const struct ibus_ring *ring, unsigned int length)
+{
+    unsigned int start = ring->tail&IBUS_RING_MASK;
+    unsigned int first = IBUS_RING_SIZE - start;
+
+    if(length <= first)
+        return &ring->data[start];
+
+    memcpy(ibus_linear_message, &ring->data[start], first);
+    memcpy(&ibus_linear_message[first], ring->data, length-first);
+    return ibus_linear_message;
+}
+
+/*
+ * Reads all available bytes from the serial line of the bus to its ring with
+ * as few read calls as possible. Returns number of bytes read or negative errno.
+ */
+static int ibus_bus_fill(struct ibus_bus *bus)
+{
+    struct ibus_ring *ring = &bus->rx.ring;
+    struct iovec iov[2];
+    unsigned int start,free_space,requested;
+    int total = 0;
+    int res = 0;
+
+    do{
+        free_space = IBUS_RING_SIZE - ibus_ring_count(ring);
+        if(free_space == 0) {
+            bus->stats.overflows++;
+            break;
+        }
+
+        /* free space may wrap around the end of the ring */
+        start = ring->head&IBUS_RING_MASK;
+        iov[0].iov_base = &ring->data[start];
+        iov[0].iov_len = IBUS_RING_SIZE - start;
+        if(iov[0].iov_len > free_space)
+            iov[0].iov_len = free_space;
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = free_space - iov[0].iov_len;
+        requested = free_space;
+
+        res = readv(bus->fd, iov, iov[1].iov_len ? 2 : 1);
+        if(res > 0) {
+            if(!total)
+                clock_gettime(CLOCK_MONOTONIC, &bus->rx_time);
+            ring->head += res;
+            total += res;
+            bus->stats.reads++;
+            bus->stats.bytes += res;
+            if(capture_fp)
+                capture_write(bus, ring->head - res, res);
+        }
+    } /* short read means that the driver buffer is drained */
+    while(res > 0 && (unsigned int)res == requested);
+
+    if(res < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -errno;
+
+    return total;
+}
+
+/*
+ * Copies up to length bytes to the ring. Returns number of bytes copied.
+ */
+static unsigned int ibus_ring_put(struct ibus_ring *ring, const unsigned char *data, unsigned int length)
+{
+    unsigned int start = ring->head&IBUS_RING_MASK;
+    unsigned int free_space = IBUS_RING_SIZE - ibus_ring_count(ring);
+    unsigned int first;
+
+    if(length > free_space)
+        length = free_space;
+    first = IBUS_RING_SIZE - start;
+    if(first > length)
+        first = length;
+
+    memcpy(&ring->data[start], data, first);
+    memcpy(ring->data, &data[first], length-first);
+    ring->head += length;
+    return length;
+}
+
+static void print_bus_traffic(const struct ibus_bus *bus, int fd);
+
+static void print_bus_stats(const struct ibus_bus *bus, int fd)
+{
+    const struct ibus_ingest_stats *stats = &bus->stats;
+    const struct ibus_tx_stats *tx = &bus->tx.stats;
+    const char *name = ibus_bus_names[bus->type];
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - stats->start.tv_sec) +
+              (now.tv_nsec - stats->start.tv_nsec)/1000000000.0;
+    if(elapsed <= 0)
+        elapsed = 1;
+
+    STATS_PRINT(fd, "ingest %s: %lu wakeups (%.1f/s), %lu reads, %lu bytes (%.1f/s), %.2f bytes/read, %lu overflows\n",
+        name, stats->wakeups, stats->wakeups/elapsed,
+        stats->reads,
+        stats->bytes, stats->bytes/elapsed,
+        stats->reads ? (double)stats->bytes/stats->reads : 0.0,
+        stats->overflows);
+    STATS_PRINT(fd, "parser %s: %lu messages, %lu VMIN updates, %lu idle timeouts\n",
+        name, stats->messages, stats->vmin_updates, stats->idle_timeouts);
+    STATS_PRINT(fd, "resync %s: %lu resyncs, %lu bytes skipped, %lu messages recovered\n",
+        name, stats->resyncs, stats->skipped_bytes, stats->recovered);
+    print_bus_traffic(bus, fd);
+    if(!tx->queued)
+        return;
+    STATS_PRINT(fd, "tx %s: %lu queued, %lu sent p50 %uus p99 %uus max %uus\n",
+        name, tx->queued, tx->sent,
+        ibus_latency_percentile(&tx->latency, 50),
+        ibus_latency_percentile(&tx->latency, 99),
+        tx->latency.max);
+    STATS_PRINT(fd, "tx %s: %lu collisions, %lu retries, %lu dropped, %lu expired, %lu queue full, %lu unchecked\n",
+        name, tx->collisions, tx->retries, tx->dropped, tx->expired, tx->queue_full, tx->unchecked);
+}
+
+static void print_video(int fd)
+{
+    if(!ibus_video.switches && !ibus_video.failed && !ibus_video.reverse_changes)
+        return;
+    STATS_PRINT(fd, "video: %lu switches, %lu skipped, %lu failed, %lu reverse changes, gear to pin p50 %uus p99 %uus max %uus\n",
+        ibus_video.switches, ibus_video.skipped, ibus_video.failed, ibus_video.reverse_changes,
+        ibus_latency_percentile(&ibus_video.latency, 50),
+        ibus_latency_percentile(&ibus_video.latency, 99),
+        ibus_video.latency.max);
+}
+
+static void print_cdc(int fd)
+{
+    if(!ibus_cdc.enabled)
+        return;
+    STATS_PRINT(fd, "cdc: %lu polls, %lu requests, %lu replies, %lu late, %lu missed, %lu unchecked, disc %u track %u\n",
+        ibus_cdc.polls, ibus_cdc.requests, ibus_cdc.replies,
+        ibus_cdc.late, ibus_cdc.missed, ibus_cdc.unchecked, ibus_cdc.disc, ibus_cdc.track);
+    STATS_PRINT(fd, "cdc: request to reply echo p50 %uus p99 %uus max %uus\n",
+        ibus_latency_percentile(&ibus_cdc.latency, 50),
+        ibus_latency_percentile(&ibus_cdc.latency, 99),
+        ibus_cdc.latency.max);
+}
+
+static void print_stats(int fd)
+{
+    unsigned int i;
+
+    for(i = 0; i < ibus_bus_count; i++)
+        print_bus_stats(&ibus_buses[i], fd);
+    STATS_PRINT(fd, "input: %lu key events, %lu writes, %lu writes saved, %lu repeats, %lu repeats skipped, %lu long presses, %lu stuck\n",
+        input_stats.key_events, input_stats.writes, input_stats.saved_writes,
+        input_stats.repeats, input_stats.repeats_skipped, input_stats.long_presses, input_stats.stuck);
+    if(knob_wheel.window)
+        STATS_PRINT(fd, "knob: %lu detents, %lu wheel events\n",
+            input_stats.knob_detents, input_stats.wheel_events);
+    print_latency(fd);
+    print_predict(fd);
+    print_video(fd);
+    print_cdc(fd);
+    if(ibus_filter.enabled)
+        STATS_PRINT(fd, "filter: %lu passed, sender %lu denied %lu not allowed, receiver %lu denied %lu not allowed, message %lu denied %lu not allowed\n",
+            ibus_filter.passed,
+            ibus_filter.deny_hits[EFilterSender], ibus_filter.allow_misses[EFilterSender],
+            ibus_filter.deny_hits[EFilterReceiver], ibus_filter.allow_misses[EFilterReceiver],
+            ibus_filter.deny_hits[EFilterMessage], ibus_filter.allow_misses[EFilterMessage]);
+    if(shm_ring)
+        STATS_PRINT(fd, "publish: %lu frames, %u clients, %lu connects, %lu refused, %lu wakeups, %lu wakeups dropped\n",
+            shm_stats.frames, shm_client_count, shm_stats.connects, shm_stats.refused,
+            shm_stats.wakeups, shm_stats.wakeups_dropped);
+}
+
+static void print_traffic_tables(int fd);
+
+/* stats requested with SIGUSR1 are traced whatever the trace level is */
+static void dump_stats()
+{
+    unsigned int level = trace_level;
+
+    trace_level |= TRACE_STATS;
+    print_stats(-1);
+    print_traffic_tables(-1);
+    trace_level = level;
+}
+
+/******************************************************************************
+ * IBUS streaming parser functions
+ *****************************************************************************/
+static inline int ibus_is_known_device(unsigned char device)
+{
+    return ibus_known_devices[device>>3]&(1<<(device&7));
+}
+
+/* devices that have name in IBUSDevices are considered as plausible senders */
+static void ibus_init_known_devices()
+{
+    unsigned int i;
+    memset(ibus_known_devices, 0, sizeof(ibus_known_devices));
+    for(i = 0; i < sizeof(IBUSDevices)/sizeof(IBUSDevices[0]); i++) {
+        if(strncmp(IBUSDevices[i], "0x", 2) != 0)
+            ibus_known_devices[i>>3] |= 1<<(i&7);
+    }
+}
+
+static inline void ibus_parser_reset(struct ibus_parser *parser)
+{
+    parser->scanned = 0;
+    parser->checksum = 0;
+}
+
+/* releases length bytes from the tail, next message starts after them */
+static inline void ibus_parser_consume(struct ibus_parser *parser, unsigned int length)
+{
+    ibus_ring_consume(&parser->ring, length);
+    ibus_parser_reset(parser);
+}
+
+/*
+ * Checks if the message at the ring tail is complete. Only the bytes that
+ * arrived after the previous call are added to the checksum.
+ */
+static enum EIbusParseResult ibus_parse_next(struct ibus_parser *parser, unsigned int *length)
+{
+    const struct ibus_ring *ring = &parser->ring;
+    unsigned int available = ibus_ring_count(ring);
+    unsigned int mes_len,checksum_index,end;
+
+    if(available <= (unsigned int)EPosLength)
+        return EParseNeedMore;
+
+    mes_len = ibus_ring_peek(ring, EPosLength)+parser->length_offset;
+    if(mes_len < parser->min_length)
+        return EParseInvalidLength;
+
+    /*checksum is located at the last byte of message*/
+    checksum_index = mes_len - 1;
+    end = available < checksum_index ? available : checksum_index;
+    if(parser->scanned < end) {
+        parser->checksum ^= ibus_ring_xor(ring, parser->scanned, end);
+        parser->scanned = end;
+    }
+
+    if(available < mes_len)
+        return EParseNeedMore;
+
+    *length = mes_len;
+    if(parser->checksum != ibus_ring_peek(ring, checksum_index))
+        return EParseInvalidChecksum;
+
+    return EParseMessage;
+}
+
+/*
+ * Returns offset of the first complete message with known sender and valid
+ * checksum starting from offset start, or 0 if there is none.
+ * Buffered data is linearized with its prefix XOR once, after that checksum
+ * of any candidate is prefix[offset] ^ prefix[offset+length], so the scan
+ * is linear instead of candidates times message length.
+ */
+static unsigned int ibus_next_complete_message(const struct ibus_parser *parser, unsigned int start)
+{
+    static __thread unsigned char data[IBUS_RING_SIZE];
+    static __thread unsigned char prefix[IBUS_RING_SIZE+1]; /*prefix[i] is XOR of data[0..i-1]*/
+    const struct ibus_ring *ring = &parser->ring;
+    unsigned int available = ibus_ring_count(ring);
+    unsigned int offset,mes_len;
+
+    if(start + parser->min_length > available)
+        return 0;
+    ibus_ring_copy(ring, data, available);
+    prefix[0] = 0;
+    ibus_prefix_xor(data, &prefix[1], available);
+
+    for(offset = start; offset + parser->min_length <= available; offset++) {
+        if(parser->known_senders && !ibus_is_known_device(data[offset+EPosSender]))
+            continue;
+        mes_len = data[offset+EPosLength]+parser->length_offset;
+        if(mes_len < parser->min_length || offset + mes_len > available)
+            continue;
+        /*xor over the message including checksum is 0*/
+        if(prefix[offset] == prefix[offset+mes_len])
+            return offset;
+    }
+    return 0;
+}
+
+/*
+ * Message at the ring tail is invalid. Slides forward one byte at a time until
+ * the tail has a known sender, plausible length and matching checksum, so
+ * the valid messages buffered behind the invalid data are not lost.
+ * Returns EParseMessage if next message was found or EParseNeedMore if the
+ * data runs out, possibly in the middle of a plausible message.
+ */
+static enum EIbusParseResult ibus_resync(struct ibus_parser *parser, unsigned int *length)
+{
+    struct ibus_ring *ring = &parser->ring;
+    enum EIbusParseResult res;
+    unsigned int skip;
+
+    if(!parser->resyncing)
+        parser->stats->resyncs++;
+    parser->resyncing = 1;
+    parser->recover_until = ring->head;
+
+    for(;;) {
+        ibus_parser_consume(parser, 1);
+        parser->stats->skipped_bytes++;
+
+        if(ibus_ring_count(ring) == 0)
+            return EParseNeedMore;
+        if(parser->known_senders && !ibus_is_known_device(ibus_ring_peek(ring, EPosSender)))
+            continue;
+
+        res = ibus_parse_next(parser, length);
+        if(res == EParseMessage)
+            return res;
+        if(res == EParseNeedMore) {
+            /* plausible but incomplete start would block the valid messages
+             * behind it until the line goes idle, prefer complete ones */
+            skip = ibus_next_complete_message(parser, 1);
+            if(skip == 0)
+                return res;
+            ibus_parser_consume(parser, skip-1);
+            parser->stats->skipped_bytes += skip-1;
+        }
+    }
+}
+
+/* returns how many bytes are still missing from the message at the ring tail */
+static unsigned int ibus_parse_needed(const struct ibus_parser *parser)
+{
+    unsigned int available = ibus_ring_count(&parser->ring);
+    unsigned int mes_len = parser->min_length;
+
+    if(available > (unsigned int)EPosLength)
+        mes_len = ibus_ring_peek(&parser->ring, EPosLength)+parser->length_offset;
+
+    return mes_len > available ? mes_len - available : 1;
+}
+
+/*
+ * Moves VMIN so that the driver wakes us up when the message being received
+ * is complete. termios is only touched when the value changes.
+ */
+static void ibus_update_vmin(struct ibus_bus *bus)
+{
+    unsigned int needed = ibus_parse_needed(&bus->rx);
+
+    if(needed > 0xFF)
+        needed = 0xFF;
+    if(bus->tio.c_cc[VMIN] == needed)
+        return;
+
+    bus->tio.c_cc[VMIN] = needed;
+    bus->stats.vmin_updates++;
+    if(tcsetattr(bus->fd,TCSANOW,&bus->tio) < 0){
+        TRACE_ERROR("tcsetattr VMIN");
+    }
+}
+
+/******************************************************************************
+ * bus functions
+ *****************************************************************************/
+/* returns bus type of name or -1 */
+static int ibus_bus_type_from_name(const char *name)
+{
+    unsigned int i;
+
+    for(i = 0; i < sizeof(ibus_bus_names)/sizeof(ibus_bus_names[0]); i++) {
+        if(strcmp(name, ibus_bus_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* clears parser, message format follows the bus type */
+static void ibus_parser_init(struct ibus_parser *parser, enum EIbusBusType type, struct ibus_ingest_stats *stats)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->stats = stats;
+    if(type == EBusDBus) {
+        /*address, length, data and checksum*/
+        parser->length_offset = 0;
+        parser->min_length = 3;
+        parser->known_senders = 0;
+    }
+    else {
+        parser->length_offset = ESenderAndLengthLength;
+        parser->min_length = EMinimumMessageLength;
+        parser->known_senders = 1;
+    }
+}
+
+/* clears parser and counters */
+static void ibus_bus_reset(struct ibus_bus *bus)
+{
+    ibus_parser_init(&bus->rx, bus->type, &bus->stats);
+    memset(&bus->stats, 0, sizeof(bus->stats));
+    memset(&bus->traffic, 0, sizeof(bus->traffic));
+    clock_gettime(CLOCK_MONOTONIC, &bus->stats.start);
+    bus->rx_time = bus->stats.start;
+    bus->pending = 0;
+    memset(&bus->tx, 0, sizeof(bus->tx));
+    bus->tx.seed = bus->stats.start.tv_nsec ^ bus->index;
+}
+
+/* adds bus of device, returns the bus or 0 if there are too many */
+static struct ibus_bus* ibus_bus_add(enum EIbusBusType type, const char *device)
+{
+    struct ibus_bus *bus;
+
+    if(ibus_bus_count == IBUS_MAX_BUSES)
+        return 0;
+
+    bus = &ibus_buses[ibus_bus_count];
+    memset(bus, 0, sizeof(*bus));
+    bus->type = type;
+    bus->index = ibus_bus_count++;
+    strncpy(bus->device, device, sizeof(bus->device)-1);
+    bus->fd = -1;
+    bus->serial_source.fd = -1;
+    bus->frame_timer.fd = -1;
+    bus->tx_timer.fd = -1;
+    ibus_bus_reset(bus);
+    return bus;
+}
+
+/*
+ * Opens serial line of the bus. All buses are 9600 8E1.
+ * Returns 0 or negative errno.
+ */
+static int ibus_bus_open(struct ibus_bus *bus)
+{
+    struct termios newtio;
+    TRACE_ENTRY_WARGS(TRACE_FUNCTION, "%s %s\n",ibus_bus_names[bus->type],bus->device);
+
+    bus->fd = open(bus->device, O_RDWR |  /*transmit reads back own frames*/
+                                O_NOCTTY |  /*no controlling*/
+                                O_NONBLOCK);
+    if (bus->fd < 0) {
+        TRACE_ERROR("Can't open ibus device");
+        goto err;
+    }
+
+    /* save current serial port settings */
+    if (tcgetattr(bus->fd, &bus->oldtio) < 0) {
+        TRACE_ERROR("Can't get current port settings");
+        goto close;
+    }
+
+    /*set line*/
+    bzero(&newtio, sizeof(newtio)); /* clear struct for new port settings */
+    newtio.c_cflag =    B9600 | /*9600 baud*/
+                        CS8 | /*8 bits.*/
+                        PARENB | /*Parity enable.*/
+                        CLOCAL | /*Ignore modem status lines.*/
+                        CREAD; /*Enable receiver.*/
+    newtio.c_iflag = IGNPAR | IGNBRK; /*Ignore characters with parity errors., Ignore break condition.*/
+    newtio.c_oflag = 0;
+    newtio.c_lflag = 0;
+    /* with VTIME=0 serial driver reports the line readable only when VMIN bytes
+     * are buffered. Reads are non-blocking so they still return everything
+     * available. VMIN starts from the minimum message and follows the length
+     * of the message being received */
+    newtio.c_cc[VMIN]=bus->rx.min_length;
+    newtio.c_cc[VTIME]=0;
+    if(tcflush(bus->fd, TCIFLUSH) < 0){
+        TRACE_ERROR("tcflush");
+        goto restore;
+    }
+    if(tcsetattr(bus->fd,TCSANOW,&newtio) < 0){
+        TRACE_ERROR("tcsetattr");
+        goto restore;
+    }
+    /* VMIN is updated on top of what the driver actually accepted */
+    if(tcgetattr(bus->fd, &bus->tio) < 0) {
+        TRACE_ERROR("Can't get new port settings");
+        goto restore;
+    }
+
+    TRACE_EXIT(TRACE_FUNCTION);
+    return 0;
+
+restore:
+    tcsetattr(bus->fd,TCSANOW,&bus->oldtio);
+close:
+    close(bus->fd);
+    bus->fd = -1;
+err:
+    TRACE_EXIT_WARGS(TRACE_FUNCTION, "error %d\n",-errno);
+    return -errno;
+}
+
+static void ibus_bus_close(struct ibus_bus *bus)
+{
+    if(bus->fd < 0)
+        return;
+    if(tcsetattr(bus->fd,TCSANOW,&bus->oldtio) < 0){
+        /*Ignore error as we are exiting*/
+    }
+    if(close(bus->fd) < 0){
+        /*Ignore error as we are exiting*/
+    }
+    bus->fd = -1;
+}
+
+/******************************************************************************
+ * transmit functions
+ *****************************************************************************/
+static inline unsigned char ibus_calc_checksum(const unsigned char *data, unsigned int length)
+{
+    return ibus_xor(data, length);
+}
+
+static inline int64_t ibus_time_diff_ns(const struct timespec *to, const struct timespec *from)
+{
+    return (int64_t)(to->tv_sec - from->tv_sec)*1000000000LL + (to->tv_nsec - from->tv_nsec);
+}
+
+static inline void ibus_time_add_ns(struct timespec *t, int64_t ns)
+{
+    ns += t->tv_nsec;
+    t->tv_sec += ns/1000000000LL;
+    t->tv_nsec = ns%1000000000LL;
+}
+
+/* returns frame of highest priority or 0 if nothing is queued */
+static struct ibus_tx_frame* ibus_tx_next(struct ibus_tx *tx)
+{
+    struct ibus_tx_queue *queue;
+    unsigned int i;
+
+    for(i = 0; i < ETxPriorityCount; i++) {
+        queue = &tx->queues[i];
+        if(queue->head != queue->tail)
+            return &queue->frames[queue->tail&(IBUS_TX_QUEUE_SIZE-1)];
+    }
+    return 0;
+}
+
+/* frame is always the tail of its queue */
+static inline void ibus_tx_release(struct ibus_tx *tx, struct ibus_tx_frame *frame)
+{
+    tx->queues[frame->priority].tail++;
+    if(tx->inflight == frame)
+        tx->inflight = 0;
+}
+
+/*
+ * Returns how long the line still has to stay quiet before sending, 0 if
+ * it is free. Bytes below VMIN are still in the driver so it is asked too.
+ */
+static int64_t ibus_tx_line_busy(const struct ibus_bus *bus, const struct timespec *now)
+{
+    int64_t quiet = ibus_time_diff_ns(now, &bus->rx_time);
+    int64_t idle = IBUS_TX_IDLE_CHARS*IBUS_CHAR_TIME_NS;
+    int waiting = 0;
+
+    if(ibus_ring_count(&bus->rx.ring) ||
+       (ioctl(bus->fd, FIONREAD, &waiting) == 0 && waiting > 0))
+        return idle;
+    return quiet < idle ? idle - quiet : 0;
+}
+
+/* transmit timer expires after ns, 0 stops it */
+static void ibus_tx_arm(struct ibus_bus *bus, int64_t ns)
+{
+    struct timespec timeout = { 0, 0 };
+
+    if(bus->tx_timer.fd < 0)
+        return;
+    ibus_time_add_ns(&timeout, ns);
+    if(event_timer_set(bus->tx_timer.fd, &timeout, 0) < 0)
+        TRACE_ERROR("Can't set transmit timer");
+}
+
+/* frame has left when it was written, adapter without echo tells nothing more */
+static void ibus_tx_unchecked(struct ibus_bus *bus, struct ibus_tx_frame *frame, const struct timespec *now)
+{
+    struct ibus_tx *tx = &bus->tx;
+
+    tx->stats.sent++;
+    tx->stats.unchecked++;
+    ibus_latency_add(&tx->stats.latency, &frame->queued, now);
+    ibus_tx_release(tx, frame);
+    tx->due = *now;
+    ibus_time_add_ns(&tx->due, (frame->length+IBUS_TX_IDLE_CHARS)*IBUS_CHAR_TIME_NS);
+}
+
+/*
+ * No echo has been seen and the frame in flight did not come back either.
+ * Adapter does not echo, that is told once and frames are sent without
+ * collision detection from then on.
+ */
+static void ibus_tx_no_echo(struct ibus_bus *bus, const struct timespec *now)
+{
+    struct ibus_tx *tx = &bus->tx;
+
+    fprintf(stderr, "%s adapter does not echo sent frames, collisions are not detected\n",
+        ibus_bus_names[bus->type]);
+    TRACE_WARGS(TRACE_IBUS, "%s adapter does not echo, frames are not checked\n",
+        ibus_bus_names[bus->type]);
+    tx->no_echo = 1;
+    ibus_tx_unchecked(bus, tx->inflight, now);
+}
+
+/*
+ * Frame was lost. It is sent again after random backoff of 1 to 2^attempts
+ * idle times so devices that collided do not collide again.
+ */
+static void ibus_tx_collision(struct ibus_bus *bus, const struct timespec *now)
+{
+    struct ibus_tx *tx = &bus->tx;
+    struct ibus_tx_frame *frame = tx->inflight;
+    unsigned int slots;
+
+    /*other traffic kept the line busy, but our frame never came back*/
+    if(!tx->echo_seen && frame->attempts+1 >= IBUS_TX_MAX_ATTEMPTS) {
+        ibus_tx_no_echo(bus, now);
+        return;
+    }
+
+    tx->inflight = 0;
+    tx->stats.collisions++;
+    if(++frame->attempts >= IBUS_TX_MAX_ATTEMPTS) {
+        TRACE_WARGS(TRACE_IBUS, "%s frame %02x->%02x %02x dropped after %d attempts\n",
+            ibus_bus_names[bus->type], frame->data[EPosSender], frame->data[EPosReceiver],
+            frame->data[EPosMessage], frame->attempts);
+        tx->stats.dropped++;
+        ibus_tx_release(tx, frame);
+        tx->due = *now;
+        return;
+    }
+    tx->stats.retries++;
+    slots = 1 + rand_r(&tx->seed)%(1U << frame->attempts);
+    tx->due = *now;
+    ibus_time_add_ns(&tx->due, (int64_t)slots*IBUS_TX_IDLE_CHARS*IBUS_CHAR_TIME_NS);
+}
+
+/*
+ * Sends next frame when the line is free, checks for missing echo and sets
+ * the transmit timer for the next step.
+ */
+static void ibus_tx_service(struct ibus_bus *bus)
+{
+    struct ibus_tx *tx = &bus->tx;
+    struct ibus_tx_frame *frame;
+    struct timespec now;
+    int64_t wait,busy;
+    int res;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(tx->inflight) {
+        wait = ibus_time_diff_ns(&tx->due, &now);
+        if(wait > 0) {
+            ibus_tx_arm(bus, wait);
+            return;
+        }
+        /*echo did not come back*/
+        if(!tx->echo_seen && ibus_time_diff_ns(&bus->rx_time, &tx->written) < 0)
+            ibus_tx_no_echo(bus, &now); /*not a byte came back*/
+        else
+            ibus_tx_collision(bus, &now);
+    }
+
+    /*late reply is worse than none, the requester has given up already*/
+    frame = ibus_tx_next(tx);
+    while(frame && frame->deadline.tv_sec && ibus_time_diff_ns(&frame->deadline, &now) < 0) {
+        TRACE_WARGS(TRACE_IBUS, "%s frame %02x->%02x %02x expired\n",
+            ibus_bus_names[bus->type], frame->data[EPosSender], frame->data[EPosReceiver],
+            frame->data[EPosMessage]);
+        tx->stats.expired++;
+        ibus_tx_release(tx, frame);
+        frame = ibus_tx_next(tx);
+    }
+    if(!frame || bus->fd < 0 || bus->hung_up) {
+        ibus_tx_arm(bus, 0);
+        return;
+    }
+
+    wait = ibus_time_diff_ns(&tx->due, &now);
+    busy = ibus_tx_line_busy(bus, &now);
+    if(busy > wait)
+        wait = busy;
+    if(wait > 0) {
+        ibus_tx_arm(bus, wait);
+        return;
+    }
+
+    res = write(bus->fd, frame->data, frame->length);
+    if(res != (int)frame->length) {
+        /*driver buffer full, or partial frame went out and is lost anyway*/
+        if(res < 0 && errno != EAGAIN)
+            TRACE_ERROR("Can't write frame");
+        tx->inflight = frame;
+        ibus_tx_collision(bus, &now);
+        wait = ibus_time_diff_ns(&tx->due, &now);
+        ibus_tx_arm(bus, wait > 0 ? wait : 1);
+        return;
+    }
+
+    if(tx->no_echo) {
+        ibus_tx_unchecked(bus, frame, &now);
+        ibus_tx_arm(bus, ibus_time_diff_ns(&tx->due, &now));
+        return;
+    }
+
+    /*echo takes the frame time plus adapter latency*/
+    tx->inflight = frame;
+    tx->written = now;
+    tx->due = now;
+    ibus_time_add_ns(&tx->due, (frame->length+IBUS_TX_IDLE_CHARS)*IBUS_CHAR_TIME_NS + IBUS_TX_ECHO_SLACK_NS);
+    ibus_tx_arm(bus, ibus_time_diff_ns(&tx->due, &now));
+}
+
+/* valid message was read while frame is in flight */
+static void ibus_tx_check_echo(struct ibus_bus *bus, const unsigned char *msg, unsigned int length)
+{
+    struct ibus_tx *tx = &bus->tx;
+    struct ibus_tx_frame *frame = tx->inflight;
+
+    /*other devices may still finish their message before ours goes out*/
+    if(length != frame->length || memcmp(msg, frame->data, length) != 0)
+        return;
+
+    tx->stats.sent++;
+    tx->echo_seen = 1;
+    ibus_latency_add(&tx->stats.latency, &frame->queued, &bus->rx_time);
+    ibus_tx_release(tx, frame);
+    tx->due = bus->rx_time;
+    ibus_tx_service(bus);
+}
+
+/* invalid data was read while frame is in flight */
+static void ibus_tx_check_corruption(struct ibus_bus *bus)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ibus_tx_collision(bus, &now);
+    ibus_tx_service(bus);
+}
+
+/*
+ * Queues message from sender to receiver. data is message id and its data,
+ * length and checksum are added. Frame that has not been written by deadline
+ * is dropped, 0 waits for the line as long as it takes. Returns 0 or
+ * negative errno.
+ */
+static int ibus_send_before(struct ibus_bus *bus, enum EIbusTxPriority priority, unsigned char sender,
+    unsigned char receiver, const unsigned char *data, unsigned int length, const struct timespec *deadline)
+{
+    struct ibus_tx_queue *queue;
+    struct ibus_tx_frame *frame;
+
+    if(bus->type == EBusDBus)
+        return -EOPNOTSUPP;
+    if(length == 0 || length > 0xFF - 2 || priority >= ETxPriorityCount)
+        return -EINVAL;
+
+    queue = &bus->tx.queues[priority];
+    if(queue->head - queue->tail == IBUS_TX_QUEUE_SIZE) {
+        bus->tx.stats.queue_full++;
+        return -ENOBUFS;
+    }
+
+    frame = &queue->frames[queue->head&(IBUS_TX_QUEUE_SIZE-1)];
+    frame->data[EPosSender] = sender;
+    frame->data[EPosLength] = length + 2; /*receiver and checksum*/
+    frame->data[EPosReceiver] = receiver;
+    memcpy(&frame->data[EPosMessage], data, length);
+    frame->length = length + 4;
+    frame->data[frame->length-1] = ibus_calc_checksum(frame->data, frame->length-1);
+    frame->priority = priority;
+    frame->attempts = 0;
+    clock_gettime(CLOCK_MONOTONIC, &frame->queued);
+    frame->deadline.tv_sec = 0;
+    if(deadline)
+        frame->deadline = *deadline;
+    queue->head++;
+    bus->tx.stats.queued++;
+
+    if(!bus->tx.inflight)
+        ibus_tx_service(bus);
+    return 0;
+}
+
+static int ibus_send(struct ibus_bus *bus, enum EIbusTxPriority priority, unsigned char sender,
+    unsigned char receiver, const unsigned char *data, unsigned int length)
+{
+    return ibus_send_before(bus, priority, sender, receiver, data, length, 0);
+}
+
+/******************************************************************************
+ * IBUS message functions
+ *****************************************************************************/
+static inline unsigned int get_message_length(const unsigned char *msg)
+{
+    return (msg[EPosLength]+ESenderAndLengthLength);
+}
+
+static inline unsigned char get_data_length(const unsigned char *msg)
+    {
+    unsigned int len = get_message_length(msg);
+    if(len <= EMinimumMessageLength)
+        len = 0; /*set it to 0 just in case*/
+    else
+        len -= EMinimumMessageLength;
+    return len;
+    }
+
+static inline unsigned char get_sender(const unsigned char *msg)
+    {
+    return msg[EPosSender];
+    }
+static inline unsigned char get_receiver(const unsigned char *msg)
+    {
+    return msg[EPosReceiver];
+    }
+static inline unsigned char get_message(const unsigned char *msg)
+    {
+    return msg[EPosMessage];
+    }
+
+/* returns the nth data byte */
+static inline unsigned char get_data_byte(const unsigned char *msg, unsigned int idx)
+{
+    return msg[EPosDataStart+idx];
+}
+
+/******************************************************************************
+ * reverse gear functions
+ *****************************************************************************/
+/* gear is in the high nibble of the second data byte of IKE sensor status */
+#define IBUS_GEAR_MASK 0xF0
+#define IBUS_GEAR_REVERSE 0x10
+
+/*
+ * Called for every IKE sensor status before it is filtered, traced or
+ * handled, the camera should not wait for them. Video is switched only when
+ * the gear changes to or from reverse, latency is kept only if a pin moved.
+ */
+static void ibus_reverse_check(const unsigned char *msg)
+{
+    struct timespec switched;
+    unsigned long switches;
+    int reverse;
+
+    if(get_data_length(msg) < 2)
+        return;
+    reverse = (get_data_byte(msg, 1) & IBUS_GEAR_MASK) == IBUS_GEAR_REVERSE;
+    if(reverse == ibus_video.reverse) {
+        /*IKE repeats the status, failed switch is tried again*/
+        if(ibus_video.output < 0 && VideoInputSwitch != ESwitchUnknown)
+            ibus_video_update();
+        return;
+    }
+
+    ibus_video.reverse = reverse;
+    ibus_video.reverse_changes++;
+    switches = ibus_video.switches;
+    ibus_video_update();
+    if(ibus_video.switches != switches) {
+        clock_gettime(CLOCK_MONOTONIC, &switched);
+        ibus_latency_add(&ibus_video.latency, &ibus_rx_time, &switched);
+    }
+    TRACE_WARGS(TRACE_STATE, "reverse gear %d\n",reverse);
+}
+
+
+/******************************************************************************
+ * CD changer functions
+ *****************************************************************************/
+/* queues reply to the request just received */
+static void ibus_cdc_reply(unsigned char receiver, const unsigned char *data, unsigned int length)
+{
+    struct timespec deadline = ibus_rx_time;
+    int res;
+
+    /*direct replay has no line to answer to*/
+    if(!ibus_cdc.bus)
+        return;
+    if(ibus_cdc.waiting)
+        ibus_cdc.missed++;
+
+    ibus_time_add_ns(&deadline, IBUS_CDC_REPLY_DEADLINE_MS*1000000LL);
+    res = ibus_send_before(ibus_cdc.bus, ETxPriorityHigh, CDC, receiver, data, length, &deadline);
+    if(res < 0) {
+        TRACE_WARGS(TRACE_IBUS, "Can't queue CD changer reply: %s\n",strerror(-res));
+        ibus_cdc.waiting = 0;
+        ibus_cdc.missed++;
+        return;
+    }
+    /*adapter without echo gives nothing to measure*/
+    if(ibus_cdc.bus->tx.no_echo) {
+        ibus_cdc.waiting = 0;
+        ibus_cdc.unchecked++;
+        return;
+    }
+    ibus_cdc.waiting = 1;
+    ibus_cdc.request = ibus_rx_time;
+}
+
+static void ibus_cdc_send_status()
+{
+    unsigned char data[8];
+    int playing = ibus_cdc.status != CDC_STATUS_STOPPED;
+
+    data[0] = CDS;
+    data[1] = ibus_cdc.status;
+    data[2] = playing ? CDC_AUDIO_PLAYING : CDC_AUDIO_STOPPED;
+    data[3] = 0x00;
+    data[4] = CDC_DISCS_LOADED;
+    data[5] = 0x00;
+    data[6] = ibus_cdc.disc;
+    data[7] = ibus_cdc.track;
+    ibus_cdc_reply(RAD, data, sizeof(data));
+}
+
+static void ibus_cdc_send_key(unsigned char command, unsigned char parameter)
+{
+    unsigned int i;
+
+    if(!send_key_events)
+        return;
+    for(i = 0; i < sizeof(ibus_cdc_keys)/sizeof(ibus_cdc_keys[0]); i++) {
+        if(ibus_cdc_keys[i].command == command &&
+           (ibus_cdc_keys[i].parameter == CDC_ANY_PARAMETER || ibus_cdc_keys[i].parameter == parameter)) {
+            send_key_event(ibus_cdc_keys[i].key_code, 1);
+            send_key_event(ibus_cdc_keys[i].key_code, 0);
+            return;
+        }
+    }
+}
+
+/* radio polls the changer every ~20s */
+static void handle_cdc_poll(const unsigned char *msg)
+{
+    unsigned char data[2];
+
+    ibus_cdc.polls++;
+    data[0] = DSRED;
+    data[1] = CDC_DEVICE_READY;
+    ibus_cdc_reply(LOC, data, sizeof(data));
+}
+
+static void handle_cdc_request(const unsigned char *msg)
+{
+    unsigned char command = CDC_CMD_STATUS;
+    unsigned char parameter = 0;
+    int selected = 0;
+
+    ibus_cdc.requests++;
+    if(get_data_length(msg) > 0)
+        command = get_data_byte(msg, 0);
+    if(get_data_length(msg) > 1)
+        parameter = get_data_byte(msg, 1);
+
+    if(command == CDC_CMD_PLAY) {
+        selected = ibus_state != EStateCDChanger;
+        ibus_cdc.status = CDC_STATUS_PLAYING;
+    }
+    else if(command == CDC_CMD_STOP)
+        ibus_cdc.status = CDC_STATUS_STOPPED;
+    else if(command == CDC_CMD_PAUSE)
+        ibus_cdc.status = CDC_STATUS_PAUSED;
+    else if(command == CDC_CMD_SCAN)
+        ibus_cdc.status = parameter ? CDC_STATUS_REWIND : CDC_STATUS_FORWARD;
+    else if(command == CDC_CMD_DISC && parameter >= 1 && parameter <= IBUS_CDC_DISCS) {
+        ibus_cdc.disc = parameter;
+        ibus_cdc.track = 1;
+    }
+    else if(command == CDC_CMD_TRACK && parameter == 0x00)
+        ibus_cdc.track = ibus_cdc.track == IBUS_CDC_TRACKS ? 1 : ibus_cdc.track+1;
+    else if(command == CDC_CMD_TRACK)
+        ibus_cdc.track = ibus_cdc.track == 1 ? IBUS_CDC_TRACKS : ibus_cdc.track-1;
+
+    /*reply first, it has the deadline*/
+    ibus_cdc_send_status();
+
+    /*changer commands tell the state, nothing is predicted for it*/
+    if(selected) {
+        ibus_predict_cancel();
+        ibus_change_state(EStateCDChanger);
+        return;
+    }
+    if(ibus_state != EStateCDChanger)
+        return;
+    ibus_cdc_send_key(command, parameter);
+    if(command == CDC_CMD_STOP) {
+        ibus_predict_cancel();
+        ibus_change_state(EStateUnknown);
+    }
+}
+
+/* echo of our own reply */
+static void handle_cdc_echo(const unsigned char *msg)
+{
+    if(!ibus_cdc.waiting)
+        return;
+    ibus_cdc.waiting = 0;
+    ibus_cdc.replies++;
+    ibus_latency_add(&ibus_cdc.latency, &ibus_cdc.request, &ibus_rx_time);
+    if(ibus_time_diff_ns(&ibus_rx_time, &ibus_cdc.request) > IBUS_CDC_REPLY_DEADLINE_MS*1000000LL)
+        ibus_cdc.late++;
+}
+
+
+/******************************************************************************
+ * traffic statistics functions
+ *****************************************************************************/
+/* frame length 3-4 is bucket 0, 5-8 bucket 1 and so on */
+static inline unsigned int ibus_length_bucket(unsigned int length)
+{
+    unsigned int bucket = length > 4 ? 32 - __builtin_clz(length-1) - 2 : 0;
+    return bucket < IBUS_LENGTH_BUCKETS ? bucket : IBUS_LENGTH_BUCKETS-1;
+}
+
+/* moves the newest slot to second, slots of the seconds between are empty */
+static void ibus_traffic_roll(struct ibus_traffic *traffic, time_t second)
+{
+    uint32_t newest = traffic->slot_bytes[traffic->slot_second&(IBUS_TRAFFIC_SLOTS-1)];
+
+    if(newest > traffic->peak_bytes)
+        traffic->peak_bytes = newest;
+    if(second - traffic->slot_second >= IBUS_TRAFFIC_SLOTS) {
+        memset(traffic->slot_bytes, 0, sizeof(traffic->slot_bytes));
+    }
+    else {
+        while(traffic->slot_second != second)
+            traffic->slot_bytes[++traffic->slot_second&(IBUS_TRAFFIC_SLOTS-1)] = 0;
+    }
+    traffic->slot_second = second;
+}
+
+/* counts the frame, a few increments and one clock difference */
+static inline void ibus_traffic_add(struct ibus_bus *bus, const unsigned char *msg, unsigned int length)
+{
+    struct ibus_traffic *traffic = &bus->traffic;
+    unsigned char sender,message;
+
+    if(bus->type == EBusDBus) {
+        sender = msg[0];
+        message = length > 3 ? msg[2] : 0;
+    }
+    else {
+        sender = get_sender(msg);
+        message = get_message(msg);
+    }
+    traffic->sender_frames[sender]++;
+    traffic->sender_bytes[sender] += length;
+    traffic->message_frames[message]++;
+    traffic->lengths[ibus_length_bucket(length)]++;
+
+    if(traffic->last_frame.tv_sec)
+        ibus_histogram_add(&traffic->gaps,
+            (ibus_time_diff_ns(&ibus_rx_time, &traffic->last_frame) - (int64_t)length*IBUS_CHAR_TIME_NS)/1000);
+    traffic->last_frame = ibus_rx_time;
+
+    if(ibus_rx_time.tv_sec != traffic->slot_second)
+        ibus_traffic_roll(traffic, ibus_rx_time.tv_sec);
+    traffic->slot_bytes[traffic->slot_second&(IBUS_TRAFFIC_SLOTS-1)] += length;
+}
+
+/* load of the seconds complete at now, percent of the time the line was busy */
+static double ibus_traffic_load(const struct ibus_traffic *traffic, time_t now, unsigned int seconds)
+{
+    uint64_t bytes = 0;
+    time_t second;
+
+    for(second = now - seconds; second < now; second++) {
+        if(second <= traffic->slot_second && traffic->slot_second - second < IBUS_TRAFFIC_SLOTS)
+            bytes += traffic->slot_bytes[second&(IBUS_TRAFFIC_SLOTS-1)];
+    }
+    return bytes*(double)IBUS_CHAR_TIME_NS/(seconds*10000000.0);
+}
+
+static void print_bus_traffic(const struct ibus_bus *bus, int fd)
+{
+    const struct ibus_traffic *traffic = &bus->traffic;
+    const char *name = ibus_bus_names[bus->type];
+    uint32_t peak = traffic->peak_bytes;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    /*newest slot is complete when the second has changed*/
+    if(traffic->slot_second < now.tv_sec && traffic->slot_bytes[traffic->slot_second&(IBUS_TRAFFIC_SLOTS-1)] > peak)
+        peak = traffic->slot_bytes[traffic->slot_second&(IBUS_TRAFFIC_SLOTS-1)];
+
+    STATS_PRINT(fd, "traffic %s: load %.1f%% 1s, %.1f%% 10s, %.1f%% 60s, %.1f%% peak, gap p50 %uus p99 %uus max %uus\n",
+        name,
+        ibus_traffic_load(traffic, now.tv_sec, 1),
+        ibus_traffic_load(traffic, now.tv_sec, 10),
+        ibus_traffic_load(traffic, now.tv_sec, 60),
+        peak*(double)IBUS_CHAR_TIME_NS/10000000.0,
+        ibus_latency_percentile(&traffic->gaps, 50),
+        ibus_latency_percentile(&traffic->gaps, 99),
+        traffic->gaps.max);
+    STATS_PRINT(fd, "lengths %s: 3-4 %lu, 5-8 %lu, 9-16 %lu, 17-32 %lu, 33-64 %lu, 65-128 %lu, 129-257 %lu\n",
+        name, traffic->lengths[0], traffic->lengths[1], traffic->lengths[2], traffic->lengths[3],
+        traffic->lengths[4], traffic->lengths[5], traffic->lengths[6]);
+}
+
+/* frames per sender and per message of every bus with rates over the uptime */
+static void print_traffic_tables(int fd)
+{
+    const struct ibus_bus *bus;
+    const struct ibus_traffic *traffic;
+    const char *name;
+    struct timespec now;
+    double elapsed;
+    unsigned int i,id;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(i = 0; i < ibus_bus_count; i++) {
+        bus = &ibus_buses[i];
+        traffic = &bus->traffic;
+        name = ibus_bus_names[bus->type];
+        elapsed = (now.tv_sec - bus->stats.start.tv_sec) +
+                  (now.tv_nsec - bus->stats.start.tv_nsec)/1000000000.0;
+        if(elapsed <= 0)
+            elapsed = 1;
+
+        for(id = 0; id < 256; id++) {
+            if(!traffic->sender_frames[id])
+                continue;
+            STATS_PRINT(fd, "sender %s %02x %s: %lu frames (%.2f/s), %llu bytes\n",
+                name, id, bus->type == EBusDBus ? "DS2" : IBUSDevices[id],
+                traffic->sender_frames[id], traffic->sender_frames[id]/elapsed,
+                traffic->sender_bytes[id]);
+        }
+        for(id = 0; id < 256; id++) {
+            if(!traffic->message_frames[id])
+                continue;
+            STATS_PRINT(fd, "message %s %02x %s: %lu frames (%.2f/s)\n",
+                name, id, bus->type == EBusDBus ? "DS2 command" : IBUSMessages[id],
+                traffic->message_frames[id], traffic->message_frames[id]/elapsed);
+        }
+    }
+}
+
+/*
+ * Creates the stats socket. Returns 0 or negative errno.
+ */
+static int ibus_stats_open(const char *path)
+{
+    struct sockaddr_un addr;
+    unsigned int i;
+    int fd,res;
+
+    for(i = 0; i < IBUS_STATS_MAX_CLIENTS; i++)
+        stats_clients[i].source.fd = stats_clients[i].dump_fd = -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -errno;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    unlink(path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        res = -errno;
+        close(fd);
+        return res;
+    }
+    stats_listen_source.fd = fd;
+    stats_socket_path = path;
+    return 0;
+}
+
+static void ibus_stats_client_close(struct ibus_stats_client *client)
+{
+    if(client->source.fd >= 0)
+        close(client->source.fd); /*removes it from epoll too*/
+    if(client->dump_fd >= 0)
+        close(client->dump_fd);
+    client->source.fd = client->dump_fd = -1;
+}
+
+static void ibus_stats_close()
+{
+    unsigned int i;
+
+    if(!stats_socket_path)
+        return;
+    for(i = 0; i < IBUS_STATS_MAX_CLIENTS; i++)
+        ibus_stats_client_close(&stats_clients[i]);
+    close(stats_listen_source.fd);
+    unlink(stats_socket_path);
+    stats_listen_source.fd = -1;
+    stats_socket_path = 0;
+}
+
+/*
+ * Sends what the socket takes now. Returns 1 when all is sent, 0 if the
+ * client has to wait for EPOLLOUT or negative errno.
+ */
+static int ibus_stats_client_send(struct ibus_stats_client *client)
+{
+    char buffer[4096];
+    ssize_t length,res;
+
+    while(client->sent < client->length) {
+        length = pread(client->dump_fd, buffer, sizeof(buffer), client->sent);
+        if(length <= 0)
+            return length < 0 ? -errno : -EIO;
+        res = send(client->source.fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(res < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+        client->sent += res;
+    }
+    return 1;
+}
+
+/* client can take more, or hung up */
+static void on_stats_client(struct event_source *source, uint32_t events)
+{
+    struct ibus_stats_client *client = source->context;
+
+    if(ibus_stats_client_send(client) != 0)
+        ibus_stats_client_close(client);
+}
+
+/* free slot, or the client that has been behind the longest */
+static struct ibus_stats_client* ibus_stats_client_slot()
+{
+    struct ibus_stats_client *oldest = &stats_clients[0];
+    unsigned int i;
+
+    for(i = 0; i < IBUS_STATS_MAX_CLIENTS; i++) {
+        if(stats_clients[i].source.fd < 0)
+            return &stats_clients[i];
+        if(stats_clients[i].serial < oldest->serial)
+            oldest = &stats_clients[i];
+    }
+    TRACE_WARGS(TRACE_STATS, "stats client %lu dropped, %ld bytes not read\n",
+        oldest->serial, (long)(oldest->length - oldest->sent));
+    ibus_stats_client_close(oldest);
+    return oldest;
+}
+
+/*
+ * Formats the stats for the client and sends what the socket takes, the
+ * main loop never waits for a client.
+ */
+static void on_stats_connect(struct event_source *source, uint32_t events)
+{
+    struct ibus_stats_client *client;
+    int fd,res;
+
+    while((fd = accept4(source->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        client = ibus_stats_client_slot();
+        client->source.fd = fd;
+        client->serial = ++stats_client_serial;
+        client->dump_fd = memfd_create("bmw-ibus-stats", MFD_CLOEXEC);
+        if(client->dump_fd < 0) {
+            TRACE_ERROR("Can't create stats buffer");
+            ibus_stats_client_close(client);
+            continue;
+        }
+        print_stats(client->dump_fd);
+        print_traffic_tables(client->dump_fd);
+        client->length = lseek(client->dump_fd, 0, SEEK_CUR);
+        client->sent = 0;
+
+        res = ibus_stats_client_send(client);
+        if(res != 0) {
+            ibus_stats_client_close(client);
+            continue;
+        }
+        if(event_add(&client->source, fd, 0, on_stats_client, client) < 0 ||
+           event_modify(&client->source, EPOLLOUT) < 0) {
+            TRACE_ERROR("Can't wait for stats client");
+            ibus_stats_client_close(client);
+        }
+    }
+}
+
+/******************************************************************************
+ * publish functions
+ *****************************************************************************/
+static void ibus_shm_close();
+
+/*
+ * Creates the frame ring and the socket clients connect to.
+ * Returns 0 or negative errno.
+ */
+static int ibus_shm_open(const char *path)
+{
+    struct sockaddr_un addr;
+    char name[64];
+    unsigned int i;
+    int fd;
+    TRACE_ENTRY_WARGS(TRACE_FUNCTION, "%s\n",path);
+
+    for(i = 0; i < IBUS_SHM_MAX_CLIENTS; i++)
+        shm_clients[i].fd = -1;
+
+    shm_size = sizeof(struct ibus_shm_header) + sizeof(struct ibus_vehicle_state) +
+               IBUS_SHM_SLOTS*sizeof(struct ibus_shm_frame);
+    shm_fd = memfd_create("bmw-ibus-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(shm_fd < 0) {
+        TRACE_ERROR("Can't create frame ring");
+        goto err;
+    }
+    /*clients can not resize the ring under us*/
+    if(ftruncate(shm_fd, shm_size) < 0 ||
+       fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        TRACE_ERROR("Can't size frame ring");
+        goto close;
+    }
+    shm_ring = mmap(0, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if(shm_ring == MAP_FAILED) {
+        shm_ring = 0;
+        TRACE_ERROR("Can't map frame ring");
+        goto close;
+    }
+    shm_ring->magic = IBUS_SHM_MAGIC;
+    shm_ring->version = IBUS_SHM_VERSION;
+    shm_ring->header_size = sizeof(struct ibus_shm_header) + sizeof(struct ibus_vehicle_state);
+    shm_ring->frame_size = sizeof(struct ibus_shm_frame);
+    shm_ring->slots = IBUS_SHM_SLOTS;
+    shm_ring->state_offset = sizeof(struct ibus_shm_header);
+    ibus_vehicle = (struct ibus_vehicle_state*)ibus_shm_state(shm_ring);
+    *ibus_vehicle = ibus_vehicle_local;
+
+    /*
+     * Only the mapping that exists now stays writable. A client could reopen
+     * /proc/<pid>/fd of the descriptor it gets with O_RDWR, the seal keeps it
+     * from writing the ring and the state anyway.
+     */
+    if(fcntl(shm_fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0) {
+        TRACE_ERROR("Can't seal frame ring");
+        goto close;
+    }
+
+    /*clients get read-only descriptor of the same memory*/
+    snprintf(name, sizeof(name), "/proc/self/fd/%d", shm_fd);
+    shm_readonly_fd = open(name, O_RDONLY | O_CLOEXEC);
+    if(shm_readonly_fd < 0) {
+        TRACE_ERROR("Can't open read-only frame ring");
+        goto close;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        TRACE_ERROR("Can't create publish socket");
+        goto close;
+    }
+    shm_listen_source.fd = fd;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    unlink(path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        TRACE_ERROR("Can't bind publish socket");
+        goto close;
+    }
+    shm_socket_path = path;
+    /*connect needs write permission, umask must not decide who can follow the bus*/
+    if(chmod(path, IBUS_SHM_SOCKET_MODE) < 0 || listen(fd, IBUS_SHM_MAX_CLIENTS) < 0) {
+        TRACE_ERROR("Can't set up publish socket");
+        goto close;
+    }
+
+    TRACE_EXIT(TRACE_FUNCTION);
+    return 0;
+
+close:
+    fd = -errno;
+    ibus_shm_close();
+    errno = -fd;
+err:
+    TRACE_EXIT_WARGS(TRACE_FUNCTION, "error %d\n",-errno);
+    return -errno;
+}
+
+static void ibus_shm_client_close(struct event_source *client)
+{
+    close(client->fd); /*removes it from epoll too*/
+    client->fd = -1;
+    shm_client_count--;
+}
+
+static void ibus_shm_close()
+{
+    unsigned int i;
+
+    for(i = 0; i < IBUS_SHM_MAX_CLIENTS; i++) {
+        if(shm_clients[i].fd >= 0)
+            ibus_shm_client_close(&shm_clients[i]);
+    }
+    if(shm_socket_path) {
+        close(shm_listen_source.fd);
+        unlink(shm_socket_path);
+        shm_socket_path = 0;
+    }
+    if(shm_ring) {
+        ibus_vehicle_local = *ibus_vehicle;
+        ibus_vehicle = &ibus_vehicle_local;
+        munmap(shm_ring, shm_size);
+    }
+    if(shm_readonly_fd >= 0)
+        close(shm_readonly_fd);
+    if(shm_fd >= 0)
+        close(shm_fd);
+    shm_ring = 0;
+    shm_fd = shm_readonly_fd = -1;
+}
+
+/* clients only close the socket, wakeups are not acknowledged */
+static void on_shm_client(struct event_source *source, uint32_t events)
+{
+    char buffer[64];
+    int res;
+
+    res = recv(source->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if(res == 0 || (res < 0 && errno != EAGAIN) || (events & (EPOLLERR | EPOLLHUP)))
+        ibus_shm_client_close(source);
+}
+
+/* accepts client and passes the read-only ring to it */
+static void on_shm_connect(struct event_source *source, uint32_t events)
+{
+    struct ibus_shm_hello hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct event_source *client = 0;
+    unsigned int i;
+    int fd;
+
+    while((fd = accept4(source->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for(i = 0; i < IBUS_SHM_MAX_CLIENTS && !client; i++) {
+            if(shm_clients[i].fd < 0)
+                client = &shm_clients[i];
+        }
+        if(!client) {
+            shm_stats.refused++;
+            close(fd);
+            continue;
+        }
+
+        memset(&hello, 0, sizeof(hello));
+        hello.magic = IBUS_SHM_MAGIC;
+        hello.version = IBUS_SHM_VERSION;
+        hello.size = shm_size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &shm_readonly_fd, sizeof(int));
+
+        if(sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello) ||
+           event_add(client, fd, 0, on_shm_client, 0) < 0) {
+            TRACE_ERROR("Can't accept client");
+            close(fd);
+            client->fd = -1;
+            continue;
+        }
+        shm_client_count++;
+        shm_stats.connects++;
+        client = 0;
+    }
+}
+
+/*
+ * Writes message to the next slot of the ring. Slot sequence is cleared
+ * first so clients reading the old frame in place notice the overwrite.
+ */
+static void ibus_shm_publish(const struct ibus_bus *bus, const unsigned char *msg, unsigned int length)
+{
+    uint64_t position = shm_ring->head;
+    struct ibus_shm_frame *frame = (struct ibus_shm_frame*)ibus_shm_slot(shm_ring, position);
+
+    __atomic_store_n(&frame->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    frame->timestamp = (uint64_t)ibus_rx_time.tv_sec*1000000000ULL + ibus_rx_time.tv_nsec;
+    frame->bus = bus->type;
+    frame->bus_index = bus->index;
+    if(bus->type == EBusDBus) {
+        frame->sender = msg[0];
+        frame->receiver = 0;
+        frame->message = length > 3 ? msg[2] : 0;
+    }
+    else {
+        frame->sender = get_sender(msg);
+        frame->receiver = get_receiver(msg);
+        frame->message = get_message(msg);
+    }
+    frame->length = length;
+    memcpy(frame->data, msg, length);
+
+    __atomic_store_n(&frame->sequence, position+1, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm_ring->head, position+1, __ATOMIC_RELEASE);
+    shm_stats.frames++;
+}
+
+/* wakes up clients if frames were published, slow clients miss the wakeup */
+static void ibus_shm_notify()
+{
+    uint64_t head;
+    unsigned int i;
+
+    if(!shm_client_count || shm_ring->head == shm_notified)
+        return;
+
+    head = shm_ring->head;
+    for(i = 0; i < IBUS_SHM_MAX_CLIENTS; i++) {
+        if(shm_clients[i].fd < 0)
+            continue;
+        if(send(shm_clients[i].fd, &head, sizeof(head), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(head))
+            shm_stats.wakeups++;
+        else
+            shm_stats.wakeups_dropped++;
+    }
+    shm_notified = head;
+}
+
+/******************************************************************************
+ * Radio text matcher
+ *****************************************************************************/
+/*
+ * Adds pattern to the matcher. Patterns are matched in the display messages
+ * where the built-in patterns of the same state are found. Must be called
+ * before ibus_build_text_matcher.
+ */
+static int ibus_add_text_pattern(const char *text, enum EIbusState state)
+{
+    unsigned char message = 0;
+    unsigned int i;
+
+    for(i = 0; i < IBUS_DEFAULT_TEXT_PATTERNS; i++) {
+        if(default_text_patterns[i].state == state) {
+            message = default_text_patterns[i].message;
+            break;
+        }
+    }
+
+    /*built-in patterns are added to the same table*/
+    if(!message || !strlen(text) ||
+       ibus_text_pattern_count == IBUS_MAX_TEXT_PATTERNS - IBUS_DEFAULT_TEXT_PATTERNS) {
+        errno = EINVAL;
+        return -EINVAL;
+    }
+
+    ibus_text_patterns[ibus_text_pattern_count].text = text;
+    ibus_text_patterns[ibus_text_pattern_count].state = state;
+    ibus_text_patterns[ibus_text_pattern_count].message = message;
+    ibus_text_pattern_count++;
+    return 0;
+}
+
+/*
+ * Builds Aho-Corasick automaton from the patterns. Failure links are resolved
+ * to full transition table so matching is one table lookup per data byte.
+ * Built-in patterns are added first and win if several states match.
+ */
+static int ibus_build_text_matcher()
+{
+    unsigned char fail[IBUS_MATCHER_MAX_STATES];
+    unsigned char queue[IBUS_MATCHER_MAX_STATES];
+    unsigned int head = 0, tail = 0;
+    unsigned int i,c,node,next,states = 1;
+    const unsigned char *text;
+
+    /* configured patterns are after the built-in ones */
+    memmove(&ibus_text_patterns[IBUS_DEFAULT_TEXT_PATTERNS],
+            ibus_text_patterns, ibus_text_pattern_count*sizeof(ibus_text_patterns[0]));
+    memcpy(ibus_text_patterns, default_text_patterns, sizeof(default_text_patterns));
+    ibus_text_pattern_count += IBUS_DEFAULT_TEXT_PATTERNS;
+
+    memset(ibus_matcher_next, 0, sizeof(ibus_matcher_next));
+    memset(ibus_matcher_output, 0, sizeof(ibus_matcher_output));
+    memset(ibus_text_message_patterns, 0, sizeof(ibus_text_message_patterns));
+    memset(fail, 0, sizeof(fail));
+
+    /* 1. trie of the patterns, state 0 is root */
+    for(i = 0; i < ibus_text_pattern_count; i++) {
+        node = 0;
+        for(text = (const unsigned char*)ibus_text_patterns[i].text; *text; text++) {
+            if(!ibus_matcher_next[node][*text]) {
+                if(states == IBUS_MATCHER_MAX_STATES) {
+                    TRACE_WARGS(TRACE_FUNCTION, "too many text patterns, %s ignored\n", ibus_text_patterns[i].text);
+                    errno = ENOSPC;
+                    return -ENOSPC;
+                }
+                ibus_matcher_next[node][*text] = states++;
+            }
+            node = ibus_matcher_next[node][*text];
+        }
+        ibus_matcher_output[node] |= 1u<<i;
+        ibus_text_message_patterns[ibus_text_patterns[i].message] |= 1u<<i;
+    }
+
+    /* 2. breadth first from the root: missing transitions follow the failure link */
+    for(c = 0; c < 256; c++) {
+        if(ibus_matcher_next[0][c])
+            queue[tail++] = ibus_matcher_next[0][c];
+    }
+    while(head < tail) {
+        node = queue[head++];
+        ibus_matcher_output[node] |= ibus_matcher_output[fail[node]];
+        for(c = 0; c < 256; c++) {
+            next = ibus_matcher_next[node][c];
+            if(next) {
+                fail[next] = ibus_matcher_next[fail[node]][c];
+                queue[tail++] = next;
+            }
+            else {
+                ibus_matcher_next[node][c] = ibus_matcher_next[fail[node]][c];
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Matches all text patterns in one pass over the data bytes of the message.
+ * Returns bitmask of the matched patterns which belong to this message.
+ */
+static inline uint32_t ibus_match_text(const unsigned char *msg)
+{
+    const unsigned char *data = &msg[EPosDataStart];
+    const unsigned char *end = data + get_data_length(msg);
+    uint32_t wanted = ibus_text_message_patterns[get_message(msg)];
+    uint32_t found = 0;
+    unsigned char node = 0;
+
+    while(data < end) {
+        node = ibus_matcher_next[node][*data++];
+        found |= ibus_matcher_output[node];
+    }
+    return found&wanted;
+}
+
+/* returns the state of the first pattern found in the message */
+static inline enum EIbusState ibus_match_text_state(const unsigned char *msg)
+{
+    uint32_t found = ibus_match_text(msg);
+    return found ? ibus_text_patterns[__builtin_ctz(found)].state : EStateUnknown;
+}
+
+/* prints the message without timestamp, used also by bmw-ibus-tracedump */
+static void print_ibus_message_text(const unsigned char *msg)
+    {
+    int addData = 1;
+    unsigned int idx = 0;
+    unsigned char data = 0;
+    unsigned char dataLen = get_data_length(msg);
+    unsigned int curr_mes_len = get_message_length(msg);
+
+    /*print message in hex. print data without spaces and send,len,res,mes and cs with spaces*/
+    /*F0 04 53 23 ABBADABBAAAA C8*/
+
+    do{
+        if(idx < 4 || idx == curr_mes_len-1)
+            printf(" %02x",msg[idx]);
+        else
+            printf("%02x",msg[idx]);
+        idx++;
+    }
+    while(idx < curr_mes_len);
+
+    printf(" = %s",IBUSDevices[get_sender(msg)]);
+    printf(" SENT ");
+
+    if(get_message(msg)==BMBTB1 && get_data_length(msg)==1)
+        {
+    	data = get_data_byte(msg, 0);
+        int longPress = 0;
+		int release = 0;
+
+		if(data & ButtonLongPress)
+			{
+			data &= ~ButtonLongPress;
+			longPress = 1;
+			}
+		else if(data & ButtonRelease)
+			{
+			data &= ~ButtonRelease;
+			release = 1;
+			}
+
+		printf("button %s",headunit_buttons[data].name);
+
+		if(release)
+			printf(" released");
+		else if(longPress)
+			printf(" pressed long");
+		else
+			printf(" pressed");
+        addData = 0;
+        }
+    else if(get_message(msg)==KNOB && get_data_length(msg)==1)
+        {
+    	data = get_data_byte(msg, 0);
+        if(data & ButtonMenuKnobClockwiseMask)
+			{
+			printf("Menu knob turned clockwise ");
+			data &= ~ButtonMenuKnobClockwiseMask;
+			}
+		else
+			{
+			printf("Menu knob turned counter clockwise ");
+			}
+
+		printf("%d time(s)",data);
+        addData = 0;
+        }
+    else
+        printf("%s",IBUSMessages[get_message(msg)]);
+
+    printf(" TO ");
+    printf("%s",IBUSDevices[get_receiver(msg)]);
+
+    idx = 0;
+    if(addData && dataLen > 0){
+        printf(" DATA:");
+        if(get_sender(msg)==RAD && get_receiver(msg)==BMBT && (get_message(msg)==CC || get_message(msg)==CS) ) {
+            do{
+                printf(" 0x%02x",msg[EPosDataStart+idx]);
+                idx++;
+            } while(idx < dataLen);
+        }
+        else{
+            do{
+                if(msg[EPosDataStart+idx] < 0x20 || msg[EPosDataStart+idx] > 0x7F)
+                    printf("0x%02x ",msg[EPosDataStart+idx]);
+                else
+                    printf("%c",msg[EPosDataStart+idx]);
+                idx++;
+            } while(idx < dataLen);
+        }
+    }
+    printf("\n");
+    }
+
+/* D-Bus: address, length, data and checksum */
+static void print_ds2_message_text(const unsigned char *msg, unsigned int length)
+    {
+    unsigned int idx;
+
+    printf(" %02x %02x ",msg[0],msg[1]);
+    for(idx = 2; idx < length-1; idx++)
+        printf("%02x",msg[idx]);
+    printf(" %02x = DS2 address 0x%02x\n",msg[length-1],msg[0]);
+    }
+
+/*
+ * Message id in binary trace tells the bus. Messages of the default
+ * I-Bus have id 0 and are printed without bus name.
+ */
+static inline uint16_t ibus_bus_trace_id(const struct ibus_bus *bus)
+    {
+    return bus->type<<8 | bus->index;
+    }
+
+static void print_bus_message_text(uint16_t trace_id, const unsigned char *msg, unsigned int length)
+    {
+    if(trace_id)
+        printf("[%s]",ibus_bus_names[trace_id>>8]);
+    if(trace_id>>8 == EBusDBus)
+        print_ds2_message_text(msg, length);
+    else
+        print_ibus_message_text(msg);
+    }
+
+static void print_bus_message(const struct ibus_bus *bus, const unsigned char *msg, unsigned int length)
+    {
+    TRACE(TRACE_IBUS,"");
+    print_bus_message_text(ibus_bus_trace_id(bus), msg, length);
+    }
+
+/******************************************************************************
+ * IBUS message handlers
+ *****************************************************************************/
+/*
+ * Returns the state radio tells with display text (UMID) and screen text
+ * (ST), AUX, TAPE or FM, or with LCD clear, or EStateUnknown if the message
+ * does not tell it. Decoding only, bmw-ibus-analyse uses this too.
+ */
+static enum EIbusState ibus_radio_state(const unsigned char *msg)
+{
+    unsigned char message = get_message(msg);
+
+    if(get_sender(msg) != RAD || get_receiver(msg) != GT)
+        return EStateUnknown;
+
+    if(message == UMID || message == ST) {
+        if(get_data_byte(msg, 0)==0x62 ) /*layout RadioDisplay*/
+            return ibus_match_text_state(msg);
+    }
+    else if(message == LCDC && get_data_length(msg)==1) {
+        switch(get_data_byte(msg, 0)) { /*menu brought foreground, state stays,*/
+            case 0x01: /*No Display Required*/
+            case 0x02: /*Radio Display Off*/
+                return EStateMenu;
+            default:
+                break;
+            }
+    }
+    return EStateUnknown;
+}
+
+static void handle_radio_state(const unsigned char *msg)
+{
+    enum EIbusState state;
+    TRACE_ENTRY(TRACE_FUNCTION);
+
+    /*display shows CD text until the emulated changer is stopped*/
+    if(ibus_state == EStateCDChanger)
+        goto exit;
+
+    state = ibus_radio_state(msg);
+    if(state != EStateUnknown && ibus_predict_confirm(state, get_message(msg)))
+        ibus_change_state(state);
+
+exit:
+    TRACE_EXIT(TRACE_FUNCTION);
+}
+
+static void handle_bmbt_button(const unsigned char *msg)
+{
+    unsigned char databyte = get_data_byte(msg, 0);
+    unsigned char longPress = 0;
+    unsigned char released = 0;
+
+    if(databyte & ButtonLongPress) {
+        databyte &= ~ButtonLongPress;
+        longPress = 1;
+    }
+    else if(databyte & ButtonRelease) {
+        databyte &= ~ButtonRelease;
+        released = 1;
+    }
+
+    if(databyte==ButtonRadioPower){
+        ibus_predict_cancel();
+        ibus_change_state(EStatePowerOff);
+    }
+    else if(!released && !longPress) {
+        /*radio shows the text of the new state later*/
+        if(databyte==ButtonMode)
+            ibus_predict_event(EPredictMode);
+        else if(databyte==ButtonFM)
+            ibus_predict_event(EPredictFM);
+        else if(databyte==ButtonAM)
+            ibus_predict_event(EPredictAM);
+    }
+
+    handle_ibus_button(databyte,released,longPress);
+}
+
+/*
+ * Radio tells BMBT the cassette status when tape plays. Cassette control
+ * is sent on every power on whatever the source, it tells nothing.
+ */
+static void handle_cassette(const unsigned char *msg)
+{
+    if(get_data_length(msg) && get_data_byte(msg, 0) == IBUS_CASSETTE_PLAYING)
+        ibus_predict_event(EPredictCassette);
+}
+
+static void handle_bmbt_tape_button(const unsigned char *msg)
+{
+    /*button command for select is in second byte of data*/
+    unsigned char databyte = get_data_byte(msg, 1);
+    unsigned char longPress = 0;
+    unsigned char released = 0;
+
+    if(databyte & ButtonLongPress) {
+        databyte &= ~ButtonLongPress;
+        longPress = 1;
+    }
+    else if(databyte & ButtonRelease) {
+        databyte &= ~ButtonRelease;
+        released = 1;
+    }
+
+    if(databyte == ButtonSelectInTapeMode) {
+        handle_ibus_button(SelectInTapeMode,released,longPress);
+    }
+    else{
+        printf("0x%02x, longPress %d, released %d\n",databyte,longPress,released);
+    }
+}
+
+static void handle_bmbt_knob(const unsigned char *msg)
+{
+    unsigned char databyte = get_data_byte(msg, 0);
+    int clockwise = 0;
+    uint16_t key;
+
+    if(databyte & ButtonMenuKnobClockwiseMask) {
+        databyte &= ~ButtonMenuKnobClockwiseMask;
+        clockwise = 1;
+    }
+
+    /*knob mapped to none in this state is not sent as wheel either*/
+    key = keymap->layers[ibus_state][clockwise?MenuKnobClockwiseMask:MenuKnobCounterClockwiseMask].key_code;
+    if(key == KEY_UNKNOWN)
+        return;
+
+    if(knob_wheel.window) {
+        if(databyte)
+            knob_wheel_turn(clockwise ? databyte : -databyte);
+        return;
+    }
+
+    /*databyte tells how many times need to send this command*/
+    while(databyte) {
+        send_key_event(key,1);
+        send_key_event(key,0);
+        databyte--;
+    }
+}
+
+static void handle_mfl_volume(const unsigned char *msg)
+{
+    unsigned char databyte = get_data_byte(msg, 0);
+    /*TODO: to volume function*/
+    /*volume*/
+    unsigned char steps = (databyte&0xF0)>>4;
+    if(databyte&0xF){ /*volume up*/
+        printf("volue up %d steps\n",steps);
+    } else { /*volume down*/
+        printf("volue down %d steps\n",steps);
+    }
+}
+
+static void handle_mfl_channel(const unsigned char *msg)
+{
+    unsigned char databyte = get_data_byte(msg, 0);
+    /*channel*/
+    unsigned char released = 0;
+    if(databyte & MFL2ButtonRelease) {
+        databyte &= ~MFL2ButtonRelease;
+        released = 1;
+    }
+    if(databyte & MFL2ButtonChannelUp){
+        handle_ibus_button(MFL2ChannelUp,released,0);
+    } else if(databyte & MFL2ButtonChannelDown){
+        handle_ibus_button(MFL2ChannelDown,released,0);
+    }
+
+    /*TODO: handle answer buttons and other mfl buttons*/
+}
+
+/*
+ * Vehicle state. Handler sets the fields it decoded and commits, readers
+ * see all fields of one message change at once.
+ */
+static uint32_t ibus_vehicle_get(enum EIbusVehicleField field)
+{
+    switch(field) {
+    case EVehicleIgnition: return ibus_vehicle->ignition;
+    case EVehicleSpeed: return ibus_vehicle->speed;
+    case EVehicleRpm: return ibus_vehicle->rpm;
+    case EVehicleOutsideTemperature: return (uint32_t)ibus_vehicle->outside_temperature;
+    case EVehicleCoolantTemperature: return (uint32_t)ibus_vehicle->coolant_temperature;
+    case EVehicleOdometer: return ibus_vehicle->odometer;
+    case EVehicleDoors: return ibus_vehicle->doors;
+    case EVehicleWindows: return ibus_vehicle->windows;
+    case EVehicleLamps: return ibus_vehicle->lamps;
+    default: return 0;
+    }
+}
+
+static void ibus_vehicle_set(enum EIbusVehicleField field, int32_t value)
+{
+    struct ibus_vehicle_state *state = ibus_vehicle;
+
+    if(state->field_generation[field] && ibus_vehicle_get(field) == (uint32_t)value)
+        return;
+
+    if(!ibus_vehicle_writing) {
+        __atomic_store_n(&state->sequence, state->sequence+1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        ibus_vehicle_writing = 1;
+        state->generation++;
+    }
+
+    switch(field) {
+    case EVehicleIgnition: state->ignition = value; break;
+    case EVehicleSpeed: state->speed = value; break;
+    case EVehicleRpm: state->rpm = value; break;
+    case EVehicleOutsideTemperature: state->outside_temperature = value; break;
+    case EVehicleCoolantTemperature: state->coolant_temperature = value; break;
+    case EVehicleOdometer: state->odometer = value; break;
+    case EVehicleDoors: state->doors = value; break;
+    case EVehicleWindows: state->windows = value; break;
+    case EVehicleLamps: state->lamps = value; break;
+    default: break;
+    }
+    state->field_generation[field] = state->generation;
+    TRACE_WARGS(TRACE_STATE, "vehicle %s %d\n",ibus_vehicle_field_names[field],value);
+}
+
+static void ibus_vehicle_commit()
+{
+    struct ibus_vehicle_state *state = ibus_vehicle;
+
+    if(!ibus_vehicle_writing)
+        return;
+    state->timestamp = (uint64_t)ibus_rx_time.tv_sec*1000000000ULL + ibus_rx_time.tv_nsec;
+    __atomic_store_n(&state->sequence, state->sequence+1, __ATOMIC_RELEASE);
+    ibus_vehicle_writing = 0;
+}
+
+/*
+ * Decodes the vehicle fields of IKE, LCM and GM broadcasts to values.
+ * Returns bitmask of the fields decoded, 0 if message has none.
+ * Decoding only, bmw-ibus-analyse uses this too.
+ */
+static unsigned int ibus_vehicle_decode(const unsigned char *msg, int32_t *values)
+{
+    unsigned char sender = get_sender(msg);
+    unsigned char message = get_message(msg);
+    unsigned int length = get_data_length(msg);
+
+    if(sender == IKE && message == IS && length >= 1) {
+        values[EVehicleIgnition] = get_data_byte(msg, 0);
+        return 1<<EVehicleIgnition;
+    }
+    if(sender == IKE && message == SR && length >= 2) {
+        /* speed in 2km/h and rpm in 100rpm steps */
+        values[EVehicleSpeed] = get_data_byte(msg, 0)*2;
+        values[EVehicleRpm] = get_data_byte(msg, 1)*100;
+        return 1<<EVehicleSpeed | 1<<EVehicleRpm;
+    }
+    if(sender == IKE && message == T && length >= 2) {
+        values[EVehicleOutsideTemperature] = (int8_t)get_data_byte(msg, 0);
+        values[EVehicleCoolantTemperature] = (int8_t)get_data_byte(msg, 1);
+        return 1<<EVehicleOutsideTemperature | 1<<EVehicleCoolantTemperature;
+    }
+    if(sender == IKE && message == O && length >= 3) {
+        /* km as 24 bit little endian */
+        values[EVehicleOdometer] = get_data_byte(msg, 0) | get_data_byte(msg, 1)<<8 | get_data_byte(msg, 2)<<16;
+        return 1<<EVehicleOdometer;
+    }
+    if(sender == LCM && message == LS && length >= 1) {
+        values[EVehicleLamps] = get_data_byte(msg, 0);
+        return 1<<EVehicleLamps;
+    }
+    if(sender == GM && message == DWS && length >= 2) {
+        values[EVehicleDoors] = get_data_byte(msg, 0);
+        values[EVehicleWindows] = get_data_byte(msg, 1);
+        return 1<<EVehicleDoors | 1<<EVehicleWindows;
+    }
+    return 0;
+}
+
+static void handle_vehicle(const unsigned char *msg)
+{
+    int32_t values[EVehicleFieldCount];
+    unsigned int fields = ibus_vehicle_decode(msg, values);
+    unsigned int field;
+
+    for(field = 0; field < EVehicleFieldCount; field++) {
+        if(fields & 1<<field)
+            ibus_vehicle_set(field, values[field]);
+    }
+    ibus_vehicle_commit();
+}
+
+/******************************************************************************
+ * IBUS message dispatch
+ *****************************************************************************/
+/**
+ * Handlers are registered by (sender, receiver, message) and compiled to a
+ * table indexed by message id. Messages without handlers, which is most of
+ * the bus traffic, cost one table lookup. Otherwise sender and receiver
+ * bitsets reject the message before the handlers of the slot are walked.
+ */
+static void ibus_register_handler(uint16_t sender, uint16_t receiver, unsigned char message, ibus_message_handler handler)
+{
+    if(ibus_handler_count == IBUS_MAX_HANDLERS) {
+        TRACE_WARGS(TRACE_FUNCTION, "too many handlers, message %02x ignored\n", message);
+        return;
+    }
+
+    ibus_handlers[ibus_handler_count].sender = sender;
+    ibus_handlers[ibus_handler_count].receiver = receiver;
+    ibus_handlers[ibus_handler_count].message = message;
+    ibus_handlers[ibus_handler_count].handler = handler;
+    ibus_handler_count++;
+}
+
+static inline void ibus_bitset_add(unsigned char *bitset, uint16_t device)
+{
+    if(device == IBUS_ANY)
+        memset(bitset, 0xFF, 256/8);
+    else
+        bitset[device>>3] |= 1<<(device&7);
+}
+
+static inline int ibus_bitset_test(const unsigned char *bitset, unsigned char device)
+{
+    return bitset[device>>3]&(1<<(device&7));
+}
+
+/*
+ * Adds filter allow|deny:sender|receiver|message=list where list is comma
+ * separated hex values, e.g. deny:sender=3f,c8. Filtered frames reach no
+ * handler and do not change the vehicle state. Returns 0 or negative errno.
+ */
+static int ibus_add_filter(const char *spec)
+{
+    char kind[8],field[16],list[256];
+    unsigned char *bitset;
+    char *value,*end,*save;
+    unsigned long id;
+    unsigned int i;
+
+    if(sscanf(spec, "%7[a-z]:%15[a-z]=%255s", kind, field, list) != 3)
+        return -EINVAL;
+    for(i = 0; i < EFilterFieldCount; i++) {
+        if(strcmp(field, ibus_filter_field_names[i]) == 0)
+            break;
+    }
+    if(i == EFilterFieldCount)
+        return -EINVAL;
+
+    if(strcmp(kind, "allow") == 0) {
+        bitset = ibus_filter.allow[i];
+        ibus_filter.has_allow[i] = 1;
+    }
+    else if(strcmp(kind, "deny") == 0)
+        bitset = ibus_filter.deny[i];
+    else
+        return -EINVAL;
+
+    for(value = strtok_r(list, ",", &save); value; value = strtok_r(0, ",", &save)) {
+        id = strtoul(value, &end, 16);
+        if(*end || end == value || id > 0xFF)
+            return -EINVAL;
+        ibus_bitset_add(bitset, id);
+    }
+    ibus_filter.enabled = 1;
+    return 0;
+}
 
-    TRACE_WARGS(TRACE_STATE, "old state %x\n",status);
-    /* check if already enabled/disabled before altering */
-    if(enable){
-    	if((status&line)==line){
-    		goto exit;
-    	}
-        status |= line;
+/*
+ * Folds the lists to pass bitsets. Filtered frames never reach the handlers,
+ * so a filter that blocks a handled sender, receiver or message is told.
+ */
+static void ibus_build_filter()
+{
+    const struct ibus_handler *handler;
+    uint16_t fields[EFilterFieldCount];
+    unsigned char told[EFilterFieldCount][256/8];
+    unsigned int i,j;
+
+    for(i = 0; i < EFilterFieldCount; i++) {
+        for(j = 0; j < 256/8; j++)
+            ibus_filter.pass[i][j] = (ibus_filter.has_allow[i] ? ibus_filter.allow[i][j] : 0xFF) & ~ibus_filter.deny[i][j];
     }
-    else {
-    	if(!((status&line)==line)){
-			goto exit;
-		}
-        status &= ~line;
+    if(!ibus_filter.enabled)
+        return;
+
+    memset(told, 0, sizeof(told));
+    for(i = 0; i < ibus_handler_count; i++) {
+        handler = &ibus_handlers[i];
+        fields[EFilterSender] = handler->sender;
+        fields[EFilterReceiver] = handler->receiver;
+        fields[EFilterMessage] = handler->message;
+        for(j = 0; j < EFilterFieldCount; j++) {
+            if(fields[j] != IBUS_ANY && !ibus_bitset_test(ibus_filter.pass[j], fields[j])) {
+                if(!ibus_bitset_test(told[j], fields[j]))
+                    fprintf(stderr, "filter drops %s %02x which has handlers\n",
+                        ibus_filter_field_names[j], fields[j]);
+                ibus_bitset_add(told[j], fields[j]);
+                break;
+            }
+        }
     }
+}
 
-    if(ioctl(ibus_device_fd, TIOCMSET, &status) < 0){
-    	TRACE_ERROR("Can't set TIOCM");
-    	goto err;
+/* returns 1 if the message passes the filter, counts the rule that dropped it */
+static inline int ibus_filter_message(const unsigned char *msg)
+{
+    const unsigned char fields[EFilterFieldCount] = { get_sender(msg), get_receiver(msg), get_message(msg) };
+    unsigned int i;
+
+    if(ibus_bitset_test(ibus_filter.pass[EFilterSender], fields[EFilterSender]) &&
+       ibus_bitset_test(ibus_filter.pass[EFilterReceiver], fields[EFilterReceiver]) &&
+       ibus_bitset_test(ibus_filter.pass[EFilterMessage], fields[EFilterMessage])) {
+        ibus_filter.passed++;
+        return 1;
     }
 
-exit:
-    TRACE_EXIT_WARGS(TRACE_STATE, "new state %x\n",status);
+    for(i = 0; i < EFilterFieldCount; i++) {
+        if(ibus_bitset_test(ibus_filter.deny[i], fields[i])) {
+            ibus_filter.deny_hits[i]++;
+            break;
+        }
+        if(ibus_filter.has_allow[i] && !ibus_bitset_test(ibus_filter.allow[i], fields[i])) {
+            ibus_filter.allow_misses[i]++;
+            break;
+        }
+    }
     return 0;
-err:
-	TRACE_EXIT_WARGS(TRACE_STATE, "error %d",-errno);
-	return -errno;
 }
 
-static void enable_video_input(int enable)
+/*
+ * Compiles registered handlers to the dispatch table. Handlers of the same
+ * message are kept together in registration order.
+ */
+static void ibus_build_dispatch_table()
 {
-	TRACE_ENTRY_WARGS(TRACE_STATE, "enable %d\n",enable);
+    unsigned int i,j,count = 0;
+    struct ibus_dispatch_slot *slot;
+
+    memset(ibus_dispatch_index, 0, sizeof(ibus_dispatch_index));
+    memset(ibus_dispatch_slots, 0, sizeof(ibus_dispatch_slots));
+
+    for(i = 0; i < ibus_handler_count; i++) {
+        unsigned char message = ibus_handlers[i].message;
+        if(ibus_dispatch_index[message])
+            continue; /*already collected*/
+
+        /*slot 0 is reserved for messages without handlers*/
+        ibus_dispatch_index[message] = i+1;
+        slot = &ibus_dispatch_slots[i+1];
+        slot->first = count;
+        for(j = i; j < ibus_handler_count; j++) {
+            if(ibus_handlers[j].message != message)
+                continue;
+            ibus_dispatch_handlers[count++] = ibus_handlers[j];
+            slot->count++;
+            ibus_bitset_add(slot->senders, ibus_handlers[j].sender);
+            ibus_bitset_add(slot->receivers, ibus_handlers[j].receiver);
+        }
+    }
+}
 
-	switch(VideoInputSwitch)
-		{
-		case ESwitchCTS:
-			{
-			set_line(TIOCM_CTS,enable);
-			break;
-			}
-		case ESwitchRTS:
-			{
-			set_line(TIOCM_RTS,enable);
-			break;
-			}
-		case ESwitchGPIO:
-			{
-			//TODO
-			break;
-			}
-		case ESwitchUnknown:
-		default:
-			{
-			//TODO
-			break;
-			}
-		}
+static inline void ibus_dispatch(const unsigned char *msg)
+{
+    const struct ibus_dispatch_slot *slot;
+    const struct ibus_handler *handler;
+    unsigned char sender,receiver;
+    unsigned int i;
+
+    slot = &ibus_dispatch_slots[ibus_dispatch_index[get_message(msg)]];
+    if(!slot->count)
+        return;
+
+    sender = get_sender(msg);
+    receiver = get_receiver(msg);
+    if(!ibus_bitset_test(slot->senders, sender) || !ibus_bitset_test(slot->receivers, receiver))
+        return;
+
+    for(i = slot->first; i < slot->first + slot->count; i++) {
+        handler = &ibus_dispatch_handlers[i];
+        if((handler->sender == IBUS_ANY || handler->sender == sender) &&
+           (handler->receiver == IBUS_ANY || handler->receiver == receiver))
+            handler->handler(msg);
+    }
+}
 
-	TRACE_EXIT(TRACE_STATE);
+static void ibus_register_default_handlers()
+{
+    /* buttons, mapped with the compiled-in table until -k keymap is loaded */
+    ibus_keymap_default(&default_keymap);
+    ibus_register_handler(BMBT, IBUS_ANY, BMBTB1, handle_bmbt_button);
+    ibus_register_handler(BMBT, IBUS_ANY, BMBTB0, handle_bmbt_tape_button);
+    ibus_register_handler(BMBT, IBUS_ANY, KNOB, handle_bmbt_knob);
+    ibus_register_handler(RAD, BMBT, CS, handle_cassette);
+    ibus_register_handler(BMBT, IBUS_ANY, MFLB, handle_mfl_volume);
+    ibus_register_handler(MFL, RAD, MFLB, handle_mfl_volume);
+    ibus_register_handler(MFL, RAD, MFLB2, handle_mfl_channel);
+
+    /* vehicle state */
+    ibus_register_handler(IKE, IBUS_ANY, IS, handle_vehicle);
+    ibus_register_handler(IKE, IBUS_ANY, SR, handle_vehicle);
+    ibus_register_handler(IKE, IBUS_ANY, T, handle_vehicle);
+    ibus_register_handler(IKE, IBUS_ANY, O, handle_vehicle);
+    ibus_register_handler(LCM, IBUS_ANY, LS, handle_vehicle);
+    ibus_register_handler(GM, IBUS_ANY, DWS, handle_vehicle);
+
+    /* emulated CD changer */
+    if(ibus_cdc.enabled) {
+        ibus_register_handler(RAD, CDC, DSREQ, handle_cdc_poll);
+        ibus_register_handler(RAD, CDC, CDSREQ, handle_cdc_request);
+        ibus_register_handler(CDC, IBUS_ANY, DSRED, handle_cdc_echo);
+        ibus_register_handler(CDC, RAD, CDS, handle_cdc_echo);
+    }
+
+    /* state, handled only if hijack state is given. CD changer needs no text*/
+    if(IbusHijackState == EStateCDChanger)
+        ibus_predict_enabled = 0;
+    else if(IbusHijackState != EStateUnknown) {
+        ibus_register_handler(RAD, GT, UMID, handle_radio_state);
+        ibus_register_handler(RAD, GT, ST, handle_radio_state);
+        ibus_register_handler(RAD, GT, LCDC, handle_radio_state);
+    }
+
+    ibus_build_dispatch_table();
 }
+
 /*
- * Change the IBUS state machine state. This controls when video output is
- * enabled and when buttons events are injected to the system queue
+ * Processes one valid message of the bus
  */
-static void ibus_change_state(enum EIbusState aNewState)
-    {
-    TRACE_ENTRY_WARGS(TRACE_STATE, "new state %d\n",aNewState);
+static void process_ibus_message(struct ibus_bus *bus, const unsigned char *msg, unsigned int length)
+{
+    struct ibus_latency *latency;
+    struct timespec dispatched;
+    TRACE_ENTRY(TRACE_FUNCTION);
 
-    if(ibus_state==aNewState){
-    	TRACE_WARGS(TRACE_STATE, "state already %d -> do nothing\n",aNewState);
-    	goto exit;
+    if(bus->tx.inflight)
+        ibus_tx_check_echo(bus, msg, length);
+    ibus_traffic_add(bus, msg, length);
+
+    /* reverse camera before anything slower is done, even if filtered */
+    if(get_message(msg) == ISS && get_sender(msg) == IKE && bus->type != EBusDBus)
+        ibus_reverse_check(msg);
+
+    /* 0. drop filtered traffic before it is traced or handled*/
+    if(ibus_filter.enabled && bus->type != EBusDBus && !ibus_filter_message(msg))
+        goto exit;
+
+    /* 1. print valid message if trace enabled*/
+    if(trace_level&TRACE_IBUS) {
+        if(trace_binary_fd >= 0)
+            trace_record_data(ibus_bus_trace_id(bus), msg, length);
+        else
+            print_bus_message(bus, msg, length);
     }
 
-    ibus_state = aNewState;
+    if(shm_ring)
+        ibus_shm_publish(bus, msg, length);
+
+    /* diagnostic messages are only traced */
+    if(bus->type == EBusDBus)
+        goto exit;
+
+    /* 2. Handle the message */
+    latency = &ibus_latency[ibus_dispatch_index[get_message(msg)]];
+    clock_gettime(CLOCK_MONOTONIC, &dispatched);
+    ibus_latency_add(&latency->dispatch, &ibus_rx_time, &dispatched);
+    ibus_dispatch(msg);
 
-    if(ibus_state==IbusHijackState && IbusHijackState!=EStateUnknown){
-    	send_key_events = 1;
-    	enable_video_input(1);
+    /* 3. Inject key and wheel events generated by the message */
+    if(send_input_events() > 0)
+        ibus_latency_add(&latency->inject, &ibus_rx_time, &input_write_time);
+
+exit:
+    TRACE_EXIT(TRACE_FUNCTION);
+}
+
+/*
+ * Processes every complete message in the receive ring of the bus. Messages
+ * are handled as soon as their last byte has arrived. If message is invalid,
+ * buffered data is silently discarded and next message is read.
+ */
+static void process_ibus_data(struct ibus_bus *bus)
+{
+    struct ibus_parser *rx = &bus->rx;
+    unsigned int length = 0;
+    enum EIbusParseResult res;
+    TRACE_ENTRY(TRACE_FUNCTION);
+
+    ibus_rx_time = bus->rx_time;
+    bus->pending = 0;
+
+    res = ibus_parse_next(rx, &length);
+    while(res != EParseNeedMore) {
+        if(res == EParseMessage) {
+            bus->stats.messages++;
+            if(rx->resyncing) {
+                /*message was buffered when invalid data was found*/
+                if((int)(rx->recover_until - rx->ring.tail) > 0)
+                    bus->stats.recovered++;
+                else
+                    rx->resyncing = 0;
+            }
+            process_ibus_message(bus, ibus_ring_message(&rx->ring, length), length);
+            ibus_parser_consume(rx, length);
+            res = ibus_parse_next(rx, &length);
+            continue;
+        }
+
+        if(res == EParseInvalidLength) {
+            TRACE_WARGS(TRACE_IBUS,"Invalid message length!! %d\n",ibus_ring_peek(&rx->ring, EPosLength));
+        } else {
+            TRACE_WARGS(TRACE_IBUS,"Invalid checksum!! %x\n",ibus_ring_peek(&rx->ring, length-1));
+        }
+        /*own frame collided with another device*/
+        if(bus->tx.inflight)
+            ibus_tx_check_corruption(bus);
+        res = ibus_resync(rx, &length);
     }
-    else{
-    	send_key_events = 0;
-    	enable_video_input(0);
+    if(shm_ring)
+        ibus_shm_notify();
+
+    TRACE_EXIT(TRACE_FUNCTION);
+}
+
+/*
+ * Line has been idle while message was incomplete. Message will never
+ * complete so the start of it was invalid, resynchronize to the data after it.
+ */
+static void process_ibus_idle(struct ibus_bus *bus)
+{
+    unsigned int length;
+    TRACE_ENTRY(TRACE_FUNCTION);
+
+    bus->stats.idle_timeouts++;
+    TRACE_WARGS(TRACE_IBUS,"Incomplete message, %d bytes missing\n",ibus_parse_needed(&bus->rx));
+    ibus_resync(&bus->rx, &length);
+    process_ibus_data(bus);
+
+    TRACE_EXIT(TRACE_FUNCTION);
+}
+
+/*
+ * Processes the data read from all buses in the order it was read, so the
+ * messages of all buses form one ordered stream.
+ */
+static void ibus_process_pending()
+{
+    struct ibus_bus *bus,*oldest;
+    unsigned int i;
+
+    for(;;) {
+        oldest = 0;
+        for(i = 0; i < ibus_bus_count; i++) {
+            bus = &ibus_buses[i];
+            if(bus->pending && (!oldest ||
+               bus->rx_time.tv_sec < oldest->rx_time.tv_sec ||
+               (bus->rx_time.tv_sec == oldest->rx_time.tv_sec && bus->rx_time.tv_nsec < oldest->rx_time.tv_nsec)))
+                oldest = bus;
+        }
+        if(!oldest)
+            break;
+        process_ibus_data(oldest);
     }
+}
 
-    if(ibus_state==EStateAUX)
-        TRACE(TRACE_STATE,"IBUS STATE changed to AUX\n");
-    else if(ibus_state==EStateFM)
-        TRACE(TRACE_STATE,"IBUS STATE changed to FM\n");
-    else if(ibus_state==EStateMenu)
-        TRACE(TRACE_STATE,"IBUS STATE changed to MENU\n");
-    else if(ibus_state==EStatePowerOff)
-        TRACE(TRACE_STATE,"IBUS STATE changed to POWEROFF\n");
-    else if(ibus_state==EStateTAPE)
-        TRACE(TRACE_STATE,"IBUS STATE changed to TAPE\n");
-    else if(ibus_state==EStateUnknown)
-        TRACE(TRACE_STATE,"IBUS STATE changed to UNKNOWN\n");
+/******************************************************************************
+ * replay functions
+ *****************************************************************************/
+/*
+ * Feeds capture directly to the parsers of its buses with the original
+ * timing scaled by replay speed. Gaps in the capture time out incomplete
+ * messages the same way the serial line idle timeout does.
+ * Returns 0 or negative errno.
+ */
+static int replay_capture(const char *path)
+{
+    static unsigned char data[IBUS_RING_SIZE];
+    struct capture_reader reader;
+    struct capture_record_header record;
+    struct timespec start,end;
+    struct ibus_bus *bus;
+    uint64_t elapsed_us = 0;
+    uint64_t last_us[IBUS_MAX_BUSES];
+    uint64_t gap_ns,timeout_ns;
+    unsigned long bytes = 0,messages = 0;
+    unsigned int pos,i;
+    double wall;
+    int res;
+    TRACE_ENTRY(TRACE_FUNCTION);
 
-exit:
-    TRACE_EXIT(TRACE_STATE);
+    res = capture_open_read(&reader, path);
+    if(res < 0)
+        goto err;
+
+    /* buses of the capture replace the serial devices */
+    ibus_bus_count = 0;
+    for(i = 0; i < reader.buses.count; i++) {
+        ibus_bus_add(reader.buses.types[i], path);
+        last_us[i] = 0;
     }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while(!exit_request && (res = capture_read(&reader, &record, data)) > 0) {
+        elapsed_us += record.delta;
+        replay_wait(&start, elapsed_us);
+        if(stats_request) {
+            stats_request = 0;
+            dump_stats();
+        }
 
+        /*line was idle while message was incomplete*/
+        bus = &ibus_buses[record.bus];
+        gap_ns = (elapsed_us - last_us[record.bus])*1000;
+        last_us[record.bus] = elapsed_us;
+        while(ibus_ring_count(&bus->rx.ring)) {
+            timeout_ns = (ibus_parse_needed(&bus->rx)+2)*IBUS_CHAR_TIME_NS;
+            if(gap_ns <= timeout_ns)
+                break;
+            gap_ns -= timeout_ns;
+            process_ibus_idle(bus);
+        }
 
-static unsigned char calc_ibus_checksum(unsigned int checksum_index)
-    {
-    unsigned char i,checksum;
-    for(i = 0,checksum=0; i < checksum_index; i++)
-        {
-        checksum = checksum ^ ibus_data[i];
+        bus->stats.wakeups++;
+        bus->stats.reads++;
+        bus->stats.bytes += record.length;
+        clock_gettime(CLOCK_MONOTONIC, &bus->rx_time);
+        for(pos = 0; pos < record.length; ) {
+            pos += ibus_ring_put(&bus->rx.ring, &data[pos], record.length-pos);
+            process_ibus_data(bus);
         }
-    return checksum;
+    }
+    capture_close_read(&reader);
+    if(res < 0)
+        goto err;
+
+    /*end of capture, lines stay idle*/
+    for(i = 0; i < ibus_bus_count; i++) {
+        bus = &ibus_buses[i];
+        while(ibus_ring_count(&bus->rx.ring))
+            process_ibus_idle(bus);
+        bytes += bus->stats.bytes;
+        messages += bus->stats.messages;
     }
 
-static inline unsigned char get_message_length()
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1000000000.0;
+    fprintf(stderr, "replayed %lu bytes, %lu messages, %.3f s capture in %.3f s, %.0f messages/s\n",
+        bytes, messages, elapsed_us/1000000.0, wall,
+        wall > 0 ? messages/wall : 0.0);
+
+    TRACE_EXIT(TRACE_FUNCTION);
+    return 0;
+err:
+    TRACE_EXIT_WARGS(TRACE_FUNCTION, "error %d\n", res);
+    return res;
+}
+
+/*
+ * Writes data to the pseudo terminal master. Waits while the slave side is
+ * full and gives up if exit is requested.
+ */
+static int replay_pty_write(int fd, const unsigned char *data, unsigned int length)
 {
-    return (ibus_data[EPosLength]+ESenderAndLengthLength);
+    struct pollfd pfd;
+    ssize_t res;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while(length && !exit_request) {
+        res = write(fd, data, length);
+        if(res < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            return -errno;
+        }
+        data += res;
+        length -= res;
+    }
+    return 0;
 }
 
-static inline unsigned char get_data_length()
-    {
-    unsigned char len = get_message_length();
-    if(len <= EMinimumMessageLength)
-        len = 0; /*set it to 0 just in case*/
-    else
-        len -= EMinimumMessageLength;
-    return len;
+/*
+ * Pseudo terminal feeder. Writes the capture to the master sides with the
+ * original timing and requests exit when the capture has been replayed.
+ */
+static void* replay_feeder(void *arg)
+{
+    static unsigned char data[IBUS_RING_SIZE];
+    struct capture_reader reader;
+    struct capture_record_header record;
+    struct timespec start;
+    struct timespec drain = { 0, 500000000L }; /*longer than idle timeout of the longest message*/
+    uint64_t elapsed_us = 0;
+    int res;
+
+    (void)arg;
+    res = capture_open_read(&reader, replay_pty_path);
+    if(res < 0) {
+        errno = -res;
+        TRACE_ERROR("Can't open capture");
+        goto exit;
     }
 
-static inline unsigned char get_sender()
-    {
-    return ibus_data[EPosSender];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!exit_request && (res = capture_read(&reader, &record, data)) > 0) {
+        elapsed_us += record.delta;
+        replay_wait(&start, elapsed_us);
+        if((res = replay_pty_write(replay_master_fds[record.bus], data, record.length)) < 0)
+            break;
     }
-static inline unsigned char get_receiver()
-    {
-    return ibus_data[EPosReceiver];
+    if(res < 0) {
+        errno = -res;
+        TRACE_ERROR("Can't replay capture");
     }
-static inline unsigned char get_message()
-    {
-    return ibus_data[EPosMessage];
+    capture_close_read(&reader);
+
+    /*let the daemon read and time out the rest*/
+    nanosleep(&drain, 0);
+exit:
+    kill(getpid(), SIGTERM);
+    return 0;
+}
+
+static void replay_pty_close()
+{
+    unsigned int i;
+
+    if(replay_feeder_running) {
+        exit_request = 1;
+        pthread_join(replay_feeder_thread, 0);
+        replay_feeder_running = 0;
     }
+    for(i = 0; i < replay_master_count; i++)
+        close(replay_master_fds[i]);
+    replay_master_count = 0;
+}
 
-/* returns the nth data byte */
-static inline unsigned char get_data_byte(unsigned int idx)
+/*
+ * Creates pseudo terminal for every bus of the capture and adds the slave
+ * sides as buses, they are opened like serial devices.
+ * Returns 0 or negative errno.
+ */
+static int replay_pty_open(const char *path)
 {
-    return ibus_data[EPosDataStart+idx];
+    struct capture_reader reader;
+    const char *slave;
+    unsigned int i;
+    int fd,res;
+
+    res = capture_open_read(&reader, path);
+    if(res < 0)
+        return res;
+    capture_close_read(&reader);
+
+    ibus_bus_count = 0;
+    for(i = 0; i < reader.buses.count; i++) {
+        fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if(fd < 0)
+            goto err;
+        replay_master_fds[replay_master_count++] = fd;
+        if(grantpt(fd) < 0 || unlockpt(fd) < 0 || !(slave = ptsname(fd)))
+            goto err;
+        ibus_bus_add(reader.buses.types[i], slave);
+    }
+    replay_pty_path = path;
+    return 0;
+
+err:
+    res = -errno;
+    replay_pty_close();
+    return res;
 }
 
-static inline unsigned int data_contains(const char* tag)
+/* starts feeding the capture, line settings must be done before */
+static int replay_pty_start()
 {
-    return strstr((char*)&ibus_data[EPosDataStart],tag)?1:0;
+    sigset_t mask,orig_mask;
+    int res;
+
+    /*signals must wake up the main loop, not the feeder*/
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &orig_mask);
+    res = pthread_create(&replay_feeder_thread, 0, replay_feeder, 0);
+    pthread_sigmask(SIG_SETMASK, &orig_mask, 0);
+    if(res)
+        return -res;
+    replay_feeder_running = 1;
+    return 0;
 }
 
-static void print_ibus_message()
-    {
-    int addData = 1;
-    unsigned int idx = 0;
-    unsigned char data = 0;
-    unsigned char dataLen = get_data_length();
-    unsigned int curr_mes_len = get_message_length();
+#ifdef __TEST__
+static void testibusmessage(char* buf){
+    struct ibus_bus *bus = &ibus_buses[0];
+    unsigned int length = strlen(buf)/2;
+    int unsigned i;
+    for (i = 0; i < length; i++, bus->rx.ring.head++)
+        sscanf(&buf[i * 2], "%2hhx", &bus->rx.ring.data[bus->rx.ring.head&IBUS_RING_MASK]);
 
-    TRACE(TRACE_IBUS,"");
+    process_ibus_data(bus);
+}
+#endif
 
-    /*print message in hex. print data without spaces and send,len,res,mes and cs with spaces*/
-    /*F0 04 53 23 ABBADABBAAAA C8*/
+#ifndef IBUS_NO_MAIN
+static void print_help(char* name)
+{
+	fprintf(stderr, "Usage: %s <options>",name);
+	fprintf(stderr, "-d serial device name (Mandatory). Bus type can be given as ibus=, kbus= or dbus= prefix, ibus by default. Can be given many times\n");
+	fprintf(stderr, "-h hijack mode. FM/TAPE/AUX/CDC, CDC needs -C\n");
+	fprintf(stderr, "-v video input switch. CTS/RTS/GPIO\n");
+	fprintf(stderr, "-t tracelevel mask. TRACE_FUNCTION=1<<0, TRACE_IBUS=1<<1, TRACE_INPUT=1<<2, TRACE_STATE=1<<3 and TRACE_STATS=1<<4\n");
+	fprintf(stderr, "-f trace file\n");
+	fprintf(stderr, "-b binary trace. Trace file is written by background thread, decode with bmw-ibus-tracedump\n");
+	fprintf(stderr, "-P no predictive state. By default Mode, FM and AM buttons and cassette frames change the state before radio text confirms it\n");
+	fprintf(stderr, "-g video switch GPIO, chip:line[:low], e.g. /dev/gpiochip0:17. Line is output, selects -v GPIO\n");
+	fprintf(stderr, "-p radio text pattern for state. STATE=text, e.g. AUX=AUX or FM=UKW. Can be given many times\n");
+	fprintf(stderr, "-c capture file. Every received byte is written with receive time\n");
+	fprintf(stderr, "-r replay capture file directly to the parser instead of serial device. uinput is optional\n");
+	fprintf(stderr, "-R replay capture file through pseudo terminal instead of serial device\n");
+	fprintf(stderr, "-x replay speed. 1 is real time (default), N is N times faster and 0 as fast as possible\n");
+	fprintf(stderr, "-u publish frames to local clients. Shared memory ring is handed out through unix socket of this path, see bmw-ibus-shm.h\n");
+	fprintf(stderr, "-F frame filter allow|deny:sender|receiver|message=hex list, e.g. deny:sender=3f,c8. Filtered frames are dropped before tracing and handling and do not change the vehicle state, filters that drop handled frames are warned of. Can be given many times\n");
+	fprintf(stderr, "-s send message when the line is open, [ibus=|kbus=]sender receiver message and data as hex, e.g. 3f0068c001. Can be given many times\n");
+	fprintf(stderr, "-k keymap file. Lines button key [long=key] [repeat=delay ms,rate ms], [AUX|TAPE|FM|MENU|CDC] section maps keys for that state only and sends keys in it. Reloaded on SIGHUP and when the file changes\n");
+	fprintf(stderr, "-C emulate CD changer. Radio polls are answered within %dms and track, disc, play, pause, stop, scan and random commands are sent as keys in CDC state\n",IBUS_CDC_REPLY_DEADLINE_MS);
+	fprintf(stderr, "-w knob as wheel, window ms[,acceleration %%]. Knob detents within window are sent as one REL_WHEEL event instead of arrow keys, every detent after the first adds acceleration %% to the gain. e.g. 40,25 (default)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-S stats socket. Every client connecting to unix socket of this path gets the stats and traffic tables as text\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "SIGHUP reloads -k keymap\n");
+	fprintf(stderr, "SIGUSR1 traces stats, latency histograms and traffic tables whatever the trace level is\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "example: %s -d /dev/ttyUSB0 -h AUX -v CTS -t 15 -f ~/tracefile.log \n",name);
+	fprintf(stderr, "example: %s -d ibus=/dev/ttyUSB0 -d kbus=/dev/ttyUSB1 -h AUX -t 2\n",name);
+	fprintf(stderr, "example: %s -d /dev/ttyUSB0 -C -h CDC -v CTS\n",name);
+	fprintf(stderr, "\n");
+}
 
-    do{
-        if(idx < 4 || idx == curr_mes_len-1)
-            printf(" %02x",ibus_data[idx]);
-        else
-            printf("%02x",ibus_data[idx]);
-        idx++;
+/******************************************************************************
+ * Main loop
+ *****************************************************************************/
+/* 10min without messages on the bus */
+#define IBUS_IDLE_SHUTDOWN 600
+
+static struct event_source ibus_idle_timer;
+static struct event_source stats_timer;
+static struct event_source signal_source;
+static struct event_source keymap_watch;
+
+/* -s messages sent when the lines are open */
+#define IBUS_MAX_STARTUP_MESSAGES 16
+static char *startup_messages[IBUS_MAX_STARTUP_MESSAGES];
+static unsigned int startup_message_count;
+
+/*
+ * Queues [ibus=|kbus=]sender,receiver,message and data as hex, e.g.
+ * 3f0068c001. Sent to the first I-Bus or K-Bus without the prefix.
+ * Returns 0 or negative errno.
+ */
+static int ibus_send_hex(char *spec)
+{
+    unsigned char data[0xFF];
+    struct ibus_bus *bus = 0;
+    char *hex = strchr(spec, '=');
+    unsigned int i,length;
+    int type = -1;
+
+    if(hex) {
+        *hex++ = '\0';
+        type = ibus_bus_type_from_name(spec);
+        if(type < 0)
+            return -EINVAL;
+    }
+    else
+        hex = spec;
+
+    for(i = 0; i < ibus_bus_count && !bus; i++) {
+        if(type < 0 ? ibus_buses[i].type != EBusDBus : ibus_buses[i].type == (enum EIbusBusType)type)
+            bus = &ibus_buses[i];
+    }
+    if(!bus)
+        return -ENODEV;
+
+    length = strlen(hex)/2;
+    if(length < 3 || length > sizeof(data) || strlen(hex)%2)
+        return -EINVAL;
+    for(i = 0; i < length; i++) {
+        if(sscanf(&hex[i*2], "%2hhx", &data[i]) != 1)
+            return -EINVAL;
+    }
+    return ibus_send(bus, ETxPriorityNormal, data[0], data[1], &data[2], length-2);
+}
+
+/* -C changer is on the first I-Bus or K-Bus. Returns 0 or negative errno */
+static int ibus_cdc_open()
+{
+    unsigned int i;
+
+    for(i = 0; i < ibus_bus_count && !ibus_cdc.bus; i++) {
+        if(ibus_buses[i].type != EBusDBus)
+            ibus_cdc.bus = &ibus_buses[i];
+    }
+    return ibus_cdc.bus ? 0 : -ENODEV;
+}
+
+/* changer announces itself when the line is open, radio starts polling it */
+static int ibus_cdc_announce()
+{
+    unsigned char data[2];
+
+    data[0] = DSRED;
+    data[1] = CDC_DEVICE_ANNOUNCE;
+    return ibus_send(ibus_cdc.bus, ETxPriorityNormal, CDC, LOC, data, sizeof(data));
+}
+
+/*
+ * Frame timer runs while a message is incomplete to notice that the line
+ * went idle in the middle of it. It is only touched when that changes.
+ */
+static void ibus_arm_frame_timer(struct ibus_bus *bus)
+{
+    struct timespec timeout = { 0, 0 };
+    int pending = ibus_ring_count(&bus->rx.ring) != 0;
+
+    if(!pending && !bus->frame_timer_armed)
+        return;
+    /* 9600baud = 9600 bits per second*/
+    /* 1 start bit, 8 data bits,1 stop bit, even parity = 11 bit = 1 char*/
+    /* 11 bits x 1sec/9600 = 1,15ms/char*/
+    if(pending)
+        timeout.tv_nsec = (ibus_parse_needed(&bus->rx)+2)*IBUS_CHAR_TIME_NS;
+    if(event_timer_set(bus->frame_timer.fd, &timeout, 0) < 0)
+        TRACE_ERROR("Can't set frame timer");
+    bus->frame_timer_armed = pending;
+}
+
+/*
+ * Reads the line. Data is processed after all ready buses have been read,
+ * see service_buses, unless the ring gets full.
+ */
+static void on_ibus_readable(struct event_source *source, uint32_t events)
+{
+    struct ibus_bus *bus = source->context;
+    int res;
+
+    bus->stats.wakeups++;
+    for(;;) {
+        res = ibus_bus_fill(bus);
+        if(res > 0)
+            bus->pending = 1;
+        /*if ring got full there is more data waiting in the driver*/
+        if(res <= 0 || ibus_ring_count(&bus->rx.ring) < IBUS_RING_SIZE)
+            break;
+        process_ibus_data(bus);
+    }
+    bus->readable = 1;
+
+    if(res < 0) {
+        TRACE_WARGS(1, "WARNING!!! read returned %d\n",res);
+    }
+    if(events & (EPOLLERR | EPOLLHUP)) {
+        /*adapter unplugged, line will not come back*/
+        TRACE_WARGS(TRACE_ALL, "%s line hung up\n",ibus_bus_names[bus->type]);
+        event_del(source);
+        bus->hung_up = 1;
+    }
+}
+
+/*
+ * Processes what was read from the buses in the order it was read and
+ * moves VMIN and frame timer of the buses that were read.
+ */
+static void service_buses()
+{
+    struct ibus_bus *bus;
+    unsigned int i,open = 0;
+
+    ibus_process_pending();
+    for(i = 0; i < ibus_bus_count; i++) {
+        bus = &ibus_buses[i];
+        if(bus->readable && !bus->hung_up) {
+            ibus_update_vmin(bus);
+            ibus_arm_frame_timer(bus);
+        }
+        bus->readable = 0;
+        open += !bus->hung_up;
     }
-    while(idx < curr_mes_len);
+    if(!open)
+        exit_request = 1;
+}
 
-    printf(" = %s",IBUSDevices[get_sender()]);
-    printf(" SENT ");
+static void on_tx_timeout(struct event_source *source, uint32_t events)
+{
+    if(event_timer_expired(source->fd))
+        ibus_tx_service(source->context);
+}
 
-    if(get_message()==BMBTB1 && get_data_length()==1)
-        {
-    	data = get_data_byte(0);
-        int longPress = 0;
-		int release = 0;
+static void on_frame_timeout(struct event_source *source, uint32_t events)
+{
+    struct ibus_bus *bus = source->context;
+    int res;
+
+    if(!event_timer_expired(source->fd))
+        return;
+    bus->frame_timer_armed = 0;
+    if(!ibus_ring_count(&bus->rx.ring) || bus->hung_up)
+        return;
+
+    /*less than VMIN bytes may still wait in the driver*/
+    res = ibus_bus_fill(bus);
+    if(res > 0)
+        process_ibus_data(bus);
+    else /*timeout occured => message will not complete*/
+        process_ibus_idle(bus);
+    ibus_update_vmin(bus);
+    ibus_arm_frame_timer(bus);
+}
 
-		if(data & ButtonLongPress)
-			{
-			data &= ~ButtonLongPress;
-			longPress = 1;
-			}
-		else if(data & ButtonRelease)
-			{
-			data &= ~ButtonRelease;
-			release = 1;
-			}
+/*
+ * Idle timer is not rearmed on every read. When it expires it is set again
+ * for the time left from the last read.
+ */
+static void on_idle_timeout(struct event_source *source, uint32_t events)
+{
+    struct timespec now,timeout = { 0, 0 };
+
+    if(!event_timer_expired(source->fd))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout.tv_sec = IBUS_IDLE_SHUTDOWN - (now.tv_sec - ibus_rx_time.tv_sec);
+    if(timeout.tv_sec <= 0) {
+        /*TODO: shutdown the system*/
+        TRACE(TRACE_ALL,"10min without messages on the bus => shutdown");
+        exit_request = 1;
+        return;
+    }
+    if(event_timer_set(source->fd, &timeout, 0) < 0)
+        TRACE_ERROR("Can't set idle timer");
+}
 
-		printf("button %s",headunit_buttons[data].name);
+static void on_stats_timeout(struct event_source *source, uint32_t events)
+{
+    if(event_timer_expired(source->fd))
+        print_stats(-1);
+}
 
-		if(release)
-			printf(" released");
-		else if(longPress)
-			printf(" pressed long");
-		else
-			printf(" pressed");
-        addData = 0;
-        }
-    else if(get_message()==KNOB && get_data_length()==1)
-        {
-    	data = get_data_byte(0);
-        if(data & ButtonMenuKnobClockwiseMask)
-			{
-			printf("Menu knob turned clockwise ");
-			data &= ~ButtonMenuKnobClockwiseMask;
-			}
-		else
-			{
-			printf("Menu knob turned counter clockwise ");
-			}
+static void on_signal(struct event_source *source, uint32_t events)
+{
+    struct signalfd_siginfo info;
+    unsigned int line;
 
-		printf("%d time(s)",data);
-        addData = 0;
+    while(read(source->fd, &info, sizeof(info)) == sizeof(info)) {
+        if(info.ssi_signo == SIGUSR1) {
+            dump_stats();
         }
-    else
-        printf("%s",IBUSMessages[get_message()]);
-
-    printf(" TO ");
-    printf("%s",IBUSDevices[get_receiver()]);
-
-    idx = 0;
-    if(addData && dataLen > 0){
-        printf(" DATA:");
-        if(get_sender()==RAD && get_receiver()==BMBT && (get_message()==CC || get_message()==CS) ) {
-            do{
-                printf(" 0x%02x",ibus_data[EPosDataStart+idx]);
-                idx++;
-            } while(idx < dataLen);
+        else if(info.ssi_signo == SIGHUP) {
+            ibus_keymap_reload(&line);
         }
-        else{
-            do{
-                if(ibus_data[EPosDataStart+idx] < 0x20 || ibus_data[EPosDataStart+idx] > 0x7F)
-                    printf("0x%02x ",ibus_data[EPosDataStart+idx]);
-                else
-                    printf("%c",ibus_data[EPosDataStart+idx]);
-                idx++;
-            } while(idx < dataLen);
+        else {
+            TRACE(1, "User requested EXIT\n");
+            exit_request = 1;
         }
     }
-    printf("\n");
-    }
+}
 
-static void handle_headunit_state()
+/* editors replace the file instead of writing it, so the directory is watched */
+static void on_keymap_changed(struct event_source *source, uint32_t events)
 {
-    TRACE_ENTRY(TRACE_FUNCTION);
-
-    if(get_sender()==RAD && get_receiver()==GT) {
-        if(get_message()==UMID) {
-            if(get_data_byte(0)==0x62 ) { /*layout RadioDisplay*/
-                if(data_contains("AUX")) {
-                    ibus_change_state(EStateAUX);
-                } else if(data_contains("TAPE")) { /*TODO: TAPE state could be checked from mode button also so that display could be switched before TAPE is shown in screen*/
-                    ibus_change_state(EStateTAPE);
-                }
-            }
-        }else if(get_message()==ST){
-            if(get_data_byte(0)==0x62 ) { /*layout RadioDisplay*/
-                if(data_contains("RDS") || data_contains("FM") || data_contains("REG") || data_contains("MWA")) {
-                    ibus_change_state(EStateFM);
-                }
-            }
-        }else if(get_message()==LCDC) {
-            if(get_data_length()==1) {
-                switch(get_data_byte(0)) { /*menu brought foreground, state stays,*/
-                    case 0x01: /*No Display Required*/
-                    case 0x02: /*Radio Display Off*/
-                        {
-                        ibus_change_state(EStateMenu);
-                        break;
-                        }
-                    default:
-                        {
-                        /*TRACE_WARGS(TRACE_IBUS,"LCD Clear, data: %02x\n",get_data_byte(0));*/
-                        break;
-                        }
-                    }
-            }
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    const char *name = strrchr(keymap_path, '/');
+    unsigned int line;
+    ssize_t length,pos;
+    int changed = 0;
+
+    name = name ? name+1 : keymap_path;
+    while((length = read(source->fd, buffer, sizeof(buffer))) > 0) {
+        for(pos = 0; pos < length; pos += sizeof(*event) + event->len) {
+            event = (const struct inotify_event*)&buffer[pos];
+            if(event->len && strcmp(event->name, name)==0)
+                changed = 1;
         }
     }
+    if(changed)
+        ibus_keymap_reload(&line);
+}
 
-    TRACE_EXIT(TRACE_FUNCTION);
-    return;
+static int keymap_watch_open()
+{
+    char dir[PATH_MAX];
+    const char *name = strrchr(keymap_path, '/');
+    int fd;
+
+    if(!name)
+        strcpy(dir, ".");
+    else if(name == keymap_path)
+        strcpy(dir, "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(name - keymap_path), keymap_path);
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0)
+        return -errno;
+    if(inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(fd);
+        return -errno;
+    }
+    return fd;
 }
 
-/*
- * Processes the IBus message. If message is invalid, its silently discarded and next message is read
- */
-static void process_ibus_message()
+static void close_event_sources()
 {
-    unsigned int checksum_index;
-    unsigned char databyte;
-    unsigned int cur_mes_len = 0;
-    TRACE_ENTRY(TRACE_FUNCTION);
+    struct event_source *sources[] = { &ibus_idle_timer, &stats_timer, &button_timer, &knob_timer, &predict_timer, &keymap_watch, &signal_source };
+    unsigned int i;
 
-    do{
-    	cur_mes_len = get_message_length();
+    for(i = 0; i < sizeof(sources)/sizeof(sources[0]); i++) {
+        if(sources[i]->fd >= 0)
+            close(sources[i]->fd);
+        sources[i]->fd = -1;
+    }
+    for(i = 0; i < ibus_bus_count; i++) {
+        if(ibus_buses[i].frame_timer.fd >= 0)
+            close(ibus_buses[i].frame_timer.fd);
+        if(ibus_buses[i].tx_timer.fd >= 0)
+            close(ibus_buses[i].tx_timer.fd);
+        ibus_buses[i].frame_timer.fd = ibus_buses[i].tx_timer.fd = -1;
+    }
+    event_close();
+}
 
-		/* 1. Validate the IBUS message */
-		if(ibus_data_index < EMinimumMessageLength ||
-		   ibus_data_index < cur_mes_len) {
-			TRACE_WARGS(TRACE_IBUS,"Invalid message length!! %d\n",ibus_data_index);
-			goto err;
-		}
+/*
+ * Registers serial lines, timers and signals to the event loop.
+ */
+static int open_event_sources(const sigset_t *signals)
+{
+    struct ibus_bus *bus;
+    struct timespec timeout = { 0, 0 };
+    unsigned int i;
+    int res;
 
-		/* 2. Validate the IBUS message checksum */
-		/*checksum is located at the last byte of message*/
-		checksum_index = cur_mes_len - 1;
-		if(calc_ibus_checksum(checksum_index) != ibus_data[checksum_index]){
-			TRACE_WARGS(TRACE_IBUS,"Invalid checksum!! %x\n",ibus_data[checksum_index]);
-			goto err;
-		}
+    ibus_idle_timer.fd = stats_timer.fd = button_timer.fd = knob_timer.fd = predict_timer.fd = keymap_watch.fd = signal_source.fd = -1;
+    if((res = event_init()) < 0)
+        goto err;
 
-		/* 3. print valid message if trace enabled*/
-		if(trace_level&TRACE_IBUS)
-			print_ibus_message();
-
-		/* 4. Handle the buttons messages */
-		if(get_sender()==BMBT) {
-			if(get_message()==BMBTB1) {
-				databyte = get_data_byte(0);
-				unsigned char longPress = 0;
-				unsigned char released = 0;
-				if(databyte & ButtonLongPress) {
-					databyte &= ~ButtonLongPress;
-					longPress = 1;
-				}
-				else if(databyte & ButtonRelease) {
-					databyte &= ~ButtonRelease;
-					released = 1;
-				}
-
-				if(databyte==ButtonRadioPower){
-					ibus_change_state(EStatePowerOff);
-				}
-
-				handle_ibus_button(databyte,released,longPress);
-			}
-			else if(get_message()==BMBTB0) {
-				/*button command for select is in second byte of data*/
-				databyte = get_data_byte(1);
-
-				unsigned char longPress = 0;
-				unsigned char released = 0;
-				if(databyte & ButtonLongPress) {
-					databyte &= ~ButtonLongPress;
-					longPress = 1;
-				}
-				else if(databyte & ButtonRelease) {
-					databyte &= ~ButtonRelease;
-					released = 1;
-				}
-
-				if(databyte == ButtonSelectInTapeMode) {
-					handle_ibus_button(SelectInTapeMode,released,longPress);
-				}
-				else{
-					printf("0x%02x, longPress %d, released %d\n",databyte,longPress,released);
-				}
-			}
-			else if(get_message()==KNOB) {
-				databyte = get_data_byte(0);
-				int clockwise = 0;
-				if(databyte & ButtonMenuKnobClockwiseMask) {
-					databyte &= ~ButtonMenuKnobClockwiseMask;
-					clockwise = 1;
-				}
-
-				/*databyte tells how many times need to send this command*/
-				while(databyte) {
-					send_key_event(headunit_buttons[clockwise?MenuKnobClockwiseMask:MenuKnobCounterClockwiseMask].key_code,1);
-					send_key_event(headunit_buttons[clockwise?MenuKnobClockwiseMask:MenuKnobCounterClockwiseMask].key_code,0);
-					databyte--;
-				}
-			}
-			else if(get_message()==MFLB) {
-				databyte = get_data_byte(0);
-				/*TODO: to volume function*/
-				/*volume*/
-				unsigned char steps = (databyte&0xF0)>>4;
-				if(databyte&0xF){ /*volume up*/
-					printf("volue up %d steps\n",steps);
-				} else { /*volume down*/
-					printf("volue down %d steps\n",steps);
-				}
-			}
-		}
-		else if(get_sender()==MFL && get_receiver()==RAD) {
-			databyte = get_data_byte(0);
-			if(get_message()==MFLB){
-				/*TODO: to volume function*/
-				/*volume*/
-				unsigned char steps = (databyte&0xF0)>>4;
-				if(databyte&0xF){ /*volume up*/
-					printf("volue up %d steps\n",steps);
-				} else { /*volume down*/
-					printf("volue down %d steps\n",steps);
-				}
-			}
-			else if(get_message()==MFLB2){
-				/*channel*/
-				unsigned char released = 0;
-				if(databyte & MFL2ButtonRelease) {
-					databyte &= ~MFL2ButtonRelease;
-					released = 1;
-				}
-				if(databyte & MFL2ButtonChannelUp){
-					handle_ibus_button(MFL2ChannelUp,released,0);
-				} else if(databyte & MFL2ButtonChannelDown){
-					handle_ibus_button(MFL2ChannelDown,released,0);
-				}
-
-				/*TODO: handle answer buttons and other mfl buttons*/
-			}
+    for(i = 0; i < ibus_bus_count; i++) {
+        bus = &ibus_buses[i];
+        if((res = event_add(&bus->serial_source, bus->fd, 1, on_ibus_readable, bus)) < 0)
+            goto err;
+        if((res = event_timer_create()) < 0 ||
+           (res = event_add(&bus->frame_timer, res, 1, on_frame_timeout, bus)) < 0)
+            goto err;
+        bus->frame_timer_armed = 0;
+        if(bus->type != EBusDBus &&
+           ((res = event_timer_create()) < 0 ||
+            (res = event_add(&bus->tx_timer, res, 1, on_tx_timeout, bus)) < 0))
+            goto err;
+    }
 
-		}
+    if((res = event_timer_create()) < 0 ||
+       (res = event_add(&ibus_idle_timer, res, 0, on_idle_timeout, 0)) < 0)
+        goto err;
+    timeout.tv_sec = IBUS_IDLE_SHUTDOWN;
+    if((res = event_timer_set(ibus_idle_timer.fd, &timeout, 0)) < 0)
+        goto err;
 
-		/* 5. Handle the state messages */
-		/*handle state only if hijack state is given*/
-		if(IbusHijackState != EStateUnknown)
-			handle_headunit_state();
-
-		/*move data in ibus_data so that first message at the beginning is cleared*/
-		if(ibus_data_index >= cur_mes_len){
-			/* Discard the first message in the buffer by
-			 * 1. Moving data from the end to the start
-			 * 2. Adjust ibus_Data_index
-			 * 3. Clear end of the buffer */
-			memmove(&ibus_data[0],&ibus_data[cur_mes_len],(ibus_data_index-cur_mes_len));
-			ibus_data_index = ibus_data_index - cur_mes_len;
-			memset(&ibus_data[ibus_data_index],0,cur_mes_len);
-		}
-    }while(ibus_data_index);
+    /*button repeats are input, same priority as the lines*/
+    if((res = event_timer_create()) < 0 ||
+       (res = event_add(&button_timer, res, 1, on_button_timeout, 0)) < 0)
+        goto err;
+    button_wheel.armed = 0;
+    if(knob_wheel.window &&
+       ((res = event_timer_create()) < 0 ||
+        (res = event_add(&knob_timer, res, 1, on_knob_timeout, 0)) < 0))
+        goto err;
 
-    /* 6. Exit */
-    TRACE_EXIT(TRACE_FUNCTION);
-    memset(ibus_data, 0, sizeof(ibus_data));
-    ibus_data_index = 0;
-    return;
-err:
-    TRACE_EXIT_WARGS(TRACE_FUNCTION, "Invalid message %d\n", -EINVAL);
-    memset(ibus_data, 0, sizeof(ibus_data));
-    ibus_data_index = 0;
-}
+    if(CHECK_TRACELEVEL(TRACE_STATS)) {
+        if((res = event_timer_create()) < 0 ||
+           (res = event_add(&stats_timer, res, 0, on_stats_timeout, 0)) < 0)
+            goto err;
+        timeout.tv_sec = IBUS_STATS_INTERVAL;
+        if((res = event_timer_set(stats_timer.fd, &timeout, 1)) < 0)
+            goto err;
+    }
 
-#ifdef __TEST__
-static void testibusmessage(char* buf){
-    memset (ibus_data, 0, sizeof(ibus_data));
-    ibus_data_index = strlen(buf)/2;
-    int unsigned i;
-    for (i = 0; i < ibus_data_index; i++)
-        sscanf(&buf[i * 2], "%2hhx", &ibus_data[i]);
+    if(shm_ring && (res = event_add(&shm_listen_source, shm_listen_source.fd, 0, on_shm_connect, 0)) < 0)
+        goto err;
+    if(ibus_predict_enabled &&
+       ((res = event_timer_create()) < 0 ||
+        (res = event_add(&predict_timer, res, 0, on_predict_timeout, 0)) < 0))
+        goto err;
+    if(keymap_path &&
+       ((res = keymap_watch_open()) < 0 ||
+        (res = event_add(&keymap_watch, res, 0, on_keymap_changed, 0)) < 0))
+        goto err;
+    if(stats_socket_path && (res = event_add(&stats_listen_source, stats_listen_source.fd, 0, on_stats_connect, 0)) < 0)
+        goto err;
 
-    process_ibus_message();
-}
-#endif
+    res = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(res < 0) {
+        res = -errno;
+        goto err;
+    }
+    if((res = event_add(&signal_source, res, 0, on_signal, 0)) < 0)
+        goto err;
+    return 0;
 
-static void print_help(char* name)
-{
-	fprintf(stderr, "Usage: %s <options>",name);
-	fprintf(stderr, "-d serial device name (Mandatory)\n");
-	fprintf(stderr, "-h hijack mode. FM/TAPE/AUX\n");
-	fprintf(stderr, "-v video input switch. CTS/RTS/GPIO\n");
-	fprintf(stderr, "-t tracelevel mask. TRACE_FUNCTION=1<<0, TRACE_IBUS=1<<2, TRACE_INPUT=1<<4 and TRACE_STATE=1<<8\n");
-	fprintf(stderr, "-f trace file\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "example: %s -d /dev/ttyUSB0 -h AUX -v CTS -t 15 -f ~/tracefile.log \n",name);
-	fprintf(stderr, "\n");
+err:
+    close_event_sources();
+    return res;
 }
 
-/******************************************************************************
- * Main loop
- *****************************************************************************/
 int main (int argc, char *argv[])
 {
 	int opt/*,fd*/;
 	sigset_t mask;
-	sigset_t orig_mask;
 	struct sigaction act;
-    struct timespec char_timeout,shutdown_timeout;
 
-    struct termios newtio,oldtio;
-    char name[128],hijackState[10],videoinputswitch[10];
-    bzero(&name, sizeof(name));
+    char hijackState[10],videoinputswitch[10];
+    char *pattern,*device;
+    int type;
+    unsigned int i,line;
+    const char *tracefile = 0;
+    const char *capturefile = 0;
+    const char *replayfile = 0;
+    const char *gpiospec = 0;
+    const char *publishsocket = 0;
+    const char *statssocket = 0;
+    int binarytrace = 0;
+    int replaypty = 0;
+    int res;
 
     /* Handle command line arguments */
-    while ((opt = getopt(argc, argv, "d:t:f:h:v:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:t:f:h:v:p:bc:r:R:x:s:u:S:F:w:k:Pg:C")) != -1) {
         switch (opt) {
         case 'd':
-            strncpy(name,optarg,sizeof(name));
+            /*optional bus type prefix, I-Bus by default*/
+            device = strchr(optarg, '=');
+            type = EBusIBus;
+            if(device) {
+                *device++ = '\0';
+                type = ibus_bus_type_from_name(optarg);
+            }
+            else
+                device = optarg;
+            if(type < 0 || !ibus_bus_add(type, device)) {
+                fprintf(stderr, "invalid or too many serial devices %s\n",device);
+                print_help(argv[0]);
+                goto exit;
+            }
             break;
         case 'h':
             strncpy(hijackState,optarg,sizeof(hijackState));
             fprintf(stderr, "hijack state %s\n",optarg);
             if(strlen(hijackState) > 0){
-                if(strcmp(hijackState,"TAPE")==0)
-                    IbusHijackState = EStateTAPE;
-                else if(strcmp(hijackState,"AUX")==0)
-                    IbusHijackState = EStateAUX;
-                else
-                    IbusHijackState = EStateUnknown;
+                IbusHijackState = ibus_state_from_name(hijackState);
             }
             break;
         case 'v':
@@ -1640,40 +6906,206 @@ int main (int argc, char *argv[])
 					VideoInputSwitch = ESwitchUnknown;
 			}
         	break;
+        case 'p':
+            pattern = strchr(optarg, '=');
+            if(pattern) {
+                *pattern++ = '\0';
+                if(ibus_add_text_pattern(pattern, ibus_state_from_name(optarg)) < 0)
+                    pattern = 0;
+            }
+            if(!pattern) {
+                fprintf(stderr, "invalid text pattern %s\n",optarg);
+                print_help(argv[0]);
+                goto exit;
+            }
+            break;
         case 't':
             trace_level = atoi(optarg);
             break;
         case 'f':
-        	stdout_fp = freopen(optarg, "a+", stdout);
-        	if(stdout_fp < 0){
-        		TRACE_ERROR("Can't open trace file");
-        		//continue, not fatal
-        	}
+        	tracefile = optarg;
             break;
+        case 'b':
+        	binarytrace = 1;
+        	break;
+        case 'c':
+        	capturefile = optarg;
+        	break;
+        case 'r':
+        case 'R':
+        	replayfile = optarg;
+        	replaypty = opt == 'R';
+        	break;
+        case 'x':
+        	replay_speed = atof(optarg);
+        	if(replay_speed < 0) {
+        		fprintf(stderr, "invalid replay speed %s\n",optarg);
+        		print_help(argv[0]);
+        		goto exit;
+        	}
+        	break;
+        case 'u':
+        	publishsocket = optarg;
+        	break;
+        case 'S':
+        	statssocket = optarg;
+        	break;
+        case 'F':
+        	if(ibus_add_filter(optarg) < 0) {
+        		fprintf(stderr, "invalid filter %s\n",optarg);
+        		print_help(argv[0]);
+        		goto exit;
+        	}
+        	break;
+        case 'g':
+        	gpiospec = optarg;
+        	break;
+        case 'P':
+        	ibus_predict_enabled = 0;
+        	break;
+        case 'C':
+        	ibus_cdc.enabled = 1;
+        	break;
+        case 'k':
+        	keymap_path = optarg;
+        	break;
+        case 'w':
+        	if(knob_wheel_parse(optarg) < 0) {
+        		fprintf(stderr, "invalid knob wheel %s\n",optarg);
+        		print_help(argv[0]);
+        		goto exit;
+        	}
+        	break;
+        case 's':
+        	if(startup_message_count == IBUS_MAX_STARTUP_MESSAGES) {
+        		fprintf(stderr, "too many messages %s\n",optarg);
+        		print_help(argv[0]);
+        		goto exit;
+        	}
+        	startup_messages[startup_message_count++] = optarg;
+        	break;
         default: /* '?' */
         	print_help(argv[0]);
             goto exit;
         }
     }
 
+    if(tracefile) {
+    	if(binarytrace) {
+    		res = trace_binary_open(tracefile);
+    		if(res < 0) {
+    			errno = -res;
+    			TRACE_ERROR("Can't open binary trace file");
+    			//continue, not fatal
+    		}
+    	}
+    	else {
+    		stdout_fp = freopen(tracefile, "a+", stdout);
+    		if(stdout_fp < 0){
+    			TRACE_ERROR("Can't open trace file");
+    			//continue, not fatal
+    		}
+    	}
+    }
+
     TRACE_WARGS(TRACE_FUNCTION, "%s\n",__func__);
 
-    if(strlen(name)<=0){
+    if(replayfile && replaypty) {
+    	/*pseudo terminal is used as the serial device*/
+    	res = replay_pty_open(replayfile);
+    	if(res < 0) {
+    		errno = -res;
+    		TRACE_ERROR("Can't create pseudo terminal for replay");
+    		goto exit;
+    	}
+    }
+
+    if(!ibus_bus_count && !replayfile){
     	print_help(argv[0]);
     	errno = EINVAL;
     	TRACE_ERROR("No serial device provided\n");
     	goto exit;
     }
 
+    if(gpiospec) {
+    	res = video_gpio_open(gpiospec);
+    	if(res < 0) {
+    		errno = -res;
+    		TRACE_ERROR("Can't open video GPIO");
+    		goto exit;
+    	}
+    }
+    else if(VideoInputSwitch == ESwitchGPIO) {
+    	fprintf(stderr, "-v GPIO needs -g chip:line\n");
+    	print_help(argv[0]);
+    	goto exit;
+    }
+
+    if(ibus_cdc.enabled && ibus_cdc_open() < 0) {
+    	fprintf(stderr, "-C needs I-Bus or K-Bus\n");
+    	print_help(argv[0]);
+    	goto exit;
+    }
+    else if(IbusHijackState == EStateCDChanger && !ibus_cdc.enabled) {
+    	fprintf(stderr, "-h CDC needs -C\n");
+    	print_help(argv[0]);
+    	goto exit;
+    }
+
+    if(capturefile) {
+    	res = capture_open(capturefile);
+    	if(res < 0) {
+    		errno = -res;
+    		TRACE_ERROR("Can't open capture file");
+    		goto exit;
+    	}
+    }
+
+    if(publishsocket) {
+    	res = ibus_shm_open(publishsocket);
+    	if(res < 0) {
+    		errno = -res;
+    		TRACE_ERROR("Can't publish frames");
+    		goto exit;
+    	}
+    }
+
+    if(statssocket) {
+    	res = ibus_stats_open(statssocket);
+    	if(res < 0) {
+    		errno = -res;
+    		TRACE_ERROR("Can't create stats socket");
+    		goto exit;
+    	}
+    }
+
+    ibus_init_known_devices();
+    if(ibus_build_text_matcher() < 0) {
+    	TRACE_ERROR("Can't build text matcher");
+    	goto exit;
+    }
+    ibus_register_default_handlers();
+    ibus_build_filter();
+
+    if(keymap_path) {
+    	res = ibus_keymap_reload(&line);
+    	if(res < 0) {
+    		fprintf(stderr, "invalid keymap %s line %u: %s\n",keymap_path,line,strerror(-res));
+    		goto exit;
+    	}
+    }
+
     /* Open uinput device */
     uinput_device_fd = uinput_create();
     if(uinput_device_fd < 0){
     	TRACE_ERROR("Can't create uinput device");
-        goto exit;
+    	if(!replayfile)
+    		goto exit;
+    	/*replay works without uinput, key events are only traced*/
     }
 
-    /* set signal handlers and block them temporarily to avoid
-     * race conditions before pselect */
+    /* signal handlers are used only by direct replay. Main loop blocks the
+     * signals and reads them from signalfd */
     sigemptyset (&mask);
 
 	memset (&act, 0, sizeof(act));
@@ -1692,126 +7124,106 @@ int main (int argc, char *argv[])
 	}
 	sigaddset (&mask, SIGINT);
 
-	if (sigprocmask(SIG_BLOCK, &mask, &orig_mask) < 0) {
-		TRACE_ERROR ("sigprocmask SIG_BLOCK");
+	memset (&act, 0, sizeof(act));
+	act.sa_handler = signal_handler;
+	if (sigaction(SIGUSR1, &act, 0)) {
+		TRACE_ERROR ("sigaction SIGUSR1");
 		goto uinput_close;
 	}
-
-    /* Open IBUS serial line */
-	ibus_device_fd = open(name, O_RDONLY |  /*we want only read IBUS*/
-                                O_NOCTTY |  /*no controlling*/
-                                O_NONBLOCK);
-	if (ibus_device_fd < 0) {
-		TRACE_ERROR("Can't open ibus device");
-        goto uinput_close;
+	sigaddset (&mask, SIGUSR1);
+
+	/*SIGHUP reloads the keymap*/
+	if(keymap_path)
+		sigaddset (&mask, SIGHUP);
+
+	if(replayfile && !replaypty) {
+		/*no serial line, parser is fed directly from the capture*/
+		ibus_change_state(EStateUnknown);
+		res = replay_capture(replayfile);
+		if(res < 0) {
+			errno = -res;
+			TRACE_ERROR("Can't replay capture");
+		}
+		print_stats(-1);
+		goto uinput_close;
 	}
 
-	/* save current serial port settings */
-    if (tcgetattr(ibus_device_fd, &oldtio) < 0) {
-    	TRACE_ERROR("Can't get current port settings");
+	if (sigprocmask(SIG_BLOCK, &mask, 0) < 0) {
+		TRACE_ERROR ("sigprocmask SIG_BLOCK");
 		goto uinput_close;
 	}
 
-    /*set line*/
-	bzero(&newtio, sizeof(newtio)); /* clear struct for new port settings */
-    newtio.c_cflag =    B9600 | /*9600 baud*/
-                        CS8 | /*8 bits.*/
-                        PARENB | /*Parity enable.*/
-                        CLOCAL | /*Ignore modem status lines.*/
-                        CREAD; /*Enable receiver.*/
-    newtio.c_iflag = IGNPAR | IGNBRK; /*Ignore characters with parity errors., Ignore break condition.*/
-    newtio.c_oflag = 0;
-    newtio.c_lflag = 0;
-    newtio.c_cc[VMIN]=1; /*read one byte at the time. TODO: try vmin =max and VTIME=0.2*/
-    newtio.c_cc[VTIME]=0;
-    if(tcflush(ibus_device_fd, TCIFLUSH) < 0){
-    	TRACE_ERROR("tcflush");
-    	goto uinput_close;
-    }
-    if(tcsetattr(ibus_device_fd,TCSANOW,&newtio) < 0){
-    	TRACE_ERROR("tcsetattr");
-    	goto uinput_close;
+    /* Open serial lines */
+    for(i = 0; i < ibus_bus_count; i++) {
+    	if(ibus_bus_open(&ibus_buses[i]) < 0)
+    		goto close;
     }
 
-    /* Set timeout value within input loop */
-    /* 9600baud = 9600 bits per second*/
-    /* 1 start bit, 8 data bits,1 stop bit, even parity = 11 bit = 1 char*/
-    /* 11 bits x 1sec/9600 = 1,15ms/char*/
-    char_timeout.tv_nsec = 2*1150000L;
-    char_timeout.tv_sec  = 0;  /* seconds*/
-
-    /* Shutdown timeout */
-    shutdown_timeout.tv_nsec = 0;
-    shutdown_timeout.tv_sec = 60*10;
+    if(replaypty) {
+    	res = replay_pty_start();
+    	if(res < 0) {
+    		errno = -res;
+    		TRACE_ERROR("Can't start replay");
+    		goto close;
+    	}
+    }
 
     /* set ibus state to unknown => video input disabled, key events disabled */
     ibus_change_state(EStateUnknown);
 
-	memset (ibus_data, 0, sizeof(ibus_data));
-    ibus_data_index = 0;
-
-	while (!exit_request) {
-        fd_set fds;
-        int res;
-
-		FD_ZERO (&fds);
-		FD_SET (ibus_device_fd, &fds);
+	for(i = 0; i < ibus_bus_count; i++)
+		ibus_bus_reset(&ibus_buses[i]);
+	ibus_rx_time = ibus_buses[0].rx_time;
 
-        if(ibus_data_index) /*if transfer ongoing, then use timeout to know when ibus message is ready*/
-            res = pselect (ibus_device_fd + 1, &fds, NULL, NULL, &char_timeout, &orig_mask);
-        else
-            res = pselect (ibus_device_fd + 1, &fds, NULL, NULL, &shutdown_timeout, &orig_mask);
+	res = open_event_sources(&mask);
+	if(res < 0) {
+		errno = -res;
+		TRACE_ERROR("Can't create event loop");
+		goto close;
+	}
 
-		if (res < 0 && errno != EINTR) {
-            TRACE_WARGS(1, "pselect returned %d\n",res);
-			break;
+	if(ibus_cdc.enabled) {
+		res = ibus_cdc_announce();
+		if(res < 0) {
+			errno = -res;
+			TRACE_ERROR("Can't announce CD changer");
 		}
+	}
 
-		else if (exit_request) {
-            TRACE(1, "User requested EXIT\n");
-			break;
+	for(i = 0; i < startup_message_count; i++) {
+		res = ibus_send_hex(startup_messages[i]);
+		if(res < 0) {
+			errno = -res;
+			TRACE_ERROR("Can't send message");
 		}
-		else if (res == 0) {
-			if(ibus_data_index){
-				/*timeout occured => ibus message ready*/
-				process_ibus_message();
-				continue;
-			}else{
-				/*TODO: shutdown the system*/
-				TRACE(TRACE_ALL,"10min without messages on the bus => shutdown");
-				break;
-			}
-        }
+	}
 
-		if (FD_ISSET(ibus_device_fd, &fds)) {
-            unsigned char data[5];
-            res = read(ibus_device_fd,data,1);
-            if(res == 1){
-            	ibus_data[ibus_data_index++] = data[0];
-            	if(ibus_data_index==ibus_data_max_length){
-            		TRACE_ERROR("BUFFER FULL!! ");
-            		//Flush the buffer and continue
-            		//TODO: maybe the buffer could be processed before flushing
-            		memset(ibus_data, 0, sizeof(ibus_data));
-            		ibus_data_index = 0;
-            		continue;
-            	}
-            }
-            else {
-            	TRACE_WARGS(1, "WARNING!!! read returned %d\n",res);
-            }
+	while (!exit_request) {
+		res = event_dispatch();
+		if (res < 0) {
+			errno = -res;
+			TRACE_ERROR("epoll_wait");
+			break;
 		}
+		service_buses();
 	}
 
-	if(tcsetattr(ibus_device_fd,TCSANOW,&oldtio) < 0){
-		/*Ignore error as we are exiting*/
-	}
-	if(close(ibus_device_fd) < 0){
-		/*Ignore error as we are exiting*/
-	}
+	close_event_sources();
+	print_stats(-1);
+
+close:
+	for(i = 0; i < ibus_bus_count; i++)
+		ibus_bus_close(&ibus_buses[i]);
 uinput_close:
     uinput_close();
 exit:
+	replay_pty_close();
+	video_gpio_close();
+	ibus_shm_close();
+	ibus_stats_close();
+	capture_close();
+	trace_binary_close();
 	if(stdout_fp) fflush(stdout_fp);
 	return 0;
 }
+#endif /*IBUS_NO_MAIN*/